@@ -0,0 +1,8 @@
+# Builds the native benchmark with the configuration of the extension, used along with its Makefile:
+#   make -f Makefile -f bench.mk json_scanner_bench
+# see `rake bench:native`. The benchmark includes json_scanner.c and links the system yajl from LIBS
+BENCH_SRC = $(srcdir)/../../bench/json_scanner_bench.c
+
+json_scanner_bench: $(BENCH_SRC) $(srcdir)/json_scanner.c $(srcdir)/json_scanner.h
+	$(ECHO) linking $@
+	$(Q) $(CC) $(INCFLAGS) $(CPPFLAGS) $(CFLAGS) -o $@ $(BENCH_SRC) $(LIBPATH) $(ldflags) $(LIBS)
@@ -0,0 +1,99 @@
+# frozen_string_literal: true
+
+# Writes the corpus of the native benchmark into the given directory, tmp/bench by default.
+# The documents and selectors are the same on every run, so results of different commits can be compared.
+# manifest.txt lists a document per line: name, file and whether it's newline delimited,
+# <name>.<n>.paths are the selectors of n JSONPath expressions, one per line
+require "json"
+require "fileutils"
+
+module JsonScannerBench
+  # Documents of different shapes and selectors for them
+  module Corpus
+    SEED = 20_240_601
+    SELECTOR_SIZES = [1, 100, 2000].freeze
+    WORDS = %w[alpha beta gamma delta id name value items data meta tags user price total].freeze
+
+    module_function
+
+    def generate(dir, rng = Random.new(SEED))
+      FileUtils.mkdir_p(dir)
+      manifest = documents(rng).map do |name, ext, ndjson, text, paths|
+        File.write(File.join(dir, "#{name}.#{ext}"), text)
+        SELECTOR_SIZES.each do |size|
+          File.write(File.join(dir, "#{name}.#{size}.paths"), "#{selector(paths, size, rng).join("\n")}\n")
+        end
+        "#{name} #{name}.#{ext} #{ndjson ? 1 : 0}"
+      end
+      File.write(File.join(dir, "manifest.txt"), "#{manifest.join("\n")}\n")
+    end
+
+    # [name, extension, newline delimited, text, paths matching something]
+    def documents(rng)
+      [
+        ["deep", "json", false, JSON.generate(Array.new(64) { |i| deep(i, 400) }, max_nesting: false),
+         ["$[*]#{".a[0]" * 200}.id", "$..id", "$[3].a[0].a[0].a"]],
+        ["wide", "json", false, JSON.generate(wide(rng)),
+         ["$.items[*].id", "$.numbers[100:200]", "$.items[*].tags[0]", "$.meta.total"]],
+        ["strings", "json", false, JSON.generate({ "texts" => Array.new(2000) { string(rng) } }),
+         ["$.texts[*]", "$.texts[0]"]],
+        ["records", "ndjson", true, Array.new(50_000) { |i| JSON.generate(record(i, rng)) }.join("\n"),
+         ["$.level", "$.ctx.user", "$.tags[*]"]],
+        ["graphql", "json", false, File.read(File.expand_path("../spec/graphql_response.json", __dir__)),
+         ["$.data.search.searchResult.paginationV2.maxPage", "$..id"]],
+      ]
+    end
+
+    # Objects and arrays nested depth levels deep
+    def deep(id, depth)
+      (depth - 1).downto(0).reduce({ "id" => id, "v" => "x" * 8 }) do |inner, level|
+        level.even? ? { "a" => inner } : [inner]
+      end
+    end
+
+    def wide(rng)
+      items = Array.new(100_000) do |i|
+        {
+          "id" => i, "price" => rng.rand(10_000) / 100.0, "ok" => rng.rand(2).zero?,
+          "tags" => WORDS.sample(3, random: rng),
+        }
+      end
+      { "items" => items, "numbers" => Array.new(200_000) { rng.rand(1 << 40) }, "meta" => { "total" => items.size } }
+    end
+
+    # Long strings with escapes and multibyte characters
+    def string(rng)
+      Array.new(rng.rand(8..1024)) do
+        case rng.rand(16)
+        when 0 then "\n"
+        when 1 then "\"quoted\""
+        when 2 then "é中"
+        when 3 then "\u0001"
+        else WORDS.sample(random: rng)
+        end
+      end.join(" ")
+    end
+
+    def record(id, rng)
+      {
+        "ts" => 1_700_000_000 + id, "level" => %w[debug info warn error].sample(random: rng),
+        "msg" => Array.new(rng.rand(4..16)) { WORDS.sample(random: rng) }.join(" "),
+        "ctx" => { "user" => rng.rand(1000), "req" => format("%016x", rng.rand(1 << 64)) },
+        "tags" => WORDS.sample(rng.rand(0..4), random: rng),
+      }
+    end
+
+    # The paths matching something first, then ones sharing their prefixes which match nothing
+    def selector(paths, size, rng)
+      res = paths.first(size)
+      (size - res.size).times do |i|
+        path = paths.sample(random: rng)
+        cut = path.enum_for(:scan, /[.\[]/).map { Regexp.last_match.begin(0) }.reject(&:zero?).sample(random: rng)
+        res << "#{cut ? path[0, cut] : "$"}.#{WORDS.sample(random: rng)}_#{i}"
+      end
+      res
+    end
+  end
+end
+
+JsonScannerBench::Corpus.generate(ARGV[0] || File.expand_path("../tmp/bench", __dir__)) if $PROGRAM_NAME == __FILE__
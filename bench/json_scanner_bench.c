@@ -0,0 +1,398 @@
+// Native benchmark of the scan core, built with the configuration of the extension by `rake bench:native`.
+// Drives the functions JsonScanner.scan is made of directly, so the cost of every stage is measured apart:
+// lex - yajl with callbacks counting tokens only, scan - matching paths and saving matches into native buffers,
+// results - turning the buffers into Ruby objects. Prints JSON, see bench/corpus.rb for the corpus
+#include "json_scanner.c"
+
+#include <ruby/version.h>
+#include <stdio.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#define BENCH_NAME_MAX 64
+#define BENCH_MAX_ITERATIONS 10000
+#define BENCH_MIN_ITERATIONS 3
+
+static const int bench_selector_sizes[] = {1, 100, 2000};
+static const char *const bench_engines[] = {"yajl", "simd"};
+
+typedef struct
+{
+  // -1 if hardware counters aren't available
+  int cycles_fd;
+  int instructions_fd;
+} bench_perf;
+
+// Totals of the iterations of a stage
+typedef struct
+{
+  uint64_t *ns;
+  long iterations;
+  uint64_t cycles;
+  uint64_t instructions;
+} bench_stage;
+
+typedef struct
+{
+  const char *dir;
+  double min_seconds;
+  bench_perf perf;
+  // keeps the texts and selectors from the GC
+  VALUE refs;
+  int first_case;
+} bench_run;
+
+static int bench_perf_open(uint64_t config)
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static uint64_t bench_perf_read(int fd)
+{
+  uint64_t value = 0;
+  if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+    return 0;
+  return value;
+}
+
+// The kernels of the SIMD engine compiled in, or picked at load time
+static const char *bench_simd_kernels(void)
+{
+#ifdef SIMD_AVX2_DISPATCH
+  return simd_avx2 ? "avx2" : "sse2";
+#elif defined(__GNUC__) && defined(__AVX2__)
+  return "avx2";
+#elif defined(__GNUC__) && defined(__SSE2__)
+  return "sse2";
+#elif defined(__GNUC__) && defined(__ARM_NEON) && defined(__aarch64__)
+  return "neon";
+#else
+  return "scalar";
+#endif
+}
+
+static uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Counters at the start of a measurement
+typedef struct
+{
+  uint64_t ns;
+  uint64_t cycles;
+  uint64_t instructions;
+} bench_mark;
+
+static bench_mark bench_start(bench_perf *perf)
+{
+  bench_mark mark;
+  mark.cycles = bench_perf_read(perf->cycles_fd);
+  mark.instructions = bench_perf_read(perf->instructions_fd);
+  mark.ns = bench_now_ns();
+  return mark;
+}
+
+static void bench_stop(bench_perf *perf, bench_mark mark, bench_stage *stage)
+{
+  uint64_t ns = bench_now_ns() - mark.ns;
+  stage->cycles += bench_perf_read(perf->cycles_fd) - mark.cycles;
+  stage->instructions += bench_perf_read(perf->instructions_fd) - mark.instructions;
+  stage->ns[stage->iterations++] = ns;
+}
+
+static void bench_stage_init(bench_stage *stage)
+{
+  memset(stage, 0, sizeof(bench_stage));
+  stage->ns = ruby_xmalloc2(BENCH_MAX_ITERATIONS, sizeof(uint64_t));
+}
+
+static int bench_cmp_ns(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int bench_stage_done(bench_stage *stage, uint64_t started_ns, double min_seconds)
+{
+  if (stage->iterations < BENCH_MIN_ITERATIONS)
+    return false;
+  return stage->iterations >= BENCH_MAX_ITERATIONS || (double)(bench_now_ns() - started_ns) / 1e9 >= min_seconds;
+}
+
+// Prints the median time of an iteration and the average counters, frees the stage
+static void bench_stage_print(const char *name, bench_stage *stage, bench_perf *perf, size_t bytes, size_t tokens)
+{
+  double ns;
+  qsort(stage->ns, stage->iterations, sizeof(uint64_t), bench_cmp_ns);
+  ns = (double)stage->ns[stage->iterations / 2];
+  printf("\"%s\": {\"iterations\": %ld, \"ns\": %.0f, \"mb_s\": %.2f, \"ns_per_token\": %.3f", name, stage->iterations,
+         ns, ns > 0 ? (double)bytes * 1e3 / ns : 0.0, tokens > 0 ? ns / (double)tokens : 0.0);
+  if (perf->cycles_fd >= 0)
+    printf(", \"cycles\": %.0f", (double)stage->cycles / (double)stage->iterations);
+  else
+    printf(", \"cycles\": null");
+  if (perf->instructions_fd >= 0)
+    printf(", \"instructions\": %.0f}", (double)stage->instructions / (double)stage->iterations);
+  else
+    printf(", \"instructions\": null}");
+  ruby_xfree(stage->ns);
+}
+
+static VALUE bench_read_file(bench_run *run, const char *name)
+{
+  char path[PATH_MAX];
+  VALUE str;
+  snprintf(path, sizeof(path), "%s/%s", run->dir, name);
+  str = rb_funcall(rb_cFile, rb_intern("binread"), 1, rb_str_new_cstr(path));
+  rb_ary_push(run->refs, str);
+  return rb_obj_freeze(str);
+}
+
+static int bench_count_null(void *ctx)
+{
+  (*(size_t *)ctx)++;
+  return true;
+}
+
+static int bench_count_boolean(void *ctx, int value)
+{
+  return bench_count_null(ctx);
+}
+
+static int bench_count_number(void *ctx, const char *value, size_t len)
+{
+  return bench_count_null(ctx);
+}
+
+static int bench_count_string(void *ctx, const unsigned char *value, size_t len)
+{
+  return bench_count_null(ctx);
+}
+
+static yajl_callbacks bench_count_callbacks = {
+    bench_count_null,
+    bench_count_boolean,
+    NULL,
+    NULL,
+    bench_count_number,
+    bench_count_string,
+    bench_count_null,
+    bench_count_string,
+    bench_count_null,
+    bench_count_null,
+    bench_count_null,
+};
+
+// Tokens are the callbacks yajl makes: scalars, keys, beginnings and ends of containers
+static size_t bench_lex(VALUE json_str, int multiple_values)
+{
+  size_t tokens = 0;
+  yajl_status stat;
+  yajl_handle handle = yajl_alloc(&bench_count_callbacks, NULL, &tokens);
+  if (handle == NULL)
+    rb_memerror();
+  yajl_config(handle, yajl_allow_multiple_values, multiple_values);
+  stat = yajl_parse(handle, (const unsigned char *)RSTRING_PTR(json_str), (size_t)RSTRING_LEN(json_str));
+  if (stat == yajl_status_ok)
+    stat = yajl_complete_parse(handle);
+  yajl_free(handle);
+  if (stat != yajl_status_ok)
+    rb_raise(rb_eJsonScannerParseError, "can't lex the corpus");
+  return tokens;
+}
+
+// Same steps as scan_text, without releasing the GVL and splitting newline delimited values
+static void bench_scan(bench_run *run, scan_ctx *selector, scan_options *options, VALUE json_str, bench_stage *scan,
+                       bench_stage *results)
+{
+  scan_ctx ctx;
+  scan_text_args args;
+  bench_mark mark;
+  volatile VALUE points_list;
+
+  scan_ctx_init_shared(&ctx, selector);
+  scan_ctx_take_scratch(&ctx);
+  points_list = scan_points_list_new(ctx.paths_len, options);
+  scan_ctx_reset_with_options(&ctx, points_list, Qundef, options);
+  memset(&args, 0, sizeof(args));
+  args.options = options;
+  args.json_text = RSTRING_PTR(json_str);
+  args.json_text_len = (size_t)RSTRING_LEN(json_str);
+  args.ctx = &ctx;
+
+  mark = bench_start(&run->perf);
+  scan_text_parse(&args);
+  bench_stop(&run->perf, mark, scan);
+  if (ctx.nomem)
+    rb_memerror();
+  if (args.stat != yajl_status_ok && args.stat != yajl_status_client_canceled)
+    rb_exc_raise(scan_ctx_parse_error(&ctx, true, args.error_text, args.error_text_len));
+
+  mark = bench_start(&run->perf);
+  scan_ctx_save_results(&ctx);
+  bench_stop(&run->perf, mark, results);
+
+  if (ctx.handle)
+    scan_ctx_free_handle(&ctx);
+  scan_ctx_return_scratch(&ctx);
+  scan_ctx_free(&ctx);
+  RB_GC_GUARD(points_list);
+}
+
+static size_t bench_gc_allocated(void)
+{
+  return rb_gc_stat(ID2SYM(rb_intern("total_allocated_objects")));
+}
+
+static void bench_case(bench_run *run, const char *name, VALUE json_str, size_t tokens, int multiple_values,
+                       int paths, const char *engine)
+{
+  char file[BENCH_NAME_MAX + 32];
+  VALUE exprs, selector, rb_options;
+  scan_ctx *selector_ctx;
+  scan_options options;
+  scan_scratch_t *scratch = thread_scratch_get();
+  bench_stage scan, results;
+  size_t yajl_allocs, mallocs, objects;
+  uint64_t started_ns;
+  size_t bytes = (size_t)RSTRING_LEN(json_str);
+
+  snprintf(file, sizeof(file), "%s.%d.paths", name, paths);
+  exprs = rb_funcall(bench_read_file(run, file), rb_intern("split"), 1, rb_str_new_cstr("\n"));
+  selector = rb_funcall(rb_cJsonScannerSelector, rb_intern("compile"), 1, exprs);
+  rb_ary_push(run->refs, selector);
+  TypedData_Get_Struct(selector, scan_ctx, &selector_type, selector_ctx);
+  rb_options = rb_hash_new();
+  rb_hash_aset(rb_options, ID2SYM(rb_intern("engine")), ID2SYM(rb_intern(engine)));
+  rb_hash_aset(rb_options, ID2SYM(rb_intern("allow_multiple_values")), multiple_values ? Qtrue : Qfalse);
+  scan_options_get(&options, rb_options);
+
+  bench_stage_init(&scan);
+  bench_stage_init(&results);
+  // warm up the scratch of the thread, so allocations of the timed iterations are the steady ones
+  bench_scan(run, selector_ctx, &options, json_str, &scan, &results);
+  scan.iterations = results.iterations = 0;
+  scan.cycles = scan.instructions = results.cycles = results.instructions = 0;
+  yajl_allocs = scratch->yajl_allocs;
+  mallocs = scratch->mallocs;
+  objects = bench_gc_allocated();
+  started_ns = bench_now_ns();
+  do
+    bench_scan(run, selector_ctx, &options, json_str, &scan, &results);
+  while (!bench_stage_done(&scan, started_ns, run->min_seconds));
+
+  printf("%s\n    {\"corpus\": \"%s\", \"paths\": %d, \"engine\": \"%s\", \"bytes\": %zu, \"tokens\": %zu,\n     ",
+         run->first_case ? "" : ",", name, paths, engine, bytes, tokens);
+  run->first_case = false;
+  printf("\"allocations\": {\"yajl_allocs\": %.1f, \"mallocs\": %.1f, \"ruby_objects\": %.1f},\n     ",
+         (double)(scratch->yajl_allocs - yajl_allocs) / scan.iterations,
+         (double)(scratch->mallocs - mallocs) / scan.iterations,
+         (double)(bench_gc_allocated() - objects) / scan.iterations);
+  bench_stage_print("scan", &scan, &run->perf, bytes, tokens);
+  printf(",\n     ");
+  bench_stage_print("results", &results, &run->perf, bytes, tokens);
+  printf("}");
+  fflush(stdout);
+}
+
+static void bench_corpus(bench_run *run, const char *name, const char *file, int multiple_values)
+{
+  VALUE json_str = bench_read_file(run, file);
+  bench_stage lex;
+  size_t tokens = bench_lex(json_str, multiple_values);
+  uint64_t started_ns = bench_now_ns();
+  bench_mark mark;
+
+  bench_stage_init(&lex);
+  do
+  {
+    mark = bench_start(&run->perf);
+    bench_lex(json_str, multiple_values);
+    bench_stop(&run->perf, mark, &lex);
+  } while (!bench_stage_done(&lex, started_ns, run->min_seconds));
+  printf("%s\n    {\"corpus\": \"%s\", \"paths\": 0, \"engine\": \"yajl\", \"bytes\": %zu, \"tokens\": %zu,\n     ",
+         run->first_case ? "" : ",", name, (size_t)RSTRING_LEN(json_str), tokens);
+  run->first_case = false;
+  bench_stage_print("lex", &lex, &run->perf, (size_t)RSTRING_LEN(json_str), tokens);
+  printf("}");
+
+  for (size_t i = 0; i < sizeof(bench_selector_sizes) / sizeof(bench_selector_sizes[0]); i++)
+    for (size_t j = 0; j < sizeof(bench_engines) / sizeof(bench_engines[0]); j++)
+      bench_case(run, name, json_str, tokens, multiple_values, bench_selector_sizes[i], bench_engines[j]);
+}
+
+static VALUE bench_main(VALUE data)
+{
+  bench_run *run = (bench_run *)data;
+  char manifest_path[PATH_MAX], name[BENCH_NAME_MAX], file[BENCH_NAME_MAX + 16];
+  int multiple_values;
+  FILE *manifest;
+
+  snprintf(manifest_path, sizeof(manifest_path), "%s/manifest.txt", run->dir);
+  manifest = fopen(manifest_path, "r");
+  if (manifest == NULL)
+    rb_sys_fail(manifest_path);
+  printf("{\"ruby\": \"%s\", \"simd\": \"%s\", \"perf_events\": %s, \"cases\": [", ruby_version, bench_simd_kernels(),
+         run->perf.cycles_fd >= 0 ? "true" : "false");
+  while (fscanf(manifest, "%63s %79s %d", name, file, &multiple_values) == 3)
+    bench_corpus(run, name, file, multiple_values);
+  fclose(manifest);
+  printf("\n]}\n");
+  return Qnil;
+}
+
+int main(int argc, char **argv)
+{
+  bench_run run;
+  int state = 0;
+  VALUE message;
+
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s CORPUS_DIR [MIN_SECONDS_PER_CASE]\n", argv[0]);
+    return 2;
+  }
+  {
+    RUBY_INIT_STACK;
+    ruby_init();
+    Init_json_scanner();
+    memset(&run, 0, sizeof(run));
+    run.dir = argv[1];
+    run.min_seconds = argc > 2 ? atof(argv[2]) : 0.5;
+    run.first_case = true;
+#ifdef __linux__
+    run.perf.cycles_fd = bench_perf_open(PERF_COUNT_HW_CPU_CYCLES);
+    run.perf.instructions_fd = bench_perf_open(PERF_COUNT_HW_INSTRUCTIONS);
+#else
+    run.perf.cycles_fd = run.perf.instructions_fd = -1;
+#endif
+    run.refs = rb_ary_new();
+    rb_gc_register_address(&run.refs);
+    rb_protect(bench_main, (VALUE)&run, &state);
+    if (state)
+    {
+      message = rb_inspect(rb_errinfo());
+      fprintf(stderr, "%s\n", StringValueCStr(message));
+      rb_set_errinfo(Qnil);
+    }
+    rb_gc_unregister_address(&run.refs);
+  }
+  return ruby_cleanup(state) || state ? 1 : 0;
+}
@@ -19,4 +19,33 @@ unless have_library("yajl") && have_header("yajl/yajl_parse.h") && have_header("
   abort "yajl library not found"
 end
 
+# JsonScanner.scan_file maps regular files into memory if possible
+have_header("unistd.h")
+have_func("mmap", "sys/mman.h") && have_func("madvise", "sys/mman.h") if have_header("sys/mman.h")
+
+# stats: true splits the time of a scan between lexing and matching with the monotonic clock
+have_func("clock_gettime", "time.h")
+
+# JsonScanner.scan_many runs native worker threads, it scans in the calling thread only otherwise
+have_func("pthread_create", "pthread.h")
+
+# Selectors can be shared between Ractors, the extension is marked Ractor-safe
+have_header("ruby/ractor.h") && have_func("rb_ext_ractor_safe", "ruby.h")
+
+# x86-64 builds without -mavx2 pick the AVX2 kernels of skip_unmatched: :fast and the SIMD engine at load time
+checking_for("AVX2 kernels dispatch") do
+  try_compile(<<~SRC) && $defs.push("-DHAVE_AVX2_DISPATCH")
+    #include <immintrin.h>
+    __attribute__((target("avx2,pclmul"))) static int avx2_kernel(void)
+    {
+      return _mm256_movemask_epi8(_mm256_setzero_si256());
+    }
+    int main(void)
+    {
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("pclmul") ? avx2_kernel() : 0;
+    }
+  SRC
+end
+
 create_makefile("json_scanner/json_scanner")
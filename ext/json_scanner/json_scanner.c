@@ -3,10 +3,13 @@
 VALUE rb_mJsonScanner;
 VALUE rb_cJsonScannerSelector;
 VALUE rb_cJsonScannerOptions;
+VALUE rb_cJsonScannerStreamScanner;
+VALUE rb_cJsonScannerPackedResult;
+VALUE rb_cJsonScannerIndex;
 VALUE rb_eJsonScannerParseError;
 #define BYTES_CONSUMED "bytes_consumed"
 ID rb_iv_bytes_consumed;
-#define SCAN_KWARGS_SIZE 9
+#define SCAN_KWARGS_SIZE 17
 ID scan_kwargs_table[SCAN_KWARGS_SIZE];
 
 VALUE null_sym;
@@ -17,6 +20,35 @@ VALUE object_sym;
 VALUE array_sym;
 
 VALUE any_key_sym;
+VALUE any_depth_sym;
+VALUE any_index_range;
+VALUE any_key_range;
+VALUE any_depth_range;
+VALUE type_sym;
+VALUE eq_sym;
+VALUE in_sym;
+VALUE count_sym;
+VALUE sum_sym;
+VALUE min_sym;
+VALUE max_sym;
+VALUE key_histogram_sym;
+VALUE fast_sym;
+VALUE yajl_sym;
+VALUE simd_sym;
+VALUE arrays_sym;
+VALUE packed_sym;
+VALUE stub_sym;
+VALUE total_allocated_objects_sym;
+VALUE quirks_mode_sym;
+VALUE symbolize_names_sym;
+ID rb_json_parse;
+// Selector.compile cache, bounded, least recently used expressions are evicted first; Ractors have their own
+#define SELECTOR_CACHE_SIZE 1024
+#ifdef HAVE_RUBY_RACTOR_H
+rb_ractor_local_key_t selector_cache_key;
+#else
+VALUE selector_cache;
+#endif
 
 enum matcher_type
 {
@@ -24,7 +56,10 @@ enum matcher_type
   MATCHER_INDEX,
   MATCHER_ANY_KEY,
   MATCHER_INDEX_RANGE,
-  // MATCHER_KEYS_LIST,
+  MATCHER_KEYS_LIST,
+  MATCHER_ANY_DEPTH,
+  // a JSON Pointer token of digits, it's a key of an object or an index of an array
+  MATCHER_KEY_OR_INDEX,
   // MATCHER_KEY_REGEX,
 };
 
@@ -46,6 +81,19 @@ typedef struct
   long end;
 } range_t;
 
+// A Set of keys, without duplicates
+typedef struct
+{
+  hashkey_t *keys;
+  int len;
+} keys_list_t;
+
+typedef struct
+{
+  hashkey_t key;
+  long index;
+} key_or_index_t;
+
 typedef struct
 {
   enum matcher_type type;
@@ -54,6 +102,8 @@ typedef struct
     hashkey_t key;
     long index;
     range_t range;
+    keys_list_t keys;
+    key_or_index_t key_or_index;
   } value;
 } path_matcher_elem_t;
 
@@ -67,20 +117,362 @@ typedef struct
   } value;
 } path_elem_t;
 
+// A trailing Hash in a path, the conditions are checked before a match is saved, all of them must hold
+typedef struct
+{
+  // bit per value_type, 0 for any type
+  int types;
+  // eq: a string or a number, a value_type, -1 if there is no eq
+  int eq_type;
+  hashkey_t eq_str;
+  int eq_is_int;
+  // eq: a number, its value in decimal if it's an integer, integer texts are compared with it exactly, NULL if it
+  // has a fraction
+  char *eq_digits;
+  size_t eq_digits_len;
+  // other texts are compared as doubles, if eq_num is exactly the value of eq
+  double eq_num;
+  int eq_num_exact;
+  // in: a numeric range, nil bounds are infinite
+  int has_range;
+  double range_begin;
+  double range_end;
+  int range_exclude_end;
+} predicate_t;
+
 typedef struct
 {
   path_matcher_elem_t *elems;
   int len;
-  int matched_depth;
+  // NULL if the path has no predicate
+  predicate_t *predicate;
 } paths_t;
 
+typedef struct
+{
+  hashkey_t key;
+  unsigned int hash;
+  // -1 in empty slots
+  int node;
+} trie_key_t;
+
+// open addressing hash table of keys
+typedef struct
+{
+  trie_key_t *slots;
+  int cap;
+  int len;
+} trie_keys_t;
+
+typedef struct
+{
+  long index;
+  int node;
+} trie_index_t;
+
+typedef struct
+{
+  range_t range;
+  int node;
+} trie_range_t;
+
+// all the keys of the set lead to the node
+typedef struct
+{
+  trie_keys_t keys;
+  int node;
+} trie_key_set_t;
+
+typedef struct
+{
+  key_or_index_t key_or_index;
+  int node;
+} trie_key_or_index_t;
+
+// Paths are compiled into a trie, so paths with common prefixes share nodes
+typedef struct
+{
+  // children by literal keys
+  trie_keys_t keys;
+  // children by literal indexes, sorted
+  trie_index_t *indexes;
+  int indexes_len;
+  trie_range_t *ranges;
+  int ranges_len;
+  trie_key_set_t *key_sets;
+  int key_sets_len;
+  trie_key_or_index_t *keys_or_indexes;
+  int keys_or_indexes_len;
+  int any_key;
+  int any_depth;
+  // the ANY_DEPTH node itself, it stays matched at every depth below, and it matches where it starts as well
+  int recursive;
+  // the node is at or below an ANY_DEPTH node, so it can be matched at any depth
+  int floating;
+  // paths ending at this node
+  int *path_ids;
+  int path_ids_len;
+  int paths_below;
+  int parent;
+  int depth;
+  // all the edges from the root are literal keys and indexes, so the node matches a single value
+  int literal;
+  // the last edge is a range, the others are literal, so the node can't match anything after the range end
+  int range_tail;
+  long range_end;
+} trie_node_t;
+
+// by scan, kept apart from the trie, which is shared by the scans with a Selector
+typedef struct
+{
+  int done;
+  int done_paths;
+} trie_node_state_t;
+
+typedef struct
+{
+  char *ptr;
+  size_t cap;
+} key_buf_t;
+
+typedef enum
+{
+  null_value,
+  boolean_value,
+  number_value,
+  string_value,
+  object_value,
+  array_value,
+} value_type;
+
+// Matches are saved natively by the callbacks, so the scan doesn't need the GVL, Ruby objects are created afterwards
+typedef struct
+{
+  size_t begin;
+  size_t end;
+  value_type type;
+  int path_id;
+  // values matched by several paths share the point
+  int same_value;
+  // with_path, the path is in saved_path
+  int path_len;
+  size_t path_pos;
+  // values: true, the text of a number or the decoded string is in saved_keys
+  size_t value_pos;
+  size_t value_len;
+  // the index of the root value in saved_roots
+  size_t root;
+} saved_point_t;
+
+typedef struct
+{
+  enum path_type type;
+  union
+  {
+    // the key is in saved_keys
+    struct
+    {
+      size_t pos;
+      size_t len;
+    } key;
+    long index;
+  } value;
+} saved_path_elem_t;
+
+typedef struct
+{
+  value_type type;
+  size_t begin;
+} saved_root_t;
+
+// JsonScanner.aggregate, what is accumulated instead of saving points
+#define AGGREGATE_COUNT 1
+#define AGGREGATE_SUM (1 << 1)
+#define AGGREGATE_MIN (1 << 2)
+#define AGGREGATE_MAX (1 << 3)
+#define AGGREGATE_KEY_HISTOGRAM (1 << 4)
+
+// open addressing, the key is in saved_keys, 0 count in empty slots
+typedef struct
+{
+  size_t pos;
+  size_t len;
+  unsigned int hash;
+  size_t count;
+} aggregate_key_t;
+
+typedef struct
+{
+  size_t count;
+  size_t numbers;
+  // integers fitting 64 bits are summed exactly into 128 bits, like Array#sum the other numbers are summed
+  // as floats with the Kahan-Babuska compensation
+  unsigned long long int_sum;
+  long long int_sum_high;
+  size_t floats;
+  double float_sum;
+  double float_sum_c;
+  double min;
+  double max;
+  int min_is_int;
+  int max_is_int;
+  long long min_int;
+  long long max_int;
+  // the last keys of the matched paths
+  aggregate_key_t *keys;
+  size_t keys_len;
+  size_t keys_cap;
+} aggregate_t;
+
+// The structural index of the simd engine
+typedef struct
+{
+  // positions of brackets, colons and commas outside strings, unescaped quotes and first bytes of other tokens
+  uint32_t *pos;
+  size_t len;
+  size_t cap;
+  // closing brackets of open containers
+  char *stack;
+  size_t stack_cap;
+  // escaped keys are decoded there
+  char *key_buf;
+  size_t key_cap;
+} simd_index_t;
+
+// stats: true, counters gathered by the callbacks wrapping the ones of a scan, see scan_stats_callbacks
+typedef struct
+{
+  size_t bytes;
+  // by value_type
+  size_t tokens[array_value + 1];
+  size_t keys;
+  int max_depth;
+  // containers deeper than the longest path, nothing inside them is matched
+  size_t deep_containers;
+  // skip_unmatched: :fast
+  size_t skipped_containers;
+  // trie states checked against keys, indexes and values
+  size_t comparisons;
+  size_t points;
+  size_t ruby_objects;
+  // time spent in the callbacks, the rest of the parse is lexing
+  size_t callbacks;
+  uint64_t callbacks_ns;
+  uint64_t parse_ns;
+  uint64_t results_ns;
+} scan_stats_t;
+
+// A position between top-level values or elements of a top-level array, where a scan can be resumed with the state
+// it had there, see StreamScanner#checkpoint and resume_from
+typedef struct
+{
+  size_t offset;
+  // of current_path, -1 before the first value
+  int depth;
+  // depth 1, the index of the last element and where the array begins
+  long index;
+  size_t start;
+  // top-level values done
+  size_t roots;
+  // the first done_len nodes of done_log
+  int done_len;
+} scan_checkpoint_t;
+
+// Memory a thread keeps between scans: yajl allocates from a bump arena, which is reset when the handle is freed
+// instead of being returned to malloc, and buffers for matches keep their capacity
+#define SCAN_SCRATCH_MAX_BYTES (1024 * 1024)
+
+typedef union
+{
+  struct
+  {
+    size_t size;
+    // didn't fit the arena, allocated by malloc
+    int overflow;
+  } block;
+  // keeps the memory after the header aligned
+  long double align_ld;
+  void *align_ptr;
+} scan_arena_header_t;
+
+typedef struct
+{
+  yajl_alloc_funcs alloc_funcs;
+  char *arena;
+  size_t arena_len;
+  size_t arena_cap;
+  // bytes held by the handle, the arena grows to the peak when it's reset
+  size_t arena_used;
+  size_t arena_peak;
+  saved_point_t *saved_points;
+  size_t saved_points_cap;
+  saved_path_elem_t *saved_path;
+  size_t saved_path_cap;
+  char *saved_keys;
+  size_t saved_keys_cap;
+  saved_root_t *saved_roots;
+  size_t saved_roots_cap;
+  // buffers by depth and the states of the trie nodes, sized by the scan taking them
+  int *states;
+  int *states_offsets;
+  int *states_lens;
+  size_t *starts;
+  path_elem_t *current_path;
+  key_buf_t *key_bufs;
+  int key_bufs_len;
+  trie_node_state_t *node_states;
+  simd_index_t simd_index;
+  // the scratch of the thread is taken by a scan, nested scans and scan_many workers get their own
+  int busy;
+  int own;
+  // JsonScanner.allocation_counts
+  size_t scans;
+  size_t yajl_allocs;
+  size_t mallocs;
+  // JsonScanner.last_stats
+  scan_stats_t last_stats;
+  int has_last_stats;
+} scan_scratch_t;
+
 typedef struct
 {
   int with_path;
   int symbolize_path_keys;
+  int stop_early;
+  // format: :packed, points_list contains PackedResult objects
+  int packed;
+  // values: true, the scalar being saved, decoded_value is set by the simd engine for escaped strings
+  int values;
+  // JsonScanner.parse, the scanned string: matches are inserted into the roots in roots_info_list, which start as
+  // stubs, containers are parsed with JSON.parse
+  VALUE parse_text;
+  // JsonScanner.aggregate, AGGREGATE_ flags, matches are accumulated by path in aggregates instead of being saved
+  int aggregate;
+  aggregate_t *aggregates;
+  const unsigned char *value;
+  size_t value_len;
+  const unsigned char *decoded_value;
+  size_t decoded_value_len;
   int paths_len;
+  int done_paths_len;
   paths_t *paths;
+  // a predicate compares strings, the simd engine has to decode escaped ones
+  int string_predicates;
+  trie_node_t *nodes;
+  int nodes_len;
+  // nodes at or below ANY_DEPTH
+  int floating_len;
+  // the paths and the trie are compiled once and never change, a Selector shares them with all its scans
+  int shared;
+  trie_node_state_t *node_states;
+  // by depth, trie nodes matching current_path up to the depth, the root node for depth 0
+  int *states;
+  int *states_offsets;
+  int *states_lens;
+  int states_cap;
   int current_path_len;
+  // the depth the buffers by depth are allocated for, values deeper than that can't match;
+  // the longest path initially, grows with the depth of the document under ANY_DEPTH
   int max_path_len;
   path_elem_t *current_path;
   // Easier to use a Ruby array for result than convert later
@@ -91,7 +483,53 @@ typedef struct
   size_t *starts;
   // VALUE rb_err;
   yajl_handle handle;
+  // the simd engine has no handle and keeps the end of the current token there
   size_t yajl_bytes_consumed;
+  // by depth, keys that don't outlive the callback are copied there when with_path is set
+  key_buf_t *key_bufs;
+  int key_bufs_len;
+  // the chunk being parsed, yajl passes decoded strings, so it's needed to find where a string begins
+  const unsigned char *chunk;
+  size_t chunk_len;
+  // chunks don't outlive StreamScanner#feed calls
+  int streaming;
+  // the last unescaped quote before the current chunk and whether it's preceded by an odd number of backslashes
+  size_t quote_pos;
+  int odd_backslashes;
+  // skip_unmatched: :fast, parsing is cancelled when a container with nothing to match inside starts
+  int skip_fast;
+  int skip_pending;
+  int skip_object;
+  size_t skip_pos;
+  saved_point_t *saved_points;
+  size_t saved_points_len;
+  size_t saved_points_cap;
+  saved_path_elem_t *saved_path;
+  size_t saved_path_len;
+  size_t saved_path_cap;
+  // keys of saved paths and saved values
+  char *saved_keys;
+  size_t saved_keys_len;
+  size_t saved_keys_cap;
+  saved_root_t *saved_roots;
+  size_t saved_roots_len;
+  size_t saved_roots_cap;
+  // stats: true, NULL otherwise
+  scan_stats_t *stats;
+  // StreamScanner, the last checkpoint is kept when a top-level value or an element of a top-level array is done
+  int checkpoints;
+  scan_checkpoint_t checkpoint;
+  size_t roots;
+  // StreamScanner, the nodes done with stop_early in the order they were done, nodes_len long
+  int *done_log;
+  int done_log_len;
+  // resume_from, the handle has to be put into the state it had at the checkpoint, see scan_ctx_replay
+  int resumed;
+  // the scan is aborted if a buffer can't grow or if the thread is interrupted while the GVL is released
+  int nomem;
+  volatile int interrupted;
+  // taken for the scan, NULL for StreamScanner, whose handle outlives calls
+  scan_scratch_t *scratch;
 } scan_ctx;
 
 typedef struct
@@ -105,6 +543,22 @@ typedef struct
   int allow_partial_values;
   int symbolize_path_keys;
   int with_roots_info;
+  int stop_early;
+  int skip_unmatched;
+  // true for :simd
+  int engine;
+  // true for :packed
+  int format;
+  // scan_many workers, 0 for the number of CPUs, isn't a flag
+  int threads;
+  int values;
+  int stats;
+  // a Hash, StreamScanner#checkpoint, nil if not set; can't be stored in Options
+  VALUE resume_from;
+  // not an option, set by JsonScanner.parse, see scan_ctx
+  VALUE parse_text;
+  // not an option, set by JsonScanner.aggregate, see scan_ctx
+  int aggregate;
 } scan_options;
 #define SCAN_OPTION_VALUE_MASK 1
 #define SCAN_OPTION_SET_MASK (1 << 1)
@@ -125,6 +579,16 @@ static void scan_options_init(scan_options *options, VALUE kwargs)
   options->allow_partial_values = 0;
   options->symbolize_path_keys = 0;
   options->with_roots_info = 0;
+  options->stop_early = 0;
+  options->skip_unmatched = 0;
+  options->engine = 0;
+  options->format = 0;
+  options->threads = 0;
+  options->values = 0;
+  options->stats = 0;
+  options->resume_from = Qnil;
+  options->parse_text = Qfalse;
+  options->aggregate = 0;
   if (kwargs != Qnil)
   {
     VALUE kwargs_values[SCAN_KWARGS_SIZE];
@@ -144,15 +608,56 @@ static void scan_options_init(scan_options *options, VALUE kwargs)
     if (kwargs_values[6] != Qundef)
       SCAN_OPTION_SET(options, allow_partial_values, RTEST(kwargs_values[6]));
     if (kwargs_values[7] != Qundef)
-      SCAN_OPTION_SET(options, symbolize_path_keys, RTEST(kwargs_values[8]));
+      SCAN_OPTION_SET(options, symbolize_path_keys, RTEST(kwargs_values[7]));
     if (kwargs_values[8] != Qundef)
       SCAN_OPTION_SET(options, with_roots_info, RTEST(kwargs_values[8]));
+    if (kwargs_values[9] != Qundef)
+      SCAN_OPTION_SET(options, stop_early, RTEST(kwargs_values[9]));
+    if (kwargs_values[10] != Qundef)
+    {
+      if (kwargs_values[10] != fast_sym && RTEST(kwargs_values[10]))
+        rb_raise(rb_eArgError, "skip_unmatched must be :fast or nil");
+      SCAN_OPTION_SET(options, skip_unmatched, kwargs_values[10] == fast_sym);
+    }
+    if (kwargs_values[11] != Qundef)
+    {
+      if (kwargs_values[11] != simd_sym && kwargs_values[11] != yajl_sym && kwargs_values[11] != Qnil)
+        rb_raise(rb_eArgError, "engine must be :yajl or :simd");
+      SCAN_OPTION_SET(options, engine, kwargs_values[11] == simd_sym);
+    }
+    if (kwargs_values[12] != Qundef)
+    {
+      if (kwargs_values[12] != packed_sym && kwargs_values[12] != arrays_sym && kwargs_values[12] != Qnil)
+        rb_raise(rb_eArgError, "format must be :arrays or :packed");
+      SCAN_OPTION_SET(options, format, kwargs_values[12] == packed_sym);
+    }
+    if (kwargs_values[13] != Qundef && kwargs_values[13] != Qnil)
+    {
+      int threads = NUM2INT(kwargs_values[13]);
+      if (threads < 1)
+        rb_raise(rb_eArgError, "threads must be positive");
+      options->threads = threads;
+    }
+    if (kwargs_values[14] != Qundef)
+      SCAN_OPTION_SET(options, values, RTEST(kwargs_values[14]));
+    if (kwargs_values[15] != Qundef)
+      SCAN_OPTION_SET(options, stats, RTEST(kwargs_values[15]));
+    if (kwargs_values[16] != Qundef && kwargs_values[16] != Qnil)
+    {
+      rb_check_type(kwargs_values[16], T_HASH);
+      options->resume_from = kwargs_values[16];
+    }
+    if (SCAN_OPTION(options, format) && SCAN_OPTION(options, with_path))
+      rb_raise(rb_eArgError, "with_path can't be used with format: :packed");
+    if (SCAN_OPTION(options, format) && SCAN_OPTION(options, values))
+      rb_raise(rb_eArgError, "values can't be used with format: :packed");
   }
 }
 
 static inline size_t scan_ctx_get_bytes_consumed(scan_ctx *ctx)
 {
-  return ctx->yajl_bytes_consumed + yajl_get_bytes_consumed(ctx->handle);
+  // the simd engine has no handle
+  return ctx->yajl_bytes_consumed + (ctx->handle ? yajl_get_bytes_consumed(ctx->handle) : 0);
 }
 
 static inline void scan_ctx_save_bytes_consumed(scan_ctx *ctx)
@@ -160,6 +665,8 @@ static inline void scan_ctx_save_bytes_consumed(scan_ctx *ctx)
   ctx->yajl_bytes_consumed += yajl_get_bytes_consumed(ctx->handle);
 }
 
+static void predicate_inspect(VALUE res, predicate_t *pred);
+
 void scan_ctx_debug(scan_ctx *ctx)
 {
   // actually might have been cleared by GC already, be careful, debug only when in valid state
@@ -167,7 +674,9 @@ void scan_ctx_debug(scan_ctx *ctx)
   fprintf(stderr, "\nscan_ctx {\n");
   fprintf(stderr, "  with_path: %s,\n", ctx->with_path ? "true" : "false");
   fprintf(stderr, "  symbolize_path_keys: %s,\n", ctx->symbolize_path_keys ? "true" : "false");
+  fprintf(stderr, "  stop_early: %s,\n", ctx->stop_early ? "true" : "false");
   fprintf(stderr, "  paths_len: %d,\n", ctx->paths_len);
+  fprintf(stderr, "  done_paths_len: %d,\n", ctx->done_paths_len);
 
   fprintf(stderr, "  paths: [\n");
   for (int i = 0; ctx->paths && i < ctx->paths_len; i++)
@@ -189,14 +698,44 @@ void scan_ctx_debug(scan_ctx *ctx)
       case MATCHER_ANY_KEY:
         fprintf(stderr, "('*'..'*')");
         break;
+      case MATCHER_ANY_DEPTH:
+        fprintf(stderr, "('**'..'**')");
+        break;
+      case MATCHER_KEYS_LIST:
+        fprintf(stderr, "{");
+        for (int k = 0; k < ctx->paths[i].elems[j].value.keys.len; k++)
+          fprintf(stderr, k ? ", '%.*s'" : "'%.*s'", (int)ctx->paths[i].elems[j].value.keys.keys[k].len,
+                  ctx->paths[i].elems[j].value.keys.keys[k].val);
+        fprintf(stderr, "}");
+        break;
+      case MATCHER_KEY_OR_INDEX:
+        fprintf(stderr, "('%.*s'|%ld)", (int)ctx->paths[i].elems[j].value.key_or_index.key.len,
+                ctx->paths[i].elems[j].value.key_or_index.key.val, ctx->paths[i].elems[j].value.key_or_index.index);
+        break;
       }
       if (j < ctx->paths[i].len - 1)
         fprintf(stderr, ", ");
     }
+    if (ctx->paths[i].predicate != NULL)
+    {
+      VALUE predicate = rb_str_new_cstr(ctx->paths[i].len ? ", " : "");
+      predicate_inspect(predicate, ctx->paths[i].predicate);
+      fprintf(stderr, "%s", StringValueCStr(predicate));
+    }
     fprintf(stderr, "],\n");
   }
   fprintf(stderr, "  ],\n");
 
+  fprintf(stderr, "  nodes_len: %d,\n", ctx->nodes_len);
+  fprintf(stderr, "  states: [");
+  for (int i = 0; ctx->states && i <= ctx->current_path_len && i <= ctx->max_path_len; i++)
+  {
+    fprintf(stderr, "[");
+    for (int j = 0; j < ctx->states_lens[i]; j++)
+      fprintf(stderr, j ? ", %d" : "%d", ctx->states[ctx->states_offsets[i] + j]);
+    fprintf(stderr, i < ctx->current_path_len && i < ctx->max_path_len ? "], " : "]");
+  }
+  fprintf(stderr, "],\n");
   fprintf(stderr, "  current_path_len: %d,\n", ctx->current_path_len);
   fprintf(stderr, "  max_path_len: %d,\n", ctx->max_path_len);
   fprintf(stderr, "  current_path: [");
@@ -220,798 +759,5867 @@ void scan_ctx_debug(scan_ctx *ctx)
   fprintf(stderr, "  starts: [");
   for (int i = 0; i <= ctx->max_path_len; i++)
   {
-    fprintf(stderr, "%ld", ctx->starts[i]);
+    fprintf(stderr, "%zu", ctx->starts[i]);
     if (i < ctx->max_path_len)
       fprintf(stderr, ", ");
   }
   fprintf(stderr, "],\n");
 
   fprintf(stderr, "  handle: %p,\n", ctx->handle);
-  fprintf(stderr, "  yajl_bytes_consumed: %ld,\n", ctx->yajl_bytes_consumed);
+  fprintf(stderr, "  yajl_bytes_consumed: %zu,\n", ctx->yajl_bytes_consumed);
   fprintf(stderr, "}\n\n\n");
 }
 
-// FIXME: This will cause memory leak if ruby_xmalloc raises
-// path_ary must be RB_GC_GUARD-ed by the caller
-static VALUE scan_ctx_init(scan_ctx *ctx, VALUE path_ary, VALUE string_keys)
+static inline unsigned int trie_key_hash(const char *key, size_t len)
 {
-  int path_ary_len;
-  paths_t *paths;
-  // TODO: Allow to_ary and sized enumerables
-  rb_check_type(path_ary, T_ARRAY);
-  path_ary_len = rb_long2int(rb_array_len(path_ary));
-  // Check types early before any allocations, so exception is ok
-  // TODO: Fix this, just handle errors
-  // It's not possible that another Ruby thread changes path_ary items between these two loops, because C call holds GVL
-  for (int i = 0; i < path_ary_len; i++)
+  // FNV-1a
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < len; i++)
   {
-    int path_len;
-    VALUE path = rb_ary_entry(path_ary, i);
-    rb_check_type(path, T_ARRAY);
-    path_len = rb_long2int(rb_array_len(path));
-    for (int j = 0; j < path_len; j++)
-    {
-      VALUE entry = rb_ary_entry(path, j);
-      switch (TYPE(entry))
-      {
-      case T_SYMBOL:
-        entry = rb_sym2str(entry);
-        /* fall through */
-      case T_STRING:
-#if LONG_MAX > SIZE_MAX
-        RSTRING_LENINT(entry);
-#endif
-        break;
-      case T_FIXNUM:
-      case T_BIGNUM:
-        NUM2LONG(entry);
-        break;
-      default:
-      {
-        VALUE range_beg, range_end;
-        long end_val;
-        int open_ended;
-        if (rb_range_values(entry, &range_beg, &range_end, &open_ended) != Qtrue)
-          return rb_exc_new_cstr(rb_eArgError, "path elements must be strings, integers, or ranges");
-        if (range_beg != any_key_sym || range_end != any_key_sym)
-        {
-          if (NUM2LONG(range_beg) < 0L)
-            return rb_exc_new_cstr(rb_eArgError, "range start must be positive");
-          end_val = NUM2LONG(range_end);
-          if (end_val < -1L)
-            return rb_exc_new_cstr(rb_eArgError, "range end must be positive or -1");
-          if (end_val == -1L && open_ended)
-            return rb_exc_new_cstr(rb_eArgError, "range with -1 end must be closed");
-        }
-      }
-      }
-    }
+    hash ^= (unsigned char)key[i];
+    hash *= 16777619u;
   }
+  return hash;
+}
 
-  ctx->max_path_len = 0;
+// noexcept
+static int trie_find_key(trie_keys_t *table, const char *key, size_t len, unsigned int hash)
+{
+  unsigned int mask;
+  if (table->len == 0)
+    return -1;
+  mask = (unsigned int)table->cap - 1;
+  for (unsigned int i = hash & mask;; i = (i + 1) & mask)
+  {
+    trie_key_t *slot = &table->slots[i];
+    if (slot->node < 0)
+      return -1;
+    if (slot->hash == hash && slot->key.len == len && !memcmp(slot->key.val, key, len))
+      return slot->node;
+  }
+}
 
-  paths = ruby_xmalloc(sizeof(paths_t) * path_ary_len);
-  for (int i = 0; i < path_ary_len; i++)
+static void trie_insert_key(trie_keys_t *table, hashkey_t key, unsigned int hash, int child)
+{
+  unsigned int mask;
+  // keep the load factor under 1/2
+  if ((table->len + 1) * 2 > table->cap)
   {
-    int path_len;
-    VALUE path = rb_ary_entry(path_ary, i);
-    path_len = rb_long2int(rb_array_len(path));
-    if (path_len > ctx->max_path_len)
-      ctx->max_path_len = path_len;
-    paths[i].elems = ruby_xmalloc2(sizeof(path_matcher_elem_t), path_len);
-    for (int j = 0; j < path_len; j++)
+    trie_key_t *old_slots = table->slots;
+    int old_cap = table->cap;
+    table->cap = old_cap ? old_cap * 2 : 4;
+    table->slots = ruby_xmalloc2(sizeof(trie_key_t), table->cap);
+    for (int i = 0; i < table->cap; i++)
+      table->slots[i].node = -1;
+    table->len = 0;
+    for (int i = 0; i < old_cap; i++)
     {
-      VALUE entry = rb_ary_entry(path, j);
-      switch (TYPE(entry))
-      {
-      case T_SYMBOL:
-        entry = rb_sym2str(entry);
-        /* fall through */
-      case T_STRING:
-      {
-        if (string_keys != Qundef)
-        {
-          // If string_keys is provided, we need to duplicate the string
-          // to avoid use-after-free issues and to add the newly created string to the string_keys array.
-          // In Ruby 2.2 and newer symbols can be GC-ed, so we need to duplicate them as well.
-          entry = rb_str_dup(entry);
-          rb_ary_push(string_keys, entry);
-        }
-        paths[i].elems[j].type = MATCHER_KEY;
-        paths[i].elems[j].value.key.val = RSTRING_PTR(entry);
-#if LONG_MAX > SIZE_MAX
-        paths[i].elems[j].value.key.len = RSTRING_LENINT(entry);
-#else
-        paths[i].elems[j].value.key.len = RSTRING_LEN(entry);
-#endif
-      }
-      break;
-      case T_FIXNUM:
-      case T_BIGNUM:
-      {
-        paths[i].elems[j].type = MATCHER_INDEX;
-        paths[i].elems[j].value.index = FIX2LONG(entry);
-      }
-      break;
-      default:
-      {
-        VALUE range_beg, range_end;
-        int open_ended;
-        rb_range_values(entry, &range_beg, &range_end, &open_ended);
-        if (range_beg == any_key_sym && range_end == any_key_sym)
-        {
-          paths[i].elems[j].type = MATCHER_ANY_KEY;
-        }
-        else
-        {
-          paths[i].elems[j].type = MATCHER_INDEX_RANGE;
-          paths[i].elems[j].value.range.start = NUM2LONG(range_beg);
-          paths[i].elems[j].value.range.end = NUM2LONG(range_end);
-          // (value..-1) works as expected, (value...-1) is forbidden above
-          if (paths[i].elems[j].value.range.end == -1L)
-            paths[i].elems[j].value.range.end = LONG_MAX;
-          // -1 here is fine, so, (0...0) works just as expected - doesn't match anything
-          if (open_ended)
-            paths[i].elems[j].value.range.end--;
-        }
-      }
-      }
+      if (old_slots[i].node >= 0)
+        trie_insert_key(table, old_slots[i].key, old_slots[i].hash, old_slots[i].node);
     }
-    paths[i].len = path_len;
-    paths[i].matched_depth = 0;
+    ruby_xfree(old_slots);
   }
+  mask = (unsigned int)table->cap - 1;
+  for (unsigned int i = hash & mask;; i = (i + 1) & mask)
+  {
+    if (table->slots[i].node < 0)
+    {
+      table->slots[i].key = key;
+      table->slots[i].hash = hash;
+      table->slots[i].node = child;
+      table->len++;
+      return;
+    }
+  }
+}
 
-  ctx->paths = paths;
-  ctx->paths_len = path_ary_len;
-  ctx->current_path = ruby_xmalloc2(sizeof(path_elem_t), ctx->max_path_len);
-
-  ctx->starts = ruby_xmalloc2(sizeof(size_t), ctx->max_path_len + 1);
-  return Qundef; // no error
+// A set matches the same keys as an existing one if it has the same size and all of its keys are there
+static int trie_same_keys(trie_keys_t *table, keys_list_t *keys)
+{
+  if (table->len != keys->len)
+    return false;
+  for (int i = 0; i < keys->len; i++)
+  {
+    if (trie_find_key(table, keys->keys[i].val, keys->keys[i].len, trie_key_hash(keys->keys[i].val, keys->keys[i].len)) < 0)
+      return false;
+  }
+  return true;
 }
 
-// resets temporary values in the selector
-static void scan_ctx_reset(scan_ctx *ctx, VALUE points_list, VALUE roots_info_list, int with_path, int symbolize_path_keys)
+// noexcept
+static int trie_find_index(trie_node_t *node, long index, int *pos)
 {
-  // TODO: reset matched_depth if implemented
-  ctx->current_path_len = 0;
-  // ctx->rb_err = Qnil;
-  ctx->handle = NULL;
-  ctx->yajl_bytes_consumed = 0;
-  ctx->points_list = points_list;
-  ctx->roots_info_list = roots_info_list;
-  ctx->with_path = with_path;
-  ctx->symbolize_path_keys = symbolize_path_keys;
+  int lo = 0, hi = node->indexes_len;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (node->indexes[mid].index < index)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (pos)
+    *pos = lo;
+  return lo < node->indexes_len && node->indexes[lo].index == index ? node->indexes[lo].node : -1;
 }
 
-static void scan_ctx_free(scan_ctx *ctx)
+static int trie_new_node(scan_ctx *ctx, int parent, path_matcher_elem_t *elem)
 {
-  // fprintf(stderr, "scan_ctx_free\n");
-  if (!ctx)
-    return;
-  ruby_xfree(ctx->starts);
-  ruby_xfree(ctx->current_path);
-  if (!ctx->paths)
-    return;
-  for (int i = 0; i < ctx->paths_len; i++)
+  int id = ctx->nodes_len++;
+  trie_node_t *node = &ctx->nodes[id];
+  node->keys.slots = NULL;
+  node->keys.cap = 0;
+  node->keys.len = 0;
+  node->indexes = NULL;
+  node->indexes_len = 0;
+  node->ranges = NULL;
+  node->ranges_len = 0;
+  node->key_sets = NULL;
+  node->key_sets_len = 0;
+  node->keys_or_indexes = NULL;
+  node->keys_or_indexes_len = 0;
+  node->any_key = -1;
+  node->any_depth = -1;
+  node->path_ids = NULL;
+  node->path_ids_len = 0;
+  node->paths_below = 0;
+  node->parent = parent;
+  if (parent < 0)
   {
-    ruby_xfree(ctx->paths[i].elems);
+    node->depth = 0;
+    node->literal = true;
+    node->range_tail = false;
+    node->range_end = 0;
+    node->recursive = false;
+    node->floating = false;
+    return id;
   }
-  ruby_xfree(ctx->paths);
+  node->depth = ctx->nodes[parent].depth + 1;
+  node->recursive = elem->type == MATCHER_ANY_DEPTH;
+  node->floating = ctx->nodes[parent].floating || node->recursive;
+  if (node->floating)
+    ctx->floating_len++;
+  node->literal = ctx->nodes[parent].literal &&
+                  (elem->type == MATCHER_KEY || elem->type == MATCHER_INDEX || elem->type == MATCHER_KEY_OR_INDEX);
+  node->range_tail = ctx->nodes[parent].literal && elem->type == MATCHER_INDEX_RANGE;
+  node->range_end = elem->type == MATCHER_INDEX_RANGE ? elem->value.range.end : 0;
+  return id;
 }
 
-// noexcept
-static inline void increment_arr_index(scan_ctx *sctx)
+// Returns the child matching exactly the same elements, creates it if needed
+static int trie_child(scan_ctx *ctx, int parent, path_matcher_elem_t *elem)
 {
-  // remember - any value can be root
-  // TODO: Maybe make current_path_len 1 shorter and get rid of -1; need to change all compares
-  if (sctx->current_path_len && sctx->current_path[sctx->current_path_len - 1].type == PATH_INDEX)
+  int child, pos;
+  trie_node_t *node;
+  switch (elem->type)
   {
-    sctx->current_path[sctx->current_path_len - 1].value.index++;
+  case MATCHER_KEY:
+  {
+    unsigned int hash = trie_key_hash(elem->value.key.val, elem->value.key.len);
+    child = trie_find_key(&ctx->nodes[parent].keys, elem->value.key.val, elem->value.key.len, hash);
+    if (child >= 0)
+      return child;
+    child = trie_new_node(ctx, parent, elem);
+    trie_insert_key(&ctx->nodes[parent].keys, elem->value.key, hash, child);
+    return child;
+  }
+  case MATCHER_INDEX:
+    child = trie_find_index(&ctx->nodes[parent], elem->value.index, &pos);
+    if (child >= 0)
+      return child;
+    child = trie_new_node(ctx, parent, elem);
+    node = &ctx->nodes[parent];
+    node->indexes = ruby_xrealloc2(node->indexes, node->indexes_len + 1, sizeof(trie_index_t));
+    memmove(&node->indexes[pos + 1], &node->indexes[pos], sizeof(trie_index_t) * (node->indexes_len - pos));
+    node->indexes[pos].index = elem->value.index;
+    node->indexes[pos].node = child;
+    node->indexes_len++;
+    return child;
+  case MATCHER_INDEX_RANGE:
+    node = &ctx->nodes[parent];
+    for (int i = 0; i < node->ranges_len; i++)
+    {
+      if (node->ranges[i].range.start == elem->value.range.start && node->ranges[i].range.end == elem->value.range.end)
+        return node->ranges[i].node;
+    }
+    child = trie_new_node(ctx, parent, elem);
+    node = &ctx->nodes[parent];
+    node->ranges = ruby_xrealloc2(node->ranges, node->ranges_len + 1, sizeof(trie_range_t));
+    node->ranges[node->ranges_len].range = elem->value.range;
+    node->ranges[node->ranges_len].node = child;
+    node->ranges_len++;
+    return child;
+  case MATCHER_ANY_KEY:
+    if (ctx->nodes[parent].any_key < 0)
+    {
+      child = trie_new_node(ctx, parent, elem);
+      ctx->nodes[parent].any_key = child;
+    }
+    return ctx->nodes[parent].any_key;
+  case MATCHER_ANY_DEPTH:
+    if (ctx->nodes[parent].any_depth < 0)
+    {
+      child = trie_new_node(ctx, parent, elem);
+      ctx->nodes[parent].any_depth = child;
+    }
+    return ctx->nodes[parent].any_depth;
+  case MATCHER_KEYS_LIST:
+  {
+    trie_key_set_t *set;
+    node = &ctx->nodes[parent];
+    for (int i = 0; i < node->key_sets_len; i++)
+    {
+      if (trie_same_keys(&node->key_sets[i].keys, &elem->value.keys))
+        return node->key_sets[i].node;
+    }
+    child = trie_new_node(ctx, parent, elem);
+    node = &ctx->nodes[parent];
+    node->key_sets = ruby_xrealloc2(node->key_sets, node->key_sets_len + 1, sizeof(trie_key_set_t));
+    set = &node->key_sets[node->key_sets_len++];
+    set->keys.slots = NULL;
+    set->keys.cap = 0;
+    set->keys.len = 0;
+    set->node = child;
+    for (int i = 0; i < elem->value.keys.len; i++)
+    {
+      hashkey_t key = elem->value.keys.keys[i];
+      trie_insert_key(&set->keys, key, trie_key_hash(key.val, key.len), child);
+    }
+    return child;
+  }
+  case MATCHER_KEY_OR_INDEX:
+    // the key is the index in decimal
+    node = &ctx->nodes[parent];
+    for (int i = 0; i < node->keys_or_indexes_len; i++)
+    {
+      if (node->keys_or_indexes[i].key_or_index.index == elem->value.key_or_index.index)
+        return node->keys_or_indexes[i].node;
+    }
+    child = trie_new_node(ctx, parent, elem);
+    node = &ctx->nodes[parent];
+    node->keys_or_indexes =
+        ruby_xrealloc2(node->keys_or_indexes, node->keys_or_indexes_len + 1, sizeof(trie_key_or_index_t));
+    node->keys_or_indexes[node->keys_or_indexes_len].key_or_index = elem->value.key_or_index;
+    node->keys_or_indexes[node->keys_or_indexes_len].node = child;
+    node->keys_or_indexes_len++;
+    return child;
   }
+  return -1;
 }
 
-typedef enum
+// Buffers for matches are allocated by the first match
+static void scan_ctx_init_saved(scan_ctx *ctx)
 {
-  null_value,
-  boolean_value,
-  number_value,
-  string_value,
-  object_value,
-  array_value,
-} value_type;
+  ctx->saved_points = NULL;
+  ctx->saved_points_len = ctx->saved_points_cap = 0;
+  ctx->saved_path = NULL;
+  ctx->saved_path_len = ctx->saved_path_cap = 0;
+  ctx->saved_keys = NULL;
+  ctx->saved_keys_len = ctx->saved_keys_cap = 0;
+  ctx->saved_roots = NULL;
+  ctx->saved_roots_len = ctx->saved_roots_cap = 0;
+  ctx->aggregates = NULL;
+}
 
-// noexcept
-static VALUE create_point(scan_ctx *sctx, value_type type, size_t length)
+// Buffers can be big after a big scan, selectors don't keep them
+static void scan_ctx_free_saved(scan_ctx *ctx)
 {
-  VALUE values[3], point;
-  size_t curr_pos = scan_ctx_get_bytes_consumed(sctx);
-  point = rb_ary_new_capa(3);
-  // noexcept
-  values[1] = ULL2NUM(curr_pos);
-  switch (type)
+  free(ctx->saved_points);
+  free(ctx->saved_path);
+  free(ctx->saved_keys);
+  free(ctx->saved_roots);
+  for (int i = 0; ctx->aggregates && i < ctx->paths_len; i++)
+    free(ctx->aggregates[i].keys);
+  free(ctx->aggregates);
+  scan_ctx_init_saved(ctx);
+}
+
+#define SCAN_ARENA_BLOCK_SIZE(size)                                                                      \
+  (sizeof(scan_arena_header_t) +                                                                         \
+   ((size) + sizeof(scan_arena_header_t) - 1) / sizeof(scan_arena_header_t) * sizeof(scan_arena_header_t))
+
+static void scan_arena_use(scan_scratch_t *scratch, size_t bytes)
+{
+  scratch->arena_used += bytes;
+  if (scratch->arena_used > scratch->arena_peak)
+    scratch->arena_peak = scratch->arena_used;
+}
+
+// noexcept, doesn't need the GVL, yajl_alloc_funcs of the scratch
+static void *scan_arena_malloc(void *data, size_t size)
+{
+  scan_scratch_t *scratch = (scan_scratch_t *)data;
+  scan_arena_header_t *header;
+  size_t block_size = SCAN_ARENA_BLOCK_SIZE(size);
+  scratch->yajl_allocs++;
+  if (scratch->arena_cap - scratch->arena_len >= block_size)
   {
-    // FIXME: size_t can be longer than ulong
-  case null_value:
-    values[0] = ULL2NUM(curr_pos - length);
-    values[2] = null_sym;
-    break;
-  case boolean_value:
-    values[0] = ULL2NUM(curr_pos - length);
-    values[2] = boolean_sym;
-    break;
-  case number_value:
-    values[0] = ULL2NUM(curr_pos - length);
-    values[2] = number_sym;
-    break;
-  case string_value:
-    values[0] = ULL2NUM(curr_pos - length);
-    values[2] = string_sym;
-    break;
-  case object_value:
-    values[0] = ULL2NUM(sctx->starts[sctx->current_path_len]);
-    values[2] = object_sym;
-    break;
-  case array_value:
-    values[0] = ULL2NUM(sctx->starts[sctx->current_path_len]);
-    values[2] = array_sym;
-    break;
+    header = (scan_arena_header_t *)(scratch->arena + scratch->arena_len);
+    header->block.overflow = false;
+    scratch->arena_len += block_size;
+  }
+  else
+  {
+    scratch->mallocs++;
+    if ((header = malloc(block_size)) == NULL)
+      return NULL;
+    header->block.overflow = true;
   }
-  // rb_ary_cat raise only in case of a frozen array or if len is too long
-  rb_ary_cat(point, values, 3);
-  return point;
+  header->block.size = block_size;
+  scan_arena_use(scratch, block_size);
+  return header + 1;
 }
 
-// noexcept
-static VALUE create_path(scan_ctx *sctx)
+// noexcept, doesn't need the GVL, only the last block of the arena is given back
+static void scan_arena_free(void *data, void *ptr)
 {
-  VALUE path = rb_ary_new_capa(sctx->current_path_len);
-  for (int i = 0; i < sctx->current_path_len; i++)
+  scan_scratch_t *scratch = (scan_scratch_t *)data;
+  scan_arena_header_t *header;
+  if (ptr == NULL)
+    return;
+  header = (scan_arena_header_t *)ptr - 1;
+  scratch->arena_used -= header->block.size;
+  if (header->block.overflow)
+    free(header);
+  else if ((char *)header + header->block.size == scratch->arena + scratch->arena_len)
+    scratch->arena_len -= header->block.size;
+}
+
+// noexcept, doesn't need the GVL, the last block of the arena grows in place, yajl grows one buffer at a time
+static void *scan_arena_realloc(void *data, void *ptr, size_t size)
+{
+  scan_scratch_t *scratch = (scan_scratch_t *)data;
+  scan_arena_header_t *header;
+  size_t block_size = SCAN_ARENA_BLOCK_SIZE(size), block_pos;
+  void *res;
+  if (ptr == NULL)
+    return scan_arena_malloc(data, size);
+  header = (scan_arena_header_t *)ptr - 1;
+  block_pos = header->block.overflow ? scratch->arena_cap : (size_t)((char *)header - scratch->arena);
+  if (block_pos + header->block.size == scratch->arena_len && block_size <= scratch->arena_cap - block_pos)
   {
-    VALUE entry;
-    switch (sctx->current_path[i].type)
-    {
-    case PATH_KEY:
-      if (sctx->symbolize_path_keys)
-        entry = rb_id2sym(rb_intern2(sctx->current_path[i].value.key.val, sctx->current_path[i].value.key.len));
-      else
-        entry = rb_str_new(sctx->current_path[i].value.key.val, sctx->current_path[i].value.key.len);
-      break;
-    case PATH_INDEX:
-      entry = LONG2NUM(sctx->current_path[i].value.index);
-      break;
-    default:
-      entry = Qnil;
-    }
-    rb_ary_push(path, entry);
+    scratch->yajl_allocs++;
+    scratch->arena_used -= header->block.size;
+    scan_arena_use(scratch, block_size);
+    scratch->arena_len = block_pos + block_size;
+    header->block.size = block_size;
+    return ptr;
   }
-  return path;
+  if ((res = scan_arena_malloc(data, size)) == NULL)
+    return NULL;
+  memcpy(res, ptr, (header->block.size < block_size ? header->block.size : block_size) - sizeof(scan_arena_header_t));
+  scan_arena_free(data, ptr);
+  return res;
 }
 
-// noexcept
-static inline void save_root_info(scan_ctx *sctx, VALUE type, size_t len)
+// noexcept, doesn't need the GVL
+// The handle is freed, the arena grows to fit what the handle held at most, so the next one fits without malloc
+static void scan_arena_reset(scan_scratch_t *scratch)
 {
-  if (sctx->roots_info_list != Qundef && sctx->current_path_len == 0)
+  scratch->arena_len = 0;
+  scratch->arena_used = 0;
+  if (scratch->arena_peak > scratch->arena_cap && scratch->arena_peak <= SCAN_SCRATCH_MAX_BYTES)
   {
-    rb_ary_push(sctx->roots_info_list, rb_ary_new_from_args(2, type, ULL2NUM(scan_ctx_get_bytes_consumed(sctx) - len)));
+    free(scratch->arena);
+    scratch->mallocs++;
+    scratch->arena = malloc(scratch->arena_peak);
+    scratch->arena_cap = scratch->arena == NULL ? 0 : scratch->arena_peak;
   }
+  scratch->arena_peak = 0;
 }
 
-// noexcept
-static void save_point(scan_ctx *sctx, value_type type, size_t length)
+static void scan_scratch_free(void *data)
 {
-  // TODO: Abort parsing if all paths are matched and no more mathces are possible: only trivial key/index matchers at the current level
-  // TODO: Don't re-compare already matched prefixes; hard to invalidate, though
-  // TODO: Might fail in case of no memory
-  VALUE point = Qundef, path;
-  int match;
-  for (int i = 0; i < sctx->paths_len; i++)
-  {
-    if (sctx->paths[i].len != sctx->current_path_len)
-      continue;
+  scan_scratch_t *scratch = (scan_scratch_t *)data;
+  free(scratch->arena);
+  free(scratch->saved_points);
+  free(scratch->saved_path);
+  free(scratch->saved_keys);
+  free(scratch->saved_roots);
+  free(scratch->states);
+  free(scratch->states_offsets);
+  free(scratch->states_lens);
+  free(scratch->starts);
+  free(scratch->current_path);
+  for (int i = 0; i < scratch->key_bufs_len; i++)
+    free(scratch->key_bufs[i].ptr);
+  free(scratch->key_bufs);
+  free(scratch->node_states);
+  free(scratch->simd_index.pos);
+  free(scratch->simd_index.stack);
+  free(scratch->simd_index.key_buf);
+  free(scratch);
+}
 
-    match = true;
-    for (int j = 0; j < sctx->current_path_len; j++)
-    {
-      switch (sctx->paths[i].elems[j].type)
-      {
-      case MATCHER_ANY_KEY:
-        if (sctx->current_path[j].type != PATH_KEY)
-          match = false;
-        break;
-      case MATCHER_KEY:
-        if (sctx->current_path[j].type != PATH_KEY ||
-            sctx->current_path[j].value.key.len != sctx->paths[i].elems[j].value.key.len ||
-            strncmp(sctx->current_path[j].value.key.val, sctx->paths[i].elems[j].value.key.val, sctx->current_path[j].value.key.len))
-          match = false;
-        break;
-      case MATCHER_INDEX:
-        if (sctx->current_path[j].type != PATH_INDEX ||
-            sctx->current_path[j].value.index != sctx->paths[i].elems[j].value.index)
-          match = false;
-        break;
-      case MATCHER_INDEX_RANGE:
-        if (sctx->current_path[j].type != PATH_INDEX ||
-            sctx->current_path[j].value.index < sctx->paths[i].elems[j].value.range.start ||
-            sctx->current_path[j].value.index > sctx->paths[i].elems[j].value.range.end)
-          match = false;
-        break;
-      }
-      if (!match)
-        break;
-    }
-    if (match)
-    {
-      if (point == Qundef)
-      {
-        point = create_point(sctx, type, length);
-        if (sctx->with_path)
-        {
-          path = create_path(sctx);
-          point = rb_ary_new_from_args(2, path, point);
-        }
-      }
-      // rb_ary_push raises only in case of a frozen array, which is not the case
-      // rb_ary_entry is safe
-      rb_ary_push(rb_ary_entry(sctx->points_list, i), point);
-    }
-  }
+#ifdef HAVE_PTHREAD_CREATE
+static pthread_key_t thread_scratch_key;
+#else
+static scan_scratch_t *thread_scratch;
+#endif
+
+// Doesn't need the GVL, the scratch of the calling thread or NULL
+static scan_scratch_t *thread_scratch_peek(void)
+{
+#ifdef HAVE_PTHREAD_CREATE
+  return (scan_scratch_t *)pthread_getspecific(thread_scratch_key);
+#else
+  return thread_scratch;
+#endif
 }
 
-// noexcept
-static int scan_on_null(void *ctx)
+// Needs the GVL, creates a scratch for the calling thread if it has none yet
+static scan_scratch_t *scan_scratch_new(int for_thread)
 {
-  scan_ctx *sctx = (scan_ctx *)ctx;
-  save_root_info(sctx, null_sym, 4);
-  if (sctx->current_path_len > sctx->max_path_len)
-    return true;
-  increment_arr_index(sctx);
-  save_point(sctx, null_value, 4);
-  return true;
+  scan_scratch_t *scratch = calloc(1, sizeof(scan_scratch_t));
+  if (scratch == NULL)
+    rb_memerror();
+  scratch->alloc_funcs.malloc = scan_arena_malloc;
+  scratch->alloc_funcs.realloc = scan_arena_realloc;
+  scratch->alloc_funcs.free = scan_arena_free;
+  scratch->alloc_funcs.ctx = scratch;
+  if (!for_thread || thread_scratch_peek() != NULL)
+    return scratch;
+#ifdef HAVE_PTHREAD_CREATE
+  scratch->own = pthread_setspecific(thread_scratch_key, scratch) == 0;
+#else
+  thread_scratch = scratch;
+  scratch->own = true;
+#endif
+  return scratch;
 }
 
-// noexcept
-static int scan_on_boolean(void *ctx, int bool_val)
+static scan_scratch_t *thread_scratch_get(void)
 {
-  scan_ctx *sctx = (scan_ctx *)ctx;
-  save_root_info(sctx, boolean_sym, bool_val ? 4 : 5);
-  if (sctx->current_path_len > sctx->max_path_len)
-    return true;
-  increment_arr_index(sctx);
-  save_point(sctx, boolean_value, bool_val ? 4 : 5);
-  return true;
+  scan_scratch_t *scratch = thread_scratch_peek();
+  return scratch != NULL ? scratch : scan_scratch_new(true);
 }
 
-// noexcept
-static int scan_on_number(void *ctx, const char *val, size_t len)
+static void scan_ctx_init_state(scan_ctx *ctx)
 {
-  scan_ctx *sctx = (scan_ctx *)ctx;
-  save_root_info(sctx, number_sym, len);
-  if (sctx->current_path_len > sctx->max_path_len)
-    return true;
-  increment_arr_index(sctx);
-  save_point(sctx, number_value, len);
-  return true;
+  ctx->node_states = NULL;
+  ctx->states = NULL;
+  ctx->states_offsets = NULL;
+  ctx->states_lens = NULL;
+  ctx->states_cap = 0;
+  ctx->starts = NULL;
+  ctx->current_path = NULL;
+  ctx->key_bufs = NULL;
+  ctx->key_bufs_len = 0;
+  ctx->done_log = NULL;
 }
 
-// noexcept
-static int scan_on_string(void *ctx, const unsigned char *val, size_t len)
+static void scan_ctx_free_state(scan_ctx *ctx)
 {
-  scan_ctx *sctx = (scan_ctx *)ctx;
-  save_root_info(sctx, string_sym, len + 2);
-  if (sctx->current_path_len > sctx->max_path_len)
-    return true;
-  increment_arr_index(sctx);
-  save_point(sctx, string_value, len + 2);
-  return true;
+  free(ctx->node_states);
+  free(ctx->states);
+  free(ctx->states_offsets);
+  free(ctx->states_lens);
+  free(ctx->starts);
+  free(ctx->current_path);
+  for (int i = 0; i < ctx->key_bufs_len; i++)
+    free(ctx->key_bufs[i].ptr);
+  free(ctx->key_bufs);
+  free(ctx->done_log);
+  scan_ctx_init_state(ctx);
 }
 
-// noexcept
-static int scan_on_start_object(void *ctx)
+static size_t scan_ctx_state_size(const scan_ctx *ctx)
 {
-  scan_ctx *sctx = (scan_ctx *)ctx;
-  // Save in the beginning in case of a partial value
-  save_root_info(sctx, object_sym, 1);
-  if (sctx->current_path_len > sctx->max_path_len)
-  {
-    sctx->current_path_len++;
-    return true;
-  }
-  increment_arr_index(sctx);
-  sctx->starts[sctx->current_path_len] = scan_ctx_get_bytes_consumed(sctx) - 1;
-  if (sctx->current_path_len < sctx->max_path_len)
-    sctx->current_path[sctx->current_path_len].type = PATH_KEY;
-  sctx->current_path_len++;
-  return true;
+  size_t res = 0;
+  if (ctx->node_states != NULL)
+    res += ctx->nodes_len * sizeof(trie_node_state_t);
+  if (ctx->states != NULL)
+    res += ctx->states_cap * sizeof(int) + (ctx->max_path_len + 1) * (2 * sizeof(int) + sizeof(size_t)) +
+           ctx->max_path_len * sizeof(path_elem_t);
+  res += ctx->key_bufs_len * sizeof(key_buf_t);
+  for (int i = 0; i < ctx->key_bufs_len; i++)
+    res += ctx->key_bufs[i].cap;
+  return res;
 }
 
-// noexcept
-static int scan_on_key(void *ctx, const unsigned char *key, size_t len)
+static int scan_ctx_alloc_state(scan_ctx *ctx);
+
+// Needs the GVL, the matches are saved into the buffers kept by the scratch, which keeps the buffers by depth as well
+static void scan_ctx_take_scratch(scan_ctx *ctx)
 {
-  scan_ctx *sctx = (scan_ctx *)ctx;
-  if (sctx->current_path_len > sctx->max_path_len)
-    return true;
-  // Can't be called without scan_on_start_object being called before
-  // So current_path_len at least 1 and key.type is set to PATH_KEY;
-  sctx->current_path[sctx->current_path_len - 1].value.key.val = (char *)key;
-  sctx->current_path[sctx->current_path_len - 1].value.key.len = len;
-  return true;
+  scan_scratch_t *scratch = thread_scratch_get();
+  if (scratch->busy)
+    scratch = scan_scratch_new(false);
+  scratch->busy = true;
+  scratch->scans++;
+  ctx->scratch = scratch;
+#define SCAN_SCRATCH_TAKE(field)                 \
+  ctx->field = scratch->field;                   \
+  ctx->field##_cap = scratch->field##_cap;       \
+  scratch->field = NULL;                         \
+  scratch->field##_cap = 0;
+  SCAN_SCRATCH_TAKE(saved_points)
+  SCAN_SCRATCH_TAKE(saved_path)
+  SCAN_SCRATCH_TAKE(saved_keys)
+  SCAN_SCRATCH_TAKE(saved_roots)
+#undef SCAN_SCRATCH_TAKE
+  scan_ctx_free_state(ctx);
+#define SCAN_SCRATCH_TAKE(field) \
+  ctx->field = scratch->field;   \
+  scratch->field = NULL;
+  SCAN_SCRATCH_TAKE(node_states)
+  SCAN_SCRATCH_TAKE(states)
+  SCAN_SCRATCH_TAKE(states_offsets)
+  SCAN_SCRATCH_TAKE(states_lens)
+  SCAN_SCRATCH_TAKE(starts)
+  SCAN_SCRATCH_TAKE(current_path)
+  SCAN_SCRATCH_TAKE(key_bufs)
+#undef SCAN_SCRATCH_TAKE
+  ctx->key_bufs_len = scratch->key_bufs_len;
+  scratch->key_bufs_len = 0;
+  if (!scan_ctx_alloc_state(ctx))
+    rb_memerror();
 }
 
-// noexcept
-static int scan_on_end_object(void *ctx)
+// Needs the GVL, the handle must be freed already. Buffers grown by a big scan are freed,
+// the counts of a scratch made for a nested scan or a scan_many worker go to the scratch of the thread
+static void scan_ctx_return_scratch(scan_ctx *ctx)
 {
-  scan_ctx *sctx = (scan_ctx *)ctx;
-  sctx->current_path_len--;
-  if (sctx->current_path_len <= sctx->max_path_len)
-    save_point(sctx, object_value, 0);
-  return true;
+  scan_scratch_t *scratch = ctx->scratch, *own_scratch;
+  if (scratch == NULL)
+    return;
+  ctx->scratch = NULL;
+#define SCAN_SCRATCH_KEEP(field)                                              \
+  if (ctx->field##_cap * sizeof(*ctx->field) <= SCAN_SCRATCH_MAX_BYTES)       \
+  {                                                                           \
+    scratch->field = ctx->field;                                              \
+    scratch->field##_cap = ctx->field##_cap;                                  \
+    ctx->field = NULL;                                                        \
+  }
+  SCAN_SCRATCH_KEEP(saved_points)
+  SCAN_SCRATCH_KEEP(saved_path)
+  SCAN_SCRATCH_KEEP(saved_keys)
+  SCAN_SCRATCH_KEEP(saved_roots)
+#undef SCAN_SCRATCH_KEEP
+  scan_ctx_free_saved(ctx);
+  if (scan_ctx_state_size(ctx) <= SCAN_SCRATCH_MAX_BYTES)
+  {
+    scratch->node_states = ctx->node_states;
+    scratch->states = ctx->states;
+    scratch->states_offsets = ctx->states_offsets;
+    scratch->states_lens = ctx->states_lens;
+    scratch->starts = ctx->starts;
+    scratch->current_path = ctx->current_path;
+    scratch->key_bufs = ctx->key_bufs;
+    scratch->key_bufs_len = ctx->key_bufs_len;
+    scan_ctx_init_state(ctx);
+  }
+  scan_ctx_free_state(ctx);
+  scratch->busy = false;
+  if (scratch->own)
+    return;
+  if ((own_scratch = thread_scratch_peek()) != NULL)
+  {
+    own_scratch->yajl_allocs += scratch->yajl_allocs;
+    own_scratch->mallocs += scratch->mallocs;
+  }
+  scan_scratch_free(scratch);
 }
 
 // noexcept
-static int scan_on_start_array(void *ctx)
+// Allocates the buffers by depth for the depths after old_max_path_len up to max_path_len, keeps the rest.
+// A node is matched only once at a depth, so there is room for the nodes at the depth and for the ones under
+// ANY_DEPTH, which can be matched at any depth
+static int scan_ctx_alloc_depths(scan_ctx *ctx, int old_max_path_len, int max_path_len)
 {
-  scan_ctx *sctx = (scan_ctx *)ctx;
-  // Save in the beginning in case of a partial value
-  save_root_info(sctx, array_sym, 1);
-  if (sctx->current_path_len > sctx->max_path_len)
+  int depths_len = max_path_len + 1, old_depths_len = old_max_path_len + 1, states_cap = ctx->states_cap;
+  void *ptr;
+#define SCAN_CTX_REALLOC(field, len)                                                 \
+  if ((ptr = realloc(ctx->field, sizeof(*ctx->field) * ((len) ? (len) : 1))) == NULL) \
+    return false;                                                                     \
+  ctx->field = ptr;
+  SCAN_CTX_REALLOC(states_offsets, depths_len)
+  SCAN_CTX_REALLOC(states_lens, depths_len)
+  SCAN_CTX_REALLOC(starts, depths_len)
+  SCAN_CTX_REALLOC(current_path, max_path_len)
+  if (max_path_len > ctx->key_bufs_len)
   {
-    sctx->current_path_len++;
-    return true;
+    SCAN_CTX_REALLOC(key_bufs, max_path_len)
+    for (int i = ctx->key_bufs_len; i < max_path_len; i++)
+    {
+      ctx->key_bufs[i].ptr = NULL;
+      ctx->key_bufs[i].cap = 0;
+    }
+    ctx->key_bufs_len = max_path_len;
   }
-  increment_arr_index(sctx);
-  sctx->starts[sctx->current_path_len] = scan_ctx_get_bytes_consumed(sctx) - 1;
-  if (sctx->current_path_len < sctx->max_path_len)
+  for (int i = old_depths_len; i < depths_len; i++)
+    ctx->states_lens[i] = ctx->floating_len;
+  for (int i = 0; i < ctx->nodes_len; i++)
   {
-    sctx->current_path[sctx->current_path_len].type = PATH_INDEX;
-    sctx->current_path[sctx->current_path_len].value.index = -1;
+    if (!ctx->nodes[i].floating && ctx->nodes[i].depth >= old_depths_len && ctx->nodes[i].depth < depths_len)
+      ctx->states_lens[ctx->nodes[i].depth]++;
   }
-  sctx->current_path_len++;
+  for (int i = old_depths_len; i < depths_len; i++)
+  {
+    ctx->states_offsets[i] = states_cap;
+    states_cap += ctx->states_lens[i];
+    ctx->states_lens[i] = 0;
+  }
+  SCAN_CTX_REALLOC(states, states_cap)
+#undef SCAN_CTX_REALLOC
+  ctx->states_cap = states_cap;
+  ctx->max_path_len = max_path_len;
   return true;
 }
 
 // noexcept
-static int scan_on_end_array(void *ctx)
+// Adds a node and the ANY_DEPTH nodes right below it, which match no path elements as well;
+// the ANY_DEPTH nodes can be reached more than once
+static inline void add_state(scan_ctx *ctx, int *states, int *states_len, int node)
 {
-  scan_ctx *sctx = (scan_ctx *)ctx;
-  sctx->current_path_len--;
-  if (sctx->current_path_len <= sctx->max_path_len)
-    save_point(sctx, array_value, 0);
-  return true;
+  for (; node >= 0; node = ctx->nodes[node].any_depth)
+  {
+    if (ctx->nodes[node].recursive)
+    {
+      for (int i = 0; i < *states_len; i++)
+      {
+        if (states[i] == node)
+          return;
+      }
+    }
+    states[(*states_len)++] = node;
+  }
 }
 
-static void selector_free(void *data)
+// noexcept
+// Allocates the buffers for a scan with the compiled paths, the buffers already there are reused
+static int scan_ctx_alloc_state(scan_ctx *ctx)
 {
-  scan_ctx_free((scan_ctx *)data);
-  ruby_xfree(data);
+  void *ptr;
+  ctx->states_cap = 0;
+  if (!scan_ctx_alloc_depths(ctx, -1, ctx->max_path_len))
+    return false;
+  if ((ptr = realloc(ctx->node_states, sizeof(trie_node_state_t) * ctx->nodes_len)) == NULL)
+    return false;
+  ctx->node_states = ptr;
+  ctx->states_lens[0] = 0;
+  add_state(ctx, ctx->states, &ctx->states_lens[0], 0);
+  return true;
 }
 
-static size_t selector_size(const void *data)
+// FIXME: This will cause memory leak if ruby_xmalloc raises
+// Builds the trie for already set paths, the buffers for a scan are allocated by scan_ctx_alloc_state
+static void scan_ctx_compile(scan_ctx *ctx)
 {
-  // see ObjectSpace.memsize_of
-  scan_ctx *ctx = (scan_ctx *)data;
-  size_t res = sizeof(scan_ctx);
-  // current_path
-  if (ctx->current_path != NULL)
-    res += ctx->max_path_len * sizeof(path_elem_t);
-  // starts
-  if (ctx->starts != NULL)
-    res += ctx->max_path_len * sizeof(size_t);
-  if (ctx->paths != NULL)
+  int nodes_cap = 1;
+  for (int i = 0; i < ctx->paths_len; i++)
+    nodes_cap += ctx->paths[i].len;
+  // never reallocated, so it's safe to keep pointers to nodes while adding children
+  ctx->nodes = ruby_xmalloc2(sizeof(trie_node_t), nodes_cap);
+  ctx->nodes_len = 0;
+  ctx->floating_len = 0;
+  ctx->string_predicates = false;
+  trie_new_node(ctx, -1, NULL);
+  for (int i = 0; i < ctx->paths_len; i++)
   {
-    res += ctx->paths_len * sizeof(paths_t);
-    for (int i = 0; i < ctx->paths_len; i++)
-    {
-      res += ctx->paths[i].len * sizeof(path_matcher_elem_t);
-    }
+    int node = 0;
+    if (ctx->paths[i].predicate != NULL && ctx->paths[i].predicate->eq_type == string_value)
+      ctx->string_predicates = true;
+    for (int j = 0; j < ctx->paths[i].len; j++)
+      node = trie_child(ctx, node, &ctx->paths[i].elems[j]);
+    ctx->nodes[node].path_ids = ruby_xrealloc2(ctx->nodes[node].path_ids, ctx->nodes[node].path_ids_len + 1, sizeof(int));
+    ctx->nodes[node].path_ids[ctx->nodes[node].path_ids_len++] = i;
+    for (; node >= 0; node = ctx->nodes[node].parent)
+      ctx->nodes[node].paths_below++;
   }
-  return res;
+  ctx->shared = false;
+  scan_ctx_init_state(ctx);
+  scan_ctx_init_saved(ctx);
+  ctx->handle = NULL;
+  ctx->chunk = NULL;
+  ctx->interrupted = false;
+  ctx->scratch = NULL;
 }
 
-static const rb_data_type_t selector_type = {
-    .wrap_struct_name = "json_scanner_selector",
-    .function = {
-        .dfree = selector_free,
-        .dsize = selector_size,
-    },
-    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
-};
+// Set is a core class since Ruby 3.5, before that it's defined by the set library
+static int path_elem_is_set(VALUE entry)
+{
+  ID set_id = rb_intern("Set");
+  return !RB_SPECIAL_CONST_P(entry) && rb_const_defined(rb_cObject, set_id) &&
+         rb_obj_is_kind_of(entry, rb_const_get(rb_cObject, set_id));
+}
 
-static VALUE selector_alloc(VALUE self)
+// Returns unique keys of the set as strings or Qundef if there are other elements
+static VALUE path_elem_set_keys(VALUE set)
 {
-  scan_ctx *ctx = ruby_xmalloc(sizeof(scan_ctx));
-  ctx->paths = NULL;
-  ctx->paths_len = 0;
-  ctx->current_path = NULL;
-  ctx->max_path_len = 0;
-  ctx->starts = NULL;
-  scan_ctx_reset(ctx, Qundef, Qundef, false, false);
-  return TypedData_Wrap_Struct(self, &selector_type, ctx);
+  VALUE keys = rb_funcall(set, rb_intern("to_a"), 0);
+  for (long i = 0; i < RARRAY_LEN(keys); i++)
+  {
+    VALUE key = rb_ary_entry(keys, i);
+    if (RB_SYMBOL_P(key))
+      rb_ary_store(keys, i, rb_sym2str(key));
+    else if (!RB_TYPE_P(key, T_STRING))
+      return Qundef;
+  }
+  rb_funcall(keys, rb_intern("uniq!"), 0);
+  return keys;
 }
 
-static VALUE selector_m_initialize(VALUE self, VALUE path_ary)
+// The trailing Hash of the path or Qundef
+static VALUE path_predicate(VALUE path)
 {
-  scan_ctx *ctx;
-  VALUE scan_ctx_init_err, string_keys;
-  TypedData_Get_Struct(self, scan_ctx, &selector_type, ctx);
-  string_keys = rb_ary_new();
-  scan_ctx_init_err = scan_ctx_init(ctx, path_ary, string_keys);
-  if (scan_ctx_init_err != Qundef)
+  VALUE last = rb_array_len(path) > 0 ? rb_ary_entry(path, -1) : Qnil;
+  return RB_TYPE_P(last, T_HASH) ? last : Qundef;
+}
+
+static int value_type_from_sym(VALUE sym)
+{
+  if (sym == null_sym)
+    return null_value;
+  if (sym == boolean_sym)
+    return boolean_value;
+  if (sym == number_sym)
+    return number_value;
+  if (sym == string_sym)
+    return string_value;
+  if (sym == object_sym)
+    return object_value;
+  if (sym == array_sym)
+    return array_value;
+  return -1;
+}
+
+static void path_predicate_set_digits(predicate_t *pred, VALUE integer)
+{
+  VALUE digits = rb_funcall(integer, rb_intern("to_s"), 0);
+  pred->eq_digits_len = (size_t)RSTRING_LEN(digits);
+  pred->eq_digits = ruby_xmalloc(pred->eq_digits_len);
+  memcpy(pred->eq_digits, RSTRING_PTR(digits), pred->eq_digits_len);
+}
+
+// {type: :number, eq: 42, in: (1..50)}, only validates the hash if pred is NULL;
+// numeric conversions can raise, so it's called before any allocations first
+static VALUE path_predicate_parse(VALUE hash, predicate_t *pred, VALUE string_keys)
+{
+  predicate_t tmp;
+  VALUE types = rb_hash_lookup2(hash, type_sym, Qundef), eq = rb_hash_lookup2(hash, eq_sym, Qundef),
+        range = rb_hash_lookup2(hash, in_sym, Qundef);
+  if (pred == NULL)
+    pred = &tmp;
+  if (RHASH_SIZE(hash) != (size_t)((types != Qundef) + (eq != Qundef) + (range != Qundef)))
+    return rb_exc_new_cstr(rb_eArgError, "predicates must have only type, eq and in keys");
+  pred->types = 0;
+  pred->eq_type = -1;
+  pred->eq_digits = NULL;
+  pred->has_range = false;
+  if (types != Qundef)
   {
-    rb_exc_raise(scan_ctx_init_err);
+    if (!RB_TYPE_P(types, T_ARRAY))
+      types = rb_ary_new_from_args(1, types);
+    for (long i = 0; i < RARRAY_LEN(types); i++)
+    {
+      int type = value_type_from_sym(rb_ary_entry(types, i));
+      if (type < 0)
+        return rb_exc_new_cstr(rb_eArgError, "predicate type must be :null, :boolean, :number, :string, :object or :array");
+      pred->types |= 1 << type;
+    }
   }
-  rb_iv_set(self, "string_keys", string_keys);
-  return self;
+  if (eq != Qundef)
+  {
+    switch (TYPE(eq))
+    {
+    case T_STRING:
+      if (string_keys != Qundef)
+      {
+        eq = rb_str_dup(eq);
+        rb_ary_push(string_keys, eq);
+      }
+      pred->eq_type = string_value;
+      pred->eq_str.val = RSTRING_PTR(eq);
+      pred->eq_str.len = (size_t)RSTRING_LEN(eq);
+      break;
+    case T_FIXNUM:
+    case T_BIGNUM:
+      pred->eq_type = number_value;
+      pred->eq_is_int = true;
+      pred->eq_num = NUM2DBL(eq);
+      // Integer#== is exact, 2**63 - 1 isn't equal to any double
+      pred->eq_num_exact = RTEST(rb_equal(DBL2NUM(pred->eq_num), eq));
+      if (pred != &tmp)
+        path_predicate_set_digits(pred, eq);
+      break;
+    case T_FLOAT:
+      pred->eq_type = number_value;
+      pred->eq_is_int = false;
+      pred->eq_num = RFLOAT_VALUE(eq);
+      pred->eq_num_exact = true;
+      if (pred != &tmp && isfinite(pred->eq_num) && pred->eq_num == floor(pred->eq_num))
+        path_predicate_set_digits(pred, rb_dbl2big(pred->eq_num));
+      break;
+    default:
+      return rb_exc_new_cstr(rb_eArgError, "predicate eq must be a string or a number");
+    }
+  }
+  if (range != Qundef)
+  {
+    VALUE range_beg, range_end;
+    int exclude_end;
+    if (rb_range_values(range, &range_beg, &range_end, &exclude_end) != Qtrue ||
+        (!NIL_P(range_beg) && !rb_obj_is_kind_of(range_beg, rb_cNumeric)) ||
+        (!NIL_P(range_end) && !rb_obj_is_kind_of(range_end, rb_cNumeric)))
+      return rb_exc_new_cstr(rb_eArgError, "predicate in must be a numeric range");
+    pred->has_range = true;
+    pred->range_begin = NIL_P(range_beg) ? -HUGE_VAL : NUM2DBL(range_beg);
+    pred->range_end = NIL_P(range_end) ? HUGE_VAL : NUM2DBL(range_end);
+    pred->range_exclude_end = exclude_end && !NIL_P(range_end);
+  }
+  return Qundef;
 }
 
-static VALUE selector_m_inspect(VALUE self)
+// FIXME: This will cause memory leak if ruby_xmalloc raises
+// path_ary must be RB_GC_GUARD-ed by the caller. key_tokens are given by Selector.compile: an array per path with the
+// JSON Pointer token for an index that is a key as well, nil for other elements, Qundef otherwise
+static VALUE scan_ctx_init(scan_ctx *ctx, VALUE path_ary, VALUE string_keys, VALUE key_tokens)
 {
-  scan_ctx *ctx;
-  VALUE res;
-  TypedData_Get_Struct(self, scan_ctx, &selector_type, ctx);
-  res = rb_sprintf("#<%" PRIsVALUE " [", rb_class_name(CLASS_OF(self)));
-  for (int i = 0; ctx->paths && i < ctx->paths_len; i++)
+  int path_ary_len, key_sets_len = 0;
+  paths_t *paths;
+  // keys of the sets in path_ary are converted once, so the second loop gets the same ones
+  VALUE key_sets = rb_ary_new();
+  // TODO: Allow to_ary and sized enumerables
+  rb_check_type(path_ary, T_ARRAY);
+  path_ary_len = rb_long2int(rb_array_len(path_ary));
+  // Check types early before any allocations, so exception is ok
+  // TODO: Fix this, just handle errors
+  // It's not possible that another Ruby thread changes path_ary items between these two loops, because C call holds GVL
+  for (int i = 0; i < path_ary_len; i++)
   {
-    rb_str_buf_cat_ascii(res, "[");
-    for (int j = 0; j < ctx->paths[i].len; j++)
+    int path_len;
+    VALUE path = rb_ary_entry(path_ary, i);
+    VALUE predicate;
+    rb_check_type(path, T_ARRAY);
+    predicate = path_predicate(path);
+    path_len = rb_long2int(rb_array_len(path) - (predicate != Qundef));
+    if (predicate != Qundef)
     {
-      switch (ctx->paths[i].elems[j].type)
+      VALUE predicate_err = path_predicate_parse(predicate, NULL, Qundef);
+      if (predicate_err != Qundef)
+        return predicate_err;
+    }
+    for (int j = 0; j < path_len; j++)
+    {
+      VALUE entry = rb_ary_entry(path, j);
+      if (path_elem_is_set(entry))
       {
-      case MATCHER_KEY:
-        rb_str_catf(res, "'%.*s'", (int)ctx->paths[i].elems[j].value.key.len, ctx->paths[i].elems[j].value.key.val);
-        break;
-      case MATCHER_INDEX:
-        rb_str_catf(res, "%ld", ctx->paths[i].elems[j].value.index);
-        break;
-      case MATCHER_INDEX_RANGE:
-        rb_str_catf(res, "(%ld..%ld)", ctx->paths[i].elems[j].value.range.start, ctx->paths[i].elems[j].value.range.end == LONG_MAX ? -1L : ctx->paths[i].elems[j].value.range.end);
+        VALUE keys = path_elem_set_keys(entry);
+        if (keys == Qundef)
+          return rb_exc_new_cstr(rb_eArgError, "sets in paths must contain only strings or symbols");
+        rb_long2int(RARRAY_LEN(keys));
+        for (long k = 0; k < RARRAY_LEN(keys); k++)
+        {
+#if LONG_MAX > SIZE_MAX
+          RSTRING_LENINT(rb_ary_entry(keys, k));
+#endif
+        }
+        rb_ary_push(key_sets, keys);
+        continue;
+      }
+      switch (TYPE(entry))
+      {
+      case T_SYMBOL:
+        entry = rb_sym2str(entry);
+        /* fall through */
+      case T_STRING:
+#if LONG_MAX > SIZE_MAX
+        RSTRING_LENINT(entry);
+#endif
         break;
-      case MATCHER_ANY_KEY:
-        rb_str_buf_cat_ascii(res, "('*'..'*')");
+      case T_FIXNUM:
+      case T_BIGNUM:
+        NUM2LONG(entry);
         break;
+      default:
+      {
+        VALUE range_beg, range_end;
+        long end_val;
+        int open_ended;
+        if (rb_range_values(entry, &range_beg, &range_end, &open_ended) != Qtrue)
+          return rb_exc_new_cstr(rb_eArgError, "path elements must be strings, integers, or ranges");
+        if ((range_beg != any_key_sym || range_end != any_key_sym) &&
+            (range_beg != any_depth_sym || range_end != any_depth_sym))
+        {
+          if (NUM2LONG(range_beg) < 0L)
+            return rb_exc_new_cstr(rb_eArgError, "range start must be positive");
+          end_val = NUM2LONG(range_end);
+          if (end_val < -1L)
+            return rb_exc_new_cstr(rb_eArgError, "range end must be positive or -1");
+          if (end_val == -1L && open_ended)
+            return rb_exc_new_cstr(rb_eArgError, "range with -1 end must be closed");
+        }
+      }
       }
-      if (j < ctx->paths[i].len - 1)
-        rb_str_buf_cat_ascii(res, ", ");
     }
-    rb_str_buf_cat_ascii(res, "]");
-    if (i < ctx->paths_len - 1)
-      rb_str_buf_cat_ascii(res, ", ");
   }
-  rb_str_buf_cat_ascii(res, "]>");
-  return res;
+
+  ctx->max_path_len = 0;
+
+  paths = ruby_xmalloc(sizeof(paths_t) * path_ary_len);
+  for (int i = 0; i < path_ary_len; i++)
+  {
+    int path_len;
+    VALUE path = rb_ary_entry(path_ary, i), predicate = path_predicate(path);
+    path_len = rb_long2int(rb_array_len(path) - (predicate != Qundef));
+    paths[i].predicate = NULL;
+    if (predicate != Qundef)
+    {
+      paths[i].predicate = ruby_xmalloc(sizeof(predicate_t));
+      path_predicate_parse(predicate, paths[i].predicate, string_keys);
+    }
+    if (path_len > ctx->max_path_len)
+      ctx->max_path_len = path_len;
+    paths[i].elems = ruby_xmalloc2(sizeof(path_matcher_elem_t), path_len);
+    for (int j = 0; j < path_len; j++)
+    {
+      VALUE entry = rb_ary_entry(path, j);
+      if (path_elem_is_set(entry))
+      {
+        VALUE keys = rb_ary_entry(key_sets, key_sets_len++);
+        keys_list_t *list = &paths[i].elems[j].value.keys;
+        paths[i].elems[j].type = MATCHER_KEYS_LIST;
+        list->len = (int)RARRAY_LEN(keys);
+        list->keys = ruby_xmalloc2(sizeof(hashkey_t), list->len);
+        for (int k = 0; k < list->len; k++)
+        {
+          VALUE key = rb_ary_entry(keys, k);
+          if (string_keys != Qundef)
+          {
+            key = rb_obj_freeze(rb_str_dup(key));
+            rb_ary_push(string_keys, key);
+          }
+          list->keys[k].val = RSTRING_PTR(key);
+          list->keys[k].len = (size_t)RSTRING_LEN(key);
+        }
+        continue;
+      }
+      switch (TYPE(entry))
+      {
+      case T_SYMBOL:
+        entry = rb_sym2str(entry);
+        /* fall through */
+      case T_STRING:
+      {
+        if (string_keys != Qundef)
+        {
+          // If string_keys is provided, we need to duplicate the string
+          // to avoid use-after-free issues and to add the newly created string to the string_keys array.
+          // In Ruby 2.2 and newer symbols can be GC-ed, so we need to duplicate them as well.
+          entry = rb_obj_freeze(rb_str_dup(entry));
+          rb_ary_push(string_keys, entry);
+        }
+        paths[i].elems[j].type = MATCHER_KEY;
+        paths[i].elems[j].value.key.val = RSTRING_PTR(entry);
+#if LONG_MAX > SIZE_MAX
+        paths[i].elems[j].value.key.len = RSTRING_LENINT(entry);
+#else
+        paths[i].elems[j].value.key.len = RSTRING_LEN(entry);
+#endif
+      }
+      break;
+      case T_FIXNUM:
+      case T_BIGNUM:
+      {
+        VALUE token = key_tokens == Qundef ? Qnil : rb_ary_entry(rb_ary_entry(key_tokens, i), j);
+        if (NIL_P(token))
+        {
+          paths[i].elems[j].type = MATCHER_INDEX;
+          paths[i].elems[j].value.index = FIX2LONG(entry);
+          break;
+        }
+        if (string_keys != Qundef)
+        {
+          token = rb_obj_freeze(rb_str_dup(token));
+          rb_ary_push(string_keys, token);
+        }
+        paths[i].elems[j].type = MATCHER_KEY_OR_INDEX;
+        paths[i].elems[j].value.key_or_index.index = NUM2LONG(entry);
+        paths[i].elems[j].value.key_or_index.key.val = RSTRING_PTR(token);
+        paths[i].elems[j].value.key_or_index.key.len = (size_t)RSTRING_LEN(token);
+      }
+      break;
+      default:
+      {
+        VALUE range_beg, range_end;
+        int open_ended;
+        rb_range_values(entry, &range_beg, &range_end, &open_ended);
+        if (range_beg == any_key_sym && range_end == any_key_sym)
+        {
+          paths[i].elems[j].type = MATCHER_ANY_KEY;
+        }
+        else if (range_beg == any_depth_sym && range_end == any_depth_sym)
+        {
+          paths[i].elems[j].type = MATCHER_ANY_DEPTH;
+        }
+        else
+        {
+          paths[i].elems[j].type = MATCHER_INDEX_RANGE;
+          paths[i].elems[j].value.range.start = NUM2LONG(range_beg);
+          paths[i].elems[j].value.range.end = NUM2LONG(range_end);
+          // (value..-1) works as expected, (value...-1) is forbidden above
+          if (paths[i].elems[j].value.range.end == -1L)
+            paths[i].elems[j].value.range.end = LONG_MAX;
+          // -1 here is fine, so, (0...0) works just as expected - doesn't match anything
+          if (open_ended)
+            paths[i].elems[j].value.range.end--;
+        }
+      }
+      }
+    }
+    paths[i].len = path_len;
+  }
+
+  ctx->paths = paths;
+  ctx->paths_len = path_ary_len;
+  scan_ctx_compile(ctx);
+  RB_GC_GUARD(key_sets);
+  return Qundef; // no error
+}
+
+// Shares the compiled paths of src, which must outlive ctx and stays unchanged, so any number of scans
+// can use it at once. The buffers for the scan are allocated by scan_ctx_alloc_state or taken from the scratch
+static void scan_ctx_init_shared(scan_ctx *ctx, const scan_ctx *src)
+{
+  *ctx = *src;
+  ctx->shared = true;
+  scan_ctx_init_state(ctx);
+  scan_ctx_init_saved(ctx);
+  ctx->handle = NULL;
+  ctx->chunk = NULL;
+  ctx->interrupted = false;
+  ctx->scratch = NULL;
+}
+
+// resets temporary values in the selector
+static void scan_ctx_reset(scan_ctx *ctx, VALUE points_list, VALUE roots_info_list, int with_path, int symbolize_path_keys, int stop_early)
+{
+  for (int i = 0; ctx->node_states && i < ctx->nodes_len; i++)
+  {
+    ctx->node_states[i].done = false;
+    ctx->node_states[i].done_paths = 0;
+  }
+  ctx->done_paths_len = 0;
+  ctx->current_path_len = 0;
+  // ctx->rb_err = Qnil;
+  ctx->handle = NULL;
+  ctx->yajl_bytes_consumed = 0;
+  ctx->points_list = points_list;
+  ctx->roots_info_list = roots_info_list;
+  ctx->with_path = with_path;
+  ctx->symbolize_path_keys = symbolize_path_keys;
+  ctx->stop_early = stop_early;
+  ctx->chunk = NULL;
+  ctx->chunk_len = 0;
+  ctx->streaming = false;
+  ctx->quote_pos = 0;
+  ctx->odd_backslashes = false;
+  ctx->skip_fast = false;
+  ctx->skip_pending = false;
+  ctx->parse_text = Qfalse;
+  ctx->aggregate = 0;
+  ctx->saved_points_len = 0;
+  ctx->saved_path_len = 0;
+  ctx->saved_keys_len = 0;
+  ctx->saved_roots_len = 0;
+  ctx->stats = NULL;
+  ctx->checkpoints = false;
+  ctx->checkpoint.offset = 0;
+  ctx->checkpoint.depth = -1;
+  ctx->checkpoint.index = 0;
+  ctx->checkpoint.start = 0;
+  ctx->checkpoint.roots = 0;
+  ctx->checkpoint.done_len = 0;
+  ctx->roots = 0;
+  ctx->done_log_len = 0;
+  ctx->resumed = false;
+  ctx->nomem = false;
+}
+
+static void scan_ctx_free(scan_ctx *ctx)
+{
+  // fprintf(stderr, "scan_ctx_free\n");
+  if (!ctx)
+    return;
+  scan_ctx_free_state(ctx);
+  scan_ctx_free_saved(ctx);
+  if (ctx->shared)
+    return;
+  if (ctx->nodes)
+  {
+    for (int i = 0; i < ctx->nodes_len; i++)
+    {
+      ruby_xfree(ctx->nodes[i].keys.slots);
+      ruby_xfree(ctx->nodes[i].indexes);
+      ruby_xfree(ctx->nodes[i].ranges);
+      for (int j = 0; j < ctx->nodes[i].key_sets_len; j++)
+        ruby_xfree(ctx->nodes[i].key_sets[j].keys.slots);
+      ruby_xfree(ctx->nodes[i].key_sets);
+      ruby_xfree(ctx->nodes[i].keys_or_indexes);
+      ruby_xfree(ctx->nodes[i].path_ids);
+    }
+    ruby_xfree(ctx->nodes);
+  }
+  if (!ctx->paths)
+    return;
+  for (int i = 0; i < ctx->paths_len; i++)
+  {
+    for (int j = 0; j < ctx->paths[i].len; j++)
+    {
+      if (ctx->paths[i].elems[j].type == MATCHER_KEYS_LIST)
+        ruby_xfree(ctx->paths[i].elems[j].value.keys.keys);
+    }
+    ruby_xfree(ctx->paths[i].elems);
+    if (ctx->paths[i].predicate != NULL)
+      ruby_xfree(ctx->paths[i].predicate->eq_digits);
+    ruby_xfree(ctx->paths[i].predicate);
+  }
+  ruby_xfree(ctx->paths);
+}
+
+// noexcept
+// current_path[depth] has changed, finds the trie nodes matching it among the children of the nodes
+// matching the path above, everything deeper is gone
+static void update_states(scan_ctx *sctx, int depth)
+{
+  path_elem_t *elem = &sctx->current_path[depth];
+  int *parents = &sctx->states[sctx->states_offsets[depth]];
+  int *states = &sctx->states[sctx->states_offsets[depth + 1]];
+  int parents_len = sctx->states_lens[depth], states_len = 0;
+  unsigned int hash = 0;
+  int hashed = false;
+  for (int i = 0; i < parents_len; i++)
+  {
+    trie_node_t *node = &sctx->nodes[parents[i]];
+    int child;
+    if (node->recursive)
+      add_state(sctx, states, &states_len, parents[i]);
+    if (elem->type == PATH_KEY)
+    {
+      if (!hashed && (node->keys.len || node->key_sets_len))
+      {
+        hash = trie_key_hash(elem->value.key.val, elem->value.key.len);
+        hashed = true;
+      }
+      if (node->keys.len && (child = trie_find_key(&node->keys, elem->value.key.val, elem->value.key.len, hash)) >= 0)
+        add_state(sctx, states, &states_len, child);
+      for (int j = 0; j < node->key_sets_len; j++)
+      {
+        if (trie_find_key(&node->key_sets[j].keys, elem->value.key.val, elem->value.key.len, hash) >= 0)
+          add_state(sctx, states, &states_len, node->key_sets[j].node);
+      }
+      for (int j = 0; j < node->keys_or_indexes_len; j++)
+      {
+        hashkey_t *key = &node->keys_or_indexes[j].key_or_index.key;
+        if (key->len == elem->value.key.len && memcmp(key->val, elem->value.key.val, key->len) == 0)
+          add_state(sctx, states, &states_len, node->keys_or_indexes[j].node);
+      }
+      if (node->any_key >= 0)
+        add_state(sctx, states, &states_len, node->any_key);
+    }
+    else
+    {
+      if (node->indexes_len && (child = trie_find_index(node, elem->value.index, NULL)) >= 0)
+        add_state(sctx, states, &states_len, child);
+      for (int j = 0; j < node->keys_or_indexes_len; j++)
+      {
+        if (node->keys_or_indexes[j].key_or_index.index == elem->value.index)
+          add_state(sctx, states, &states_len, node->keys_or_indexes[j].node);
+      }
+      for (int j = 0; j < node->ranges_len; j++)
+      {
+        if (elem->value.index >= node->ranges[j].range.start && elem->value.index <= node->ranges[j].range.end)
+          add_state(sctx, states, &states_len, node->ranges[j].node);
+      }
+    }
+  }
+  sctx->states_lens[depth + 1] = states_len;
+}
+
+// noexcept
+static inline void increment_arr_index(scan_ctx *sctx)
+{
+  // remember - any value can be root
+  // TODO: Maybe make current_path_len 1 shorter and get rid of -1; need to change all compares
+  if (sctx->current_path_len && sctx->current_path[sctx->current_path_len - 1].type == PATH_INDEX)
+  {
+    sctx->current_path[sctx->current_path_len - 1].value.index++;
+    update_states(sctx, sctx->current_path_len - 1);
+  }
+}
+
+// noexcept
+static inline int chunk_contains(scan_ctx *sctx, const unsigned char *ptr)
+{
+  return sctx->chunk != NULL && ptr >= sctx->chunk && ptr < sctx->chunk + sctx->chunk_len;
+}
+
+// noexcept
+static inline int quote_escaped(scan_ctx *sctx, const unsigned char *chunk, size_t pos)
+{
+  size_t i = pos;
+  while (i > 0 && chunk[i - 1] == '\\')
+    i--;
+  return ((pos - i) + (i == 0 ? sctx->odd_backslashes : 0)) & 1;
+}
+
+// noexcept
+// Length of the string token which has just ended, yajl passes the decoded value if there are escapes
+// or if the token spans chunks, otherwise val points into the chunk
+static size_t string_token_len(scan_ctx *sctx, const unsigned char *val, size_t len)
+{
+  size_t end;
+  if (sctx->chunk == NULL || chunk_contains(sctx, val))
+    return len + 2;
+  end = yajl_get_bytes_consumed(sctx->handle);
+  // chunk[end - 1] is the closing quote, the first unescaped quote before it is the opening one
+  for (size_t i = end - 1; i-- > 0;)
+  {
+    if (sctx->chunk[i] == '"' && !quote_escaped(sctx, sctx->chunk, i))
+      return end - i;
+  }
+  // the string began in one of the previous chunks
+  return scan_ctx_get_bytes_consumed(sctx) - sctx->quote_pos;
+}
+
+// noexcept
+// Must be called before scan_ctx_save_bytes_consumed, remembers where the last string began in case it's not closed yet
+static void scan_ctx_save_chunk_quotes(scan_ctx *ctx)
+{
+  size_t i;
+  for (i = ctx->chunk_len; i-- > 0;)
+  {
+    if (ctx->chunk[i] == '"' && !quote_escaped(ctx, ctx->chunk, i))
+    {
+      ctx->quote_pos = ctx->yajl_bytes_consumed + i;
+      break;
+    }
+  }
+  for (i = ctx->chunk_len; i > 0 && ctx->chunk[i - 1] == '\\'; i--)
+    ;
+  if (i == 0)
+    ctx->odd_backslashes ^= ctx->chunk_len & 1;
+  else
+    ctx->odd_backslashes = (ctx->chunk_len - i) & 1;
+}
+
+// noexcept, doesn't need the GVL
+// Escaped keys are decoded into a yajl buffer, which is reused, and stream chunks don't outlive feed calls,
+// so keys needed for paths are copied into a buffer owned by the depth
+static const unsigned char *copy_key(scan_ctx *sctx, int depth, const unsigned char *key, size_t len)
+{
+  key_buf_t *buf = &sctx->key_bufs[depth];
+  if (len == 0)
+    return key;
+  if (buf->cap < len)
+  {
+    char *ptr = realloc(buf->ptr, len);
+    if (ptr == NULL)
+    {
+      sctx->nomem = true;
+      return key;
+    }
+    buf->ptr = ptr;
+    buf->cap = len;
+  }
+  memcpy(buf->ptr, key, len);
+  return (const unsigned char *)buf->ptr;
+}
+
+// noexcept, doesn't need the GVL
+static inline int scan_ctx_aborted(scan_ctx *sctx)
+{
+  return sctx->nomem || sctx->interrupted;
+}
+
+// noexcept, doesn't need the GVL
+// Grows a buffer for saved matches to fit len items, sets nomem if it can't
+static int scan_ctx_reserve(scan_ctx *sctx, void **buf, size_t *cap, size_t len, size_t size)
+{
+  size_t new_cap = *cap ? *cap : 16;
+  void *grown;
+  if (len <= *cap)
+    return true;
+  while (new_cap < len)
+    new_cap *= 2;
+  grown = realloc(*buf, new_cap * size);
+  if (sctx->scratch)
+    sctx->scratch->mallocs++;
+  if (grown == NULL)
+  {
+    sctx->nomem = true;
+    return false;
+  }
+  *buf = grown;
+  *cap = new_cap;
+  return true;
+}
+
+// noexcept, doesn't need the GVL
+// Keys don't outlive chunks and key buffers are reused, so they are copied as well
+static int save_path(scan_ctx *sctx, size_t *path_pos)
+{
+  if (!scan_ctx_reserve(sctx, (void **)&sctx->saved_path, &sctx->saved_path_cap,
+                        sctx->saved_path_len + sctx->current_path_len, sizeof(saved_path_elem_t)))
+    return false;
+  *path_pos = sctx->saved_path_len;
+  for (int i = 0; i < sctx->current_path_len; i++)
+  {
+    saved_path_elem_t *elem = &sctx->saved_path[sctx->saved_path_len + i];
+    elem->type = sctx->current_path[i].type;
+    if (elem->type == PATH_INDEX)
+    {
+      elem->value.index = sctx->current_path[i].value.index;
+      continue;
+    }
+    elem->value.key.pos = sctx->saved_keys_len;
+    elem->value.key.len = sctx->current_path[i].value.key.len;
+    if (elem->value.key.len == 0)
+      continue;
+    if (!scan_ctx_reserve(sctx, (void **)&sctx->saved_keys, &sctx->saved_keys_cap,
+                          sctx->saved_keys_len + elem->value.key.len, sizeof(char)))
+      return false;
+    memcpy(sctx->saved_keys + sctx->saved_keys_len, sctx->current_path[i].value.key.val, elem->value.key.len);
+    sctx->saved_keys_len += elem->value.key.len;
+  }
+  sctx->saved_path_len += sctx->current_path_len;
+  return true;
+}
+
+// noexcept, doesn't need the GVL
+static inline void save_root_info(scan_ctx *sctx, value_type type, size_t len)
+{
+  if (sctx->roots_info_list != Qundef && sctx->current_path_len == 0 &&
+      scan_ctx_reserve(sctx, (void **)&sctx->saved_roots, &sctx->saved_roots_cap, sctx->saved_roots_len + 1,
+                       sizeof(saved_root_t)))
+  {
+    saved_root_t *root = &sctx->saved_roots[sctx->saved_roots_len++];
+    root->type = type;
+    root->begin = scan_ctx_get_bytes_consumed(sctx) - len;
+  }
+}
+
+// noexcept, doesn't need the GVL
+// Zeroes the counters, a restarted scan starts over
+static int scan_ctx_reset_aggregates(scan_ctx *ctx)
+{
+  if (ctx->aggregates == NULL)
+    ctx->aggregates = calloc(ctx->paths_len ? ctx->paths_len : 1, sizeof(aggregate_t));
+  if (ctx->aggregates == NULL)
+    return false;
+  for (int i = 0; i < ctx->paths_len; i++)
+  {
+    aggregate_t *agg = &ctx->aggregates[i];
+    aggregate_key_t *keys = agg->keys;
+    size_t keys_cap = agg->keys_cap;
+    memset(agg, 0, sizeof(aggregate_t));
+    if (keys != NULL)
+      memset(keys, 0, keys_cap * sizeof(aggregate_key_t));
+    agg->keys = keys;
+    agg->keys_cap = keys_cap;
+  }
+  return true;
+}
+
+// noexcept, doesn't need the GVL
+// The text of a JSON number isn't null-terminated, integers fitting 64 bits are read exactly
+static double number_text_value(const unsigned char *val, size_t len, int *is_int, long long *int_val)
+{
+  char buf[64], *str = buf;
+  double res;
+  size_t digits = len > 0 && val[0] == '-' ? len - 1 : len;
+  *is_int = digits > 0 && digits <= 19;
+  for (size_t i = len - digits; *is_int && i < len; i++)
+    *is_int = val[i] >= '0' && val[i] <= '9';
+  if (*is_int)
+  {
+    unsigned long long abs_val = 0;
+    for (size_t i = len - digits; i < len; i++)
+      abs_val = abs_val * 10 + (unsigned long long)(val[i] - '0');
+    if (abs_val <= (unsigned long long)LLONG_MAX + (digits < len))
+    {
+      *int_val = digits < len ? (long long)(0 - abs_val) : (long long)abs_val;
+      return (double)*int_val;
+    }
+    *is_int = false;
+  }
+  if (len >= sizeof(buf) && (str = malloc(len + 1)) == NULL)
+    return NAN;
+  memcpy(str, val, len);
+  str[len] = '\0';
+  res = strtod(str, NULL);
+  if (str != buf)
+    free(str);
+  return res;
+}
+
+// noexcept, doesn't need the GVL
+// Integer texts are compared with the digits of eq, so integers of any size are compared exactly
+static int predicate_number_eq(predicate_t *pred, const unsigned char *val, size_t len, double num)
+{
+  size_t i = len > 0 && val[0] == '-';
+  while (i < len && val[i] >= '0' && val[i] <= '9')
+    i++;
+  if (i < len)
+    return pred->eq_num_exact && num == pred->eq_num;
+  // -0 is 0
+  if (len == 2 && val[0] == '-' && val[1] == '0')
+  {
+    val++;
+    len--;
+  }
+  return pred->eq_digits != NULL && len == pred->eq_digits_len && memcmp(val, pred->eq_digits, len) == 0;
+}
+
+// noexcept, doesn't need the GVL
+static int predicate_match(scan_ctx *sctx, predicate_t *pred, value_type type)
+{
+  if (pred->types && !(pred->types & (1 << type)))
+    return false;
+  if (pred->eq_type == string_value && (type != string_value || sctx->value_len != pred->eq_str.len ||
+                                        memcmp(sctx->value, pred->eq_str.val, sctx->value_len) != 0))
+    return false;
+  if (pred->eq_type == number_value || pred->has_range)
+  {
+    int is_int;
+    long long int_val;
+    double num;
+    if (type != number_value)
+      return false;
+    num = number_text_value(sctx->value, sctx->value_len, &is_int, &int_val);
+    // only a long number text that can't be copied
+    if (isnan(num))
+    {
+      sctx->nomem = true;
+      return false;
+    }
+    if (pred->eq_type == number_value && !predicate_number_eq(pred, sctx->value, sctx->value_len, num))
+      return false;
+    if (pred->has_range &&
+        (num < pred->range_begin || num > pred->range_end || (pred->range_exclude_end && num == pred->range_end)))
+      return false;
+  }
+  return true;
+}
+
+// noexcept, doesn't need the GVL
+static void aggregate_key(scan_ctx *sctx, aggregate_t *agg, const char *key, size_t len)
+{
+  unsigned int hash = trie_key_hash(key, len);
+  size_t mask;
+  if ((agg->keys_len + 1) * 2 > agg->keys_cap)
+  {
+    size_t cap = agg->keys_cap ? agg->keys_cap * 2 : 16;
+    aggregate_key_t *keys = calloc(cap, sizeof(aggregate_key_t));
+    if (keys == NULL)
+    {
+      sctx->nomem = true;
+      return;
+    }
+    for (size_t i = 0; i < agg->keys_cap; i++)
+    {
+      size_t j;
+      if (!agg->keys[i].count)
+        continue;
+      for (j = agg->keys[i].hash & (cap - 1); keys[j].count; j = (j + 1) & (cap - 1))
+        ;
+      keys[j] = agg->keys[i];
+    }
+    free(agg->keys);
+    agg->keys = keys;
+    agg->keys_cap = cap;
+  }
+  mask = agg->keys_cap - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask)
+  {
+    aggregate_key_t *slot = &agg->keys[i];
+    if (!slot->count)
+    {
+      if (!scan_ctx_reserve(sctx, (void **)&sctx->saved_keys, &sctx->saved_keys_cap, sctx->saved_keys_len + len,
+                            sizeof(char)))
+        return;
+      memcpy(sctx->saved_keys + sctx->saved_keys_len, key, len);
+      slot->pos = sctx->saved_keys_len;
+      slot->len = len;
+      slot->hash = hash;
+      slot->count = 1;
+      sctx->saved_keys_len += len;
+      agg->keys_len++;
+      return;
+    }
+    if (slot->hash == hash && slot->len == len && !memcmp(sctx->saved_keys + slot->pos, key, len))
+    {
+      slot->count++;
+      return;
+    }
+  }
+}
+
+// noexcept, doesn't need the GVL
+// Integers are compared exactly, doubles can't tell apart the large ones
+static int aggregate_less(int a_is_int, long long a_int, double a, int b_is_int, long long b_int, double b)
+{
+  return a_is_int && b_is_int ? a_int < b_int : a < b;
+}
+
+// noexcept, doesn't need the GVL
+// The Kahan-Babuska summation of Array#sum, infinities and NaN are kept as they are
+static void aggregate_float_sum(aggregate_t *agg, double num)
+{
+  double sum = agg->float_sum, t;
+  if (isnan(sum))
+    return;
+  if (isnan(num) || isinf(num))
+  {
+    agg->float_sum = isinf(sum) && isinf(num) && signbit(sum) != signbit(num) ? NAN : num;
+    return;
+  }
+  if (isinf(sum))
+    return;
+  t = sum + num;
+  if (fabs(sum) >= fabs(num))
+    agg->float_sum_c += (sum - t) + num;
+  else
+    agg->float_sum_c += (num - t) + sum;
+  agg->float_sum = t;
+}
+
+static void aggregate_point(scan_ctx *sctx, aggregate_t *agg, value_type type)
+{
+  agg->count++;
+  if (type == number_value && (sctx->aggregate & (AGGREGATE_SUM | AGGREGATE_MIN | AGGREGATE_MAX)))
+  {
+    int is_int;
+    long long int_val;
+    double num = number_text_value(sctx->value, sctx->value_len, &is_int, &int_val);
+    if (isnan(num))
+    {
+      sctx->nomem = true;
+      return;
+    }
+    if (is_int)
+    {
+      unsigned long long int_sum = agg->int_sum + (unsigned long long)int_val;
+      agg->int_sum_high += (int_sum < agg->int_sum) - (int_val < 0);
+      agg->int_sum = int_sum;
+    }
+    else
+    {
+      aggregate_float_sum(agg, num);
+      agg->floats++;
+    }
+    if (!agg->numbers || aggregate_less(is_int, int_val, num, agg->min_is_int, agg->min_int, agg->min))
+    {
+      agg->min = num;
+      agg->min_is_int = is_int;
+      agg->min_int = int_val;
+    }
+    if (!agg->numbers || aggregate_less(agg->max_is_int, agg->max_int, agg->max, is_int, int_val, num))
+    {
+      agg->max = num;
+      agg->max_is_int = is_int;
+      agg->max_int = int_val;
+    }
+    agg->numbers++;
+  }
+  if ((sctx->aggregate & AGGREGATE_KEY_HISTOGRAM) && sctx->current_path_len > 0 &&
+      sctx->current_path[sctx->current_path_len - 1].type == PATH_KEY)
+    aggregate_key(sctx, agg, sctx->current_path[sctx->current_path_len - 1].value.key.val,
+                  sctx->current_path[sctx->current_path_len - 1].value.key.len);
+}
+
+// noexcept, doesn't need the GVL
+static void save_point(scan_ctx *sctx, value_type type, size_t length)
+{
+  size_t end = scan_ctx_get_bytes_consumed(sctx), path_pos = 0, value_pos = 0;
+  int saved = false;
+  int *states = &sctx->states[sctx->states_offsets[sctx->current_path_len]];
+  for (int i = 0; i < sctx->states_lens[sctx->current_path_len]; i++)
+  {
+    trie_node_t *node = &sctx->nodes[states[i]];
+    for (int j = 0; j < node->path_ids_len; j++)
+    {
+      saved_point_t *point;
+      predicate_t *pred = sctx->paths[node->path_ids[j]].predicate;
+      if (pred != NULL && !predicate_match(sctx, pred, type))
+        continue;
+      if (sctx->aggregate)
+      {
+        if (sctx->aggregates != NULL)
+          aggregate_point(sctx, &sctx->aggregates[node->path_ids[j]], type);
+        continue;
+      }
+      if (!scan_ctx_reserve(sctx, (void **)&sctx->saved_points, &sctx->saved_points_cap, sctx->saved_points_len + 1,
+                            sizeof(saved_point_t)))
+        return;
+      if (!saved && sctx->with_path && !save_path(sctx, &path_pos))
+        return;
+      if (!saved && sctx->values && (type == number_value || type == string_value))
+      {
+        if (!scan_ctx_reserve(sctx, (void **)&sctx->saved_keys, &sctx->saved_keys_cap,
+                              sctx->saved_keys_len + sctx->value_len, sizeof(char)))
+          return;
+        memcpy(sctx->saved_keys + sctx->saved_keys_len, sctx->value, sctx->value_len);
+        value_pos = sctx->saved_keys_len;
+        sctx->saved_keys_len += sctx->value_len;
+      }
+      point = &sctx->saved_points[sctx->saved_points_len++];
+      point->begin = type == object_value || type == array_value ? sctx->starts[sctx->current_path_len] : end - length;
+      point->end = end;
+      point->type = type;
+      point->path_id = node->path_ids[j];
+      point->same_value = saved;
+      point->path_len = sctx->current_path_len;
+      point->path_pos = path_pos;
+      point->value_pos = value_pos;
+      point->value_len = sctx->value_len;
+      point->root = sctx->saved_roots_len ? sctx->saved_roots_len - 1 : 0;
+      saved = true;
+    }
+  }
+}
+
+// format: :packed stores each match as a fixed-width record: little-endian uint64 begin and end, then a type byte
+#define PACKED_RECORD_SIZE 17
+
+typedef struct
+{
+  VALUE data;
+} packed_result;
+
+static void packed_result_mark(void *data)
+{
+  rb_gc_mark(((packed_result *)data)->data);
+}
+
+static size_t packed_result_size(const void *data)
+{
+  return sizeof(packed_result);
+}
+
+static const rb_data_type_t packed_result_type = {
+    .wrap_struct_name = "json_scanner_packed_result",
+    .function = {
+        .dmark = packed_result_mark,
+        .dfree = RUBY_DEFAULT_FREE,
+        .dsize = packed_result_size,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE packed_result_alloc(VALUE self)
+{
+  packed_result *packed;
+  VALUE res = TypedData_Make_Struct(self, packed_result, &packed_result_type, packed);
+  packed->data = Qnil;
+  return res;
+}
+
+static VALUE packed_result_new(void)
+{
+  VALUE res = packed_result_alloc(rb_cJsonScannerPackedResult);
+  // binary, appended to by scan_ctx_save_results
+  ((packed_result *)RTYPEDDATA_DATA(res))->data = rb_str_buf_new(0);
+  return res;
+}
+
+static VALUE packed_result_data(VALUE self)
+{
+  packed_result *packed;
+  TypedData_Get_Struct(self, packed_result, &packed_result_type, packed);
+  if (packed->data == Qnil)
+    rb_raise(rb_eRuntimeError, "uninitialized %" PRIsVALUE, rb_obj_class(self));
+  return packed->data;
+}
+
+static void packed_result_append(VALUE self, size_t begin, size_t end, value_type type)
+{
+  unsigned char record[PACKED_RECORD_SIZE];
+  for (int i = 0; i < 8; i++)
+  {
+    record[i] = (unsigned char)((uint64_t)begin >> (i * 8));
+    record[8 + i] = (unsigned char)((uint64_t)end >> (i * 8));
+  }
+  record[16] = (unsigned char)type;
+  rb_str_cat(((packed_result *)RTYPEDDATA_DATA(self))->data, (const char *)record, PACKED_RECORD_SIZE);
+}
+
+static inline uint64_t packed_result_read_u64(const unsigned char *ptr)
+{
+  uint64_t res = 0;
+  for (int i = 7; i >= 0; i--)
+    res = (res << 8) | ptr[i];
+  return res;
+}
+
+static long packed_result_len(VALUE self)
+{
+  return RSTRING_LEN(packed_result_data(self)) / PACKED_RECORD_SIZE;
+}
+
+// Returns a pointer to the i-th record or NULL, negative indexes count from the end
+static const unsigned char *packed_result_record(VALUE self, VALUE index)
+{
+  long i = NUM2LONG(index), len = packed_result_len(self);
+  if (i < 0)
+    i += len;
+  if (i < 0 || i >= len)
+    return NULL;
+  return (const unsigned char *)RSTRING_PTR(packed_result_data(self)) + i * PACKED_RECORD_SIZE;
+}
+
+static VALUE value_type_sym(value_type type);
+
+static VALUE packed_result_point(const unsigned char *record)
+{
+  return rb_ary_new_from_args(3, ULL2NUM(packed_result_read_u64(record)), ULL2NUM(packed_result_read_u64(record + 8)),
+                              value_type_sym((value_type)record[16]));
+}
+
+/*
+ * call-seq:
+ *   JsonScanner::PackedResult.new(data)
+ *
+ * Wraps +data+ produced by <tt>format: :packed</tt>, e.g. saved with PackedResult#data
+ */
+static VALUE packed_result_m_initialize(VALUE self, VALUE data)
+{
+  packed_result *packed;
+  TypedData_Get_Struct(self, packed_result, &packed_result_type, packed);
+  StringValue(data);
+  if (RSTRING_LEN(data) % PACKED_RECORD_SIZE != 0)
+    rb_raise(rb_eArgError, "data size must be a multiple of %d", PACKED_RECORD_SIZE);
+  for (long i = PACKED_RECORD_SIZE - 1; i < RSTRING_LEN(data); i += PACKED_RECORD_SIZE)
+  {
+    if ((unsigned char)RSTRING_PTR(data)[i] > array_value)
+      rb_raise(rb_eArgError, "invalid value type at %ld", i / PACKED_RECORD_SIZE);
+  }
+  RB_OBJ_WRITE(self, &packed->data, rb_str_new_frozen(data));
+  return self;
+}
+
+// Frozen binary string with the records
+static VALUE packed_result_m_data(VALUE self)
+{
+  return rb_str_new_frozen(packed_result_data(self));
+}
+
+static VALUE packed_result_m_size(VALUE self)
+{
+  return LONG2NUM(packed_result_len(self));
+}
+
+// Returns [begin, end, type] like scan does or nil
+static VALUE packed_result_m_aref(VALUE self, VALUE index)
+{
+  const unsigned char *record = packed_result_record(self, index);
+  return record ? packed_result_point(record) : Qnil;
+}
+
+static VALUE packed_result_enum_size(VALUE self, VALUE args, VALUE eobj)
+{
+  return packed_result_m_size(self);
+}
+
+static VALUE packed_result_m_each(VALUE self)
+{
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, packed_result_enum_size);
+  // the block may hold a reference to the data, yet it's never changed after the scan
+  for (long i = 0; i < packed_result_len(self); i++)
+    rb_yield(packed_result_point((const unsigned char *)RSTRING_PTR(packed_result_data(self)) + i * PACKED_RECORD_SIZE));
+  return self;
+}
+
+// Returns the i-th matched value of json_str as a string or nil
+static VALUE packed_result_m_byteslice_for(VALUE self, VALUE json_str, VALUE index)
+{
+  const unsigned char *record = packed_result_record(self, index);
+  uint64_t begin, end;
+  StringValue(json_str);
+  if (!record)
+    return Qnil;
+  begin = packed_result_read_u64(record);
+  end = packed_result_read_u64(record + 8);
+  if (end > (uint64_t)RSTRING_LEN(json_str) || begin > end)
+    rb_raise(rb_eIndexError, "match %" PRIu64 "...%" PRIu64 " is out of the string", begin, end);
+  return rb_str_subseq(json_str, (long)begin, (long)(end - begin));
+}
+
+static VALUE packed_result_m_inspect(VALUE self)
+{
+  return rb_sprintf("#<%" PRIsVALUE " size=%ld>", rb_class_name(CLASS_OF(self)), packed_result_len(self));
+}
+
+static VALUE value_type_sym(value_type type)
+{
+  switch (type)
+  {
+  case null_value:
+    return null_sym;
+  case boolean_value:
+    return boolean_sym;
+  case number_value:
+    return number_sym;
+  case string_value:
+    return string_sym;
+  case object_value:
+    return object_sym;
+  case array_value:
+    return array_sym;
+  }
+  return Qnil;
+}
+
+static VALUE create_path(scan_ctx *ctx, saved_point_t *point)
+{
+  VALUE path = rb_ary_new_capa(point->path_len);
+  for (int i = 0; i < point->path_len; i++)
+  {
+    saved_path_elem_t *elem = &ctx->saved_path[point->path_pos + i];
+    VALUE entry;
+    switch (elem->type)
+    {
+    case PATH_KEY:
+      if (ctx->symbolize_path_keys)
+        entry = rb_id2sym(rb_intern2(ctx->saved_keys + elem->value.key.pos, elem->value.key.len));
+      else
+        entry = rb_str_new(ctx->saved_keys + elem->value.key.pos, elem->value.key.len);
+      break;
+    case PATH_INDEX:
+      entry = LONG2NUM(elem->value.index);
+      break;
+    default:
+      entry = Qnil;
+    }
+    rb_ary_push(path, entry);
+  }
+  return path;
+}
+
+// The text is a valid JSON number
+static VALUE number_value_new(const char *num, size_t len)
+{
+  char buf[64];
+  size_t i = num[0] == '-';
+  unsigned long long value = 0;
+  for (size_t j = i; j < len; j++)
+  {
+    if (num[j] < '0' || num[j] > '9')
+    {
+      VALUE str;
+      if (len < sizeof(buf))
+      {
+        memcpy(buf, num, len);
+        buf[len] = '\0';
+        return DBL2NUM(strtod(buf, NULL));
+      }
+      str = rb_str_new(num, len);
+      return DBL2NUM(strtod(RSTRING_PTR(str), NULL));
+    }
+  }
+  // fits into long long
+  if (len - i > 18)
+    return rb_str_to_inum(rb_str_new(num, len), 10, false);
+  for (; i < len; i++)
+    value = value * 10 + (unsigned long long)(num[i] - '0');
+  return LL2NUM(num[0] == '-' ? -(long long)value : (long long)value);
+}
+
+static VALUE saved_value_new(scan_ctx *ctx, saved_point_t *point)
+{
+  switch (point->type)
+  {
+  case boolean_value:
+    return point->end - point->begin == 4 ? Qtrue : Qfalse;
+  case number_value:
+    return number_value_new(ctx->saved_keys + point->value_pos, point->value_len);
+  case string_value:
+    return rb_utf8_str_new(ctx->saved_keys + point->value_pos, point->value_len);
+  default:
+    return Qnil;
+  }
+}
+
+// Stores the value into an array or a hash, unmatched array elements before the index become stubs
+static void parse_tree_store(VALUE parent, VALUE key, long index, VALUE value)
+{
+  if (key != Qundef)
+  {
+    rb_hash_aset(parent, key, value);
+    return;
+  }
+  while (RARRAY_LEN(parent) < index)
+    rb_ary_push(parent, stub_sym);
+  rb_ary_store(parent, index, value);
+}
+
+// Inserts the value of the point into the tree of roots, the containers on the path are created as needed,
+// replacing stubs
+static void parse_tree_insert(scan_ctx *ctx, saved_point_t *point, long root, VALUE value)
+{
+  VALUE parent = ctx->roots_info_list, key = Qundef;
+  long index = root;
+  for (int i = 0; i < point->path_len; i++)
+  {
+    saved_path_elem_t *elem = &ctx->saved_path[point->path_pos + i];
+    VALUE child = key != Qundef ? rb_hash_aref(parent, key) : rb_ary_entry(parent, index);
+    if (elem->type == PATH_INDEX ? !RB_TYPE_P(child, T_ARRAY) : !RB_TYPE_P(child, T_HASH))
+    {
+      child = elem->type == PATH_INDEX ? rb_ary_new() : rb_hash_new();
+      parse_tree_store(parent, key, index, child);
+    }
+    parent = child;
+    if (elem->type == PATH_INDEX)
+    {
+      key = Qundef;
+      index = elem->value.index;
+    }
+    else
+    {
+      key = rb_utf8_str_new(ctx->saved_keys + elem->value.key.pos, elem->value.key.len);
+      if (ctx->symbolize_path_keys)
+        key = rb_str_intern(key);
+    }
+  }
+  parse_tree_store(parent, key, index, value);
+}
+
+// JsonScanner.parse, roots start as stubs: the symbols of their types
+static void parse_tree_save_results(scan_ctx *ctx)
+{
+  long roots_offset = RARRAY_LEN(ctx->roots_info_list);
+  VALUE json = rb_const_get(rb_cObject, rb_intern("JSON"));
+  VALUE parse_opts = rb_hash_new();
+  rb_hash_aset(parse_opts, quirks_mode_sym, Qtrue);
+  rb_hash_aset(parse_opts, symbolize_names_sym, ctx->symbolize_path_keys ? Qtrue : Qfalse);
+  for (size_t i = 0; i < ctx->saved_roots_len; i++)
+    rb_ary_push(ctx->roots_info_list, value_type_sym(ctx->saved_roots[i].type));
+  for (size_t i = 0; i < ctx->saved_points_len; i++)
+  {
+    saved_point_t *saved = &ctx->saved_points[i];
+    VALUE value;
+    if (saved->same_value)
+      continue;
+    if (saved->type == object_value || saved->type == array_value)
+      value = rb_funcall(json, rb_json_parse, 2,
+                         rb_str_subseq(ctx->parse_text, (long)saved->begin, (long)(saved->end - saved->begin)),
+                         parse_opts);
+    else
+      value = saved_value_new(ctx, saved);
+    parse_tree_insert(ctx, saved, roots_offset + (long)saved->root, value);
+  }
+  RB_GC_GUARD(parse_opts);
+}
+
+static void scan_ctx_save_points(scan_ctx *ctx)
+{
+  VALUE point = Qnil;
+  for (size_t i = 0; i < ctx->saved_points_len; i++)
+  {
+    saved_point_t *saved = &ctx->saved_points[i];
+    if (ctx->packed)
+    {
+      packed_result_append(rb_ary_entry(ctx->points_list, saved->path_id), saved->begin, saved->end, saved->type);
+      continue;
+    }
+    if (!saved->same_value)
+    {
+      if (ctx->values)
+        point = rb_ary_new_from_args(4, SIZET2NUM(saved->begin), SIZET2NUM(saved->end), value_type_sym(saved->type),
+                                     saved_value_new(ctx, saved));
+      else
+        point = rb_ary_new_from_args(3, SIZET2NUM(saved->begin), SIZET2NUM(saved->end), value_type_sym(saved->type));
+      if (ctx->with_path)
+        point = rb_ary_new_from_args(2, create_path(ctx, saved), point);
+    }
+    // rb_ary_push raises only in case of a frozen array, which is not the case
+    // rb_ary_entry is safe
+    rb_ary_push(rb_ary_entry(ctx->points_list, saved->path_id), point);
+  }
+  for (size_t i = 0; i < ctx->saved_roots_len; i++)
+  {
+    rb_ary_push(ctx->roots_info_list,
+                rb_ary_new_from_args(2, value_type_sym(ctx->saved_roots[i].type), SIZET2NUM(ctx->saved_roots[i].begin)));
+  }
+}
+
+static int aggregate_key_pos_cmp(const void *a, const void *b)
+{
+  size_t a_pos = (*(aggregate_key_t *const *)a)->pos, b_pos = (*(aggregate_key_t *const *)b)->pos;
+  return a_pos < b_pos ? -1 : a_pos > b_pos;
+}
+
+static VALUE aggregate_number(int is_int, long long int_val, double val)
+{
+  return is_int ? LL2NUM(int_val) : DBL2NUM(val);
+}
+
+// needs the GVL
+static VALUE aggregate_sum(aggregate_t *agg)
+{
+  VALUE int_sum;
+  if ((agg->int_sum_high == 0 && agg->int_sum <= LLONG_MAX) || (agg->int_sum_high == -1 && agg->int_sum > LLONG_MAX))
+    int_sum = LL2NUM((long long)agg->int_sum);
+  else
+    int_sum = rb_funcall(rb_funcall(LL2NUM(agg->int_sum_high), rb_intern("<<"), 1, INT2FIX(64)), '+', 1,
+                         ULL2NUM(agg->int_sum));
+  if (!agg->floats)
+    return int_sum;
+  aggregate_float_sum(agg, NUM2DBL(int_sum));
+  return DBL2NUM(agg->float_sum + agg->float_sum_c);
+}
+
+// Replaces the points of every path with a Hash of its aggregates, needs the GVL
+static void aggregate_save_results(scan_ctx *ctx)
+{
+  for (int i = 0; i < ctx->paths_len; i++)
+  {
+    aggregate_t *agg = &ctx->aggregates[i];
+    VALUE res = rb_hash_new();
+    if (ctx->aggregate & AGGREGATE_COUNT)
+      rb_hash_aset(res, count_sym, SIZET2NUM(agg->count));
+    if (ctx->aggregate & AGGREGATE_SUM)
+      rb_hash_aset(res, sum_sym, aggregate_sum(agg));
+    if (ctx->aggregate & AGGREGATE_MIN)
+      rb_hash_aset(res, min_sym, agg->numbers ? aggregate_number(agg->min_is_int, agg->min_int, agg->min) : Qnil);
+    if (ctx->aggregate & AGGREGATE_MAX)
+      rb_hash_aset(res, max_sym, agg->numbers ? aggregate_number(agg->max_is_int, agg->max_int, agg->max) : Qnil);
+    if (ctx->aggregate & AGGREGATE_KEY_HISTOGRAM)
+    {
+      VALUE histogram = rb_hash_new(), keys_buf;
+      aggregate_key_t **keys = ALLOCV_N(aggregate_key_t *, keys_buf, agg->keys_len);
+      size_t keys_len = 0;
+      for (size_t j = 0; j < agg->keys_cap; j++)
+      {
+        if (agg->keys[j].count)
+          keys[keys_len++] = &agg->keys[j];
+      }
+      // keys are saved when they are seen first
+      qsort(keys, keys_len, sizeof(aggregate_key_t *), aggregate_key_pos_cmp);
+      for (size_t j = 0; j < keys_len; j++)
+      {
+        VALUE key = rb_utf8_str_new(ctx->saved_keys + keys[j]->pos, keys[j]->len);
+        rb_hash_aset(histogram, ctx->symbolize_path_keys ? rb_str_intern(key) : key, SIZET2NUM(keys[j]->count));
+      }
+      ALLOCV_END(keys_buf);
+      rb_hash_aset(res, key_histogram_sym, histogram);
+    }
+    rb_ary_store(ctx->points_list, i, res);
+  }
+}
+
+// Converts matches saved since the previous call into Ruby objects, needs the GVL
+static void scan_ctx_save_results(scan_ctx *ctx)
+{
+  if (ctx->aggregate)
+    aggregate_save_results(ctx);
+  else if (ctx->parse_text)
+    parse_tree_save_results(ctx);
+  else
+    scan_ctx_save_points(ctx);
+  ctx->saved_points_len = 0;
+  ctx->saved_path_len = 0;
+  ctx->saved_keys_len = 0;
+  ctx->saved_roots_len = 0;
+}
+
+// noexcept
+// Marks the paths below the node done, they can't match anything else
+static inline void mark_node_done(scan_ctx *sctx, int node)
+{
+  trie_node_state_t *state = &sctx->node_states[node];
+  int done_paths = sctx->nodes[node].paths_below - state->done_paths;
+  state->done = true;
+  for (int j = node; j >= 0; j = sctx->nodes[j].parent)
+    sctx->node_states[j].done_paths += done_paths;
+  sctx->done_paths_len += done_paths;
+  if (sctx->done_log)
+    sctx->done_log[sctx->done_log_len++] = node;
+}
+
+// noexcept
+// The value at current_path has been visited completely; marks paths that can't match anything else
+// Returns false to abort parsing if no path can match anything else
+static int update_done_paths(scan_ctx *sctx)
+{
+  int depth = sctx->current_path_len;
+  int *states = &sctx->states[sctx->states_offsets[depth]];
+  // Only literal key/index prefixes point to a single value, so their subtrees are done when such a value is visited;
+  // a range is done when its last index is visited. Duplicate keys are not expected
+  for (int i = 0; i < sctx->states_lens[depth]; i++)
+  {
+    trie_node_t *node = &sctx->nodes[states[i]];
+    if (sctx->node_states[states[i]].done ||
+        !(node->literal ||
+          (node->range_tail && sctx->current_path[depth - 1].value.index >= node->range_end)))
+      continue;
+    mark_node_done(sctx, states[i]);
+  }
+  // Root value is complete anyway, let yajl check the rest
+  return sctx->done_paths_len < sctx->paths_len;
+}
+
+// noexcept
+// Called when a top-level value or an element of a top-level array is done, the scan can be resumed after it
+static void scan_ctx_save_checkpoint(scan_ctx *sctx)
+{
+  int depth = sctx->current_path_len;
+  if (depth == 1 && sctx->current_path[0].type != PATH_INDEX)
+    return;
+  if (depth == 0)
+    sctx->roots++;
+  sctx->checkpoint.offset = scan_ctx_get_bytes_consumed(sctx);
+  sctx->checkpoint.depth = depth;
+  if (depth == 1)
+  {
+    sctx->checkpoint.index = sctx->current_path[0].value.index;
+    sctx->checkpoint.start = sctx->starts[0];
+  }
+  sctx->checkpoint.roots = sctx->roots;
+  sctx->checkpoint.done_len = sctx->done_log_len;
+}
+
+// noexcept
+static inline int value_done(scan_ctx *sctx)
+{
+  int res;
+  if (scan_ctx_aborted(sctx))
+    return false;
+  res = !sctx->stop_early || sctx->current_path_len == 0 || update_done_paths(sctx);
+  if (sctx->checkpoints && sctx->current_path_len <= 1)
+    scan_ctx_save_checkpoint(sctx);
+  return res;
+}
+
+// noexcept
+// Called when a container starts at the deepest depth the buffers are allocated for, they grow if a node under
+// ANY_DEPTH is matched, so values inside can match too
+static inline int grow_depths(scan_ctx *sctx)
+{
+  int depth = sctx->current_path_len;
+  int *states = &sctx->states[sctx->states_offsets[depth]];
+  if (depth < sctx->max_path_len || !sctx->floating_len)
+    return true;
+  for (int i = 0; i < sctx->states_lens[depth]; i++)
+  {
+    if (sctx->nodes[states[i]].floating)
+    {
+      if (scan_ctx_alloc_depths(sctx, sctx->max_path_len, sctx->max_path_len * 2 + 1))
+        return true;
+      sctx->nomem = true;
+      return false;
+    }
+  }
+  return true;
+}
+
+// noexcept
+// Called when a container has started, parsing is cancelled to skip it if nothing inside it can match
+static inline int skip_container(scan_ctx *sctx, int is_object)
+{
+  int depth = sctx->current_path_len - 1;
+  int *states = &sctx->states[sctx->states_offsets[depth]];
+  if (scan_ctx_aborted(sctx))
+    return true;
+  if (!sctx->skip_fast)
+    return false;
+  for (int i = 0; i < sctx->states_lens[depth]; i++)
+  {
+    trie_node_t *node = &sctx->nodes[states[i]];
+    if (node->recursive || node->keys.len || node->indexes_len || node->ranges_len || node->key_sets_len ||
+        node->keys_or_indexes_len || node->any_key >= 0)
+      return false;
+  }
+  sctx->skip_pending = true;
+  sctx->skip_object = is_object;
+  sctx->skip_pos = scan_ctx_get_bytes_consumed(sctx) - 1;
+  return true;
+}
+
+// noexcept, doesn't need the GVL
+static int scan_on_null(void *ctx)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  save_root_info(sctx, null_value, 4);
+  if (sctx->current_path_len > sctx->max_path_len)
+    return !scan_ctx_aborted(sctx);
+  increment_arr_index(sctx);
+  save_point(sctx, null_value, 4);
+  return value_done(sctx);
+}
+
+// noexcept, doesn't need the GVL
+static int scan_on_boolean(void *ctx, int bool_val)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  save_root_info(sctx, boolean_value, bool_val ? 4 : 5);
+  if (sctx->current_path_len > sctx->max_path_len)
+    return !scan_ctx_aborted(sctx);
+  increment_arr_index(sctx);
+  save_point(sctx, boolean_value, bool_val ? 4 : 5);
+  return value_done(sctx);
+}
+
+// noexcept, doesn't need the GVL
+static int scan_on_number(void *ctx, const char *val, size_t len)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  save_root_info(sctx, number_value, len);
+  if (sctx->current_path_len > sctx->max_path_len)
+    return !scan_ctx_aborted(sctx);
+  increment_arr_index(sctx);
+  sctx->value = (const unsigned char *)val;
+  sctx->value_len = len;
+  save_point(sctx, number_value, len);
+  return value_done(sctx);
+}
+
+// noexcept, doesn't need the GVL
+static int scan_on_string(void *ctx, const unsigned char *val, size_t len)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  size_t token_len = string_token_len(sctx, val, len);
+  const unsigned char *decoded = sctx->decoded_value;
+  sctx->decoded_value = NULL;
+  save_root_info(sctx, string_value, token_len);
+  if (sctx->current_path_len > sctx->max_path_len)
+    return !scan_ctx_aborted(sctx);
+  increment_arr_index(sctx);
+  sctx->value = decoded ? decoded : val;
+  sctx->value_len = decoded ? sctx->decoded_value_len : len;
+  save_point(sctx, string_value, token_len);
+  return value_done(sctx);
+}
+
+// noexcept, doesn't need the GVL
+static int scan_on_start_object(void *ctx)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  // Save in the beginning in case of a partial value
+  save_root_info(sctx, object_value, 1);
+  if (sctx->current_path_len > sctx->max_path_len)
+  {
+    sctx->current_path_len++;
+    return !scan_ctx_aborted(sctx);
+  }
+  increment_arr_index(sctx);
+  sctx->starts[sctx->current_path_len] = scan_ctx_get_bytes_consumed(sctx) - 1;
+  if (!grow_depths(sctx))
+    return false;
+  if (sctx->current_path_len < sctx->max_path_len)
+    sctx->current_path[sctx->current_path_len].type = PATH_KEY;
+  sctx->current_path_len++;
+  return !skip_container(sctx, true);
+}
+
+// noexcept, doesn't need the GVL
+static int scan_on_key(void *ctx, const unsigned char *key, size_t len)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  if (sctx->current_path_len > sctx->max_path_len)
+    return !scan_ctx_aborted(sctx);
+  // Can't be called without scan_on_start_object being called before
+  // So current_path_len at least 1 and key.type is set to PATH_KEY;
+  if (sctx->with_path && (sctx->streaming || !chunk_contains(sctx, key)))
+    key = copy_key(sctx, sctx->current_path_len - 1, key, len);
+  sctx->current_path[sctx->current_path_len - 1].value.key.val = (char *)key;
+  sctx->current_path[sctx->current_path_len - 1].value.key.len = len;
+  update_states(sctx, sctx->current_path_len - 1);
+  return !scan_ctx_aborted(sctx);
+}
+
+// noexcept, doesn't need the GVL
+static int scan_on_end_object(void *ctx)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  sctx->current_path_len--;
+  if (sctx->current_path_len > sctx->max_path_len)
+    return !scan_ctx_aborted(sctx);
+  save_point(sctx, object_value, 0);
+  return value_done(sctx);
+}
+
+// noexcept, doesn't need the GVL
+static int scan_on_start_array(void *ctx)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  // Save in the beginning in case of a partial value
+  save_root_info(sctx, array_value, 1);
+  if (sctx->current_path_len > sctx->max_path_len)
+  {
+    sctx->current_path_len++;
+    return !scan_ctx_aborted(sctx);
+  }
+  increment_arr_index(sctx);
+  sctx->starts[sctx->current_path_len] = scan_ctx_get_bytes_consumed(sctx) - 1;
+  if (!grow_depths(sctx))
+    return false;
+  if (sctx->current_path_len < sctx->max_path_len)
+  {
+    sctx->current_path[sctx->current_path_len].type = PATH_INDEX;
+    sctx->current_path[sctx->current_path_len].value.index = -1;
+  }
+  sctx->current_path_len++;
+  return !skip_container(sctx, false);
+}
+
+// noexcept, doesn't need the GVL
+static int scan_on_end_array(void *ctx)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  sctx->current_path_len--;
+  if (sctx->current_path_len > sctx->max_path_len)
+    return !scan_ctx_aborted(sctx);
+  save_point(sctx, array_value, 0);
+  return value_done(sctx);
+}
+
+// noexcept, doesn't need the GVL
+// 0 if the monotonic clock isn't available
+static inline uint64_t scan_stats_now_ns(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+// The least time it takes to read the clock, subtracted from the timings of callbacks
+static uint64_t scan_stats_clock_ns = 0;
+
+static void scan_stats_calibrate(void)
+{
+  uint64_t best = UINT64_MAX;
+  for (int i = 0; i < 64; i++)
+  {
+    uint64_t start = scan_stats_now_ns(), ns = scan_stats_now_ns() - start;
+    if (ns < best)
+      best = ns;
+  }
+  scan_stats_clock_ns = best;
+}
+
+// noexcept, doesn't need the GVL
+// Trie states a value is checked against: the ones of the array it's in for its index and its own ones for save_point
+static inline void scan_stats_count_value(scan_ctx *sctx, int in_array)
+{
+  int depth = sctx->current_path_len;
+  if (depth > sctx->max_path_len)
+    return;
+  if (in_array)
+    sctx->stats->comparisons += sctx->states_lens[depth - 1];
+  sctx->stats->comparisons += sctx->states_lens[depth];
+}
+
+static inline int scan_stats_in_array(scan_ctx *sctx)
+{
+  return sctx->current_path_len > 0 && sctx->current_path_len <= sctx->max_path_len &&
+         sctx->current_path[sctx->current_path_len - 1].type == PATH_INDEX;
+}
+
+#define SCAN_STATS_CALLBACK_BEGIN(type)        \
+  scan_ctx *sctx = (scan_ctx *)ctx;            \
+  scan_stats_t *stats = sctx->stats;           \
+  int in_array = scan_stats_in_array(sctx);    \
+  uint64_t start_ns = scan_stats_now_ns();     \
+  int ret;                                     \
+  stats->tokens[type]++;                       \
+  stats->callbacks++;
+
+#define SCAN_STATS_CALLBACK_END()                        \
+  stats->callbacks_ns += scan_stats_now_ns() - start_ns; \
+  return ret;
+
+// noexcept, doesn't need the GVL
+static int scan_stats_on_null(void *ctx)
+{
+  SCAN_STATS_CALLBACK_BEGIN(null_value)
+  ret = scan_on_null(ctx);
+  scan_stats_count_value(sctx, in_array);
+  SCAN_STATS_CALLBACK_END()
+}
+
+// noexcept, doesn't need the GVL
+static int scan_stats_on_boolean(void *ctx, int bool_val)
+{
+  SCAN_STATS_CALLBACK_BEGIN(boolean_value)
+  ret = scan_on_boolean(ctx, bool_val);
+  scan_stats_count_value(sctx, in_array);
+  SCAN_STATS_CALLBACK_END()
+}
+
+// noexcept, doesn't need the GVL
+static int scan_stats_on_number(void *ctx, const char *val, size_t len)
+{
+  SCAN_STATS_CALLBACK_BEGIN(number_value)
+  ret = scan_on_number(ctx, val, len);
+  scan_stats_count_value(sctx, in_array);
+  SCAN_STATS_CALLBACK_END()
+}
+
+// noexcept, doesn't need the GVL
+static int scan_stats_on_string(void *ctx, const unsigned char *val, size_t len)
+{
+  SCAN_STATS_CALLBACK_BEGIN(string_value)
+  ret = scan_on_string(ctx, val, len);
+  scan_stats_count_value(sctx, in_array);
+  SCAN_STATS_CALLBACK_END()
+}
+
+// noexcept, doesn't need the GVL
+static inline void scan_stats_count_start(scan_ctx *sctx, int in_array)
+{
+  scan_stats_t *stats = sctx->stats;
+  if (sctx->current_path_len > stats->max_depth)
+    stats->max_depth = sctx->current_path_len;
+  if (sctx->current_path_len > sctx->max_path_len + 1)
+    stats->deep_containers++;
+  else if (in_array)
+    stats->comparisons += sctx->states_lens[sctx->current_path_len - 2];
+  if (sctx->skip_pending)
+    stats->skipped_containers++;
+}
+
+// noexcept, doesn't need the GVL
+static int scan_stats_on_start_object(void *ctx)
+{
+  SCAN_STATS_CALLBACK_BEGIN(object_value)
+  ret = scan_on_start_object(ctx);
+  scan_stats_count_start(sctx, in_array);
+  SCAN_STATS_CALLBACK_END()
+}
+
+// noexcept, doesn't need the GVL
+static int scan_stats_on_key(void *ctx, const unsigned char *key, size_t len)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  scan_stats_t *stats = sctx->stats;
+  uint64_t start_ns = scan_stats_now_ns();
+  int ret = scan_on_key(ctx, key, len);
+  stats->keys++;
+  stats->callbacks++;
+  if (sctx->current_path_len <= sctx->max_path_len)
+    stats->comparisons += sctx->states_lens[sctx->current_path_len - 1];
+  SCAN_STATS_CALLBACK_END()
+}
+
+// noexcept, doesn't need the GVL
+static int scan_stats_on_end_object(void *ctx)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  scan_stats_t *stats = sctx->stats;
+  uint64_t start_ns = scan_stats_now_ns();
+  int ret = scan_on_end_object(ctx);
+  stats->callbacks++;
+  scan_stats_count_value(sctx, false);
+  SCAN_STATS_CALLBACK_END()
+}
+
+// noexcept, doesn't need the GVL
+static int scan_stats_on_start_array(void *ctx)
+{
+  SCAN_STATS_CALLBACK_BEGIN(array_value)
+  ret = scan_on_start_array(ctx);
+  scan_stats_count_start(sctx, in_array);
+  SCAN_STATS_CALLBACK_END()
+}
+
+// noexcept, doesn't need the GVL
+static int scan_stats_on_end_array(void *ctx)
+{
+  scan_ctx *sctx = (scan_ctx *)ctx;
+  scan_stats_t *stats = sctx->stats;
+  uint64_t start_ns = scan_stats_now_ns();
+  int ret = scan_on_end_array(ctx);
+  stats->callbacks++;
+  scan_stats_count_value(sctx, false);
+  SCAN_STATS_CALLBACK_END()
+}
+
+#undef SCAN_STATS_CALLBACK_BEGIN
+#undef SCAN_STATS_CALLBACK_END
+
+static yajl_callbacks scan_stats_callbacks = {
+    scan_stats_on_null,
+    scan_stats_on_boolean,
+    NULL,
+    NULL,
+    scan_stats_on_number,
+    scan_stats_on_string,
+    scan_stats_on_start_object,
+    scan_stats_on_key,
+    scan_stats_on_end_object,
+    scan_stats_on_start_array,
+    scan_stats_on_end_array};
+
+static void selector_free(void *data)
+{
+  scan_ctx_free((scan_ctx *)data);
+  ruby_xfree(data);
+}
+
+static size_t selector_size(const void *data)
+{
+  // see ObjectSpace.memsize_of
+  scan_ctx *ctx = (scan_ctx *)data;
+  size_t res = sizeof(scan_ctx) + scan_ctx_state_size(ctx);
+  res += ctx->saved_points_cap * sizeof(saved_point_t) + ctx->saved_path_cap * sizeof(saved_path_elem_t) +
+         ctx->saved_keys_cap + ctx->saved_roots_cap * sizeof(saved_root_t);
+  // the compiled paths of a Selector are counted once, by the Selector
+  if (ctx->shared)
+    return res;
+  if (ctx->nodes != NULL)
+  {
+    res += ctx->nodes_len * sizeof(trie_node_t);
+    for (int i = 0; i < ctx->nodes_len; i++)
+    {
+      res += ctx->nodes[i].keys.cap * sizeof(trie_key_t) + ctx->nodes[i].indexes_len * sizeof(trie_index_t) +
+             ctx->nodes[i].ranges_len * sizeof(trie_range_t) + ctx->nodes[i].path_ids_len * sizeof(int) +
+             ctx->nodes[i].key_sets_len * sizeof(trie_key_set_t) +
+             ctx->nodes[i].keys_or_indexes_len * sizeof(trie_key_or_index_t);
+      for (int j = 0; j < ctx->nodes[i].key_sets_len; j++)
+        res += ctx->nodes[i].key_sets[j].keys.cap * sizeof(trie_key_t);
+    }
+  }
+  if (ctx->paths != NULL)
+  {
+    res += ctx->paths_len * sizeof(paths_t);
+    for (int i = 0; i < ctx->paths_len; i++)
+    {
+      res += ctx->paths[i].len * sizeof(path_matcher_elem_t);
+      if (ctx->paths[i].predicate != NULL)
+        res += sizeof(predicate_t);
+      for (int j = 0; j < ctx->paths[i].len; j++)
+      {
+        if (ctx->paths[i].elems[j].type == MATCHER_KEYS_LIST)
+          res += ctx->paths[i].elems[j].value.keys.len * sizeof(hashkey_t);
+      }
+    }
+  }
+  return res;
+}
+
+static const rb_data_type_t selector_type = {
+    .wrap_struct_name = "json_scanner_selector",
+    .function = {
+        .dfree = selector_free,
+        .dsize = selector_size,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | JSON_SCANNER_TYPED_FROZEN_SHAREABLE,
+};
+
+static VALUE selector_alloc(VALUE self)
+{
+  scan_ctx *ctx = ruby_xmalloc(sizeof(scan_ctx));
+  ctx->paths = NULL;
+  ctx->paths_len = 0;
+  ctx->string_predicates = false;
+  ctx->max_path_len = 0;
+  ctx->nodes = NULL;
+  ctx->nodes_len = 0;
+  ctx->shared = false;
+  scan_ctx_init_state(ctx);
+  scan_ctx_init_saved(ctx);
+  ctx->interrupted = false;
+  scan_ctx_reset(ctx, Qundef, Qundef, false, false, false);
+  return TypedData_Wrap_Struct(self, &selector_type, ctx);
+}
+
+static VALUE selector_init(VALUE self, VALUE path_ary, VALUE key_tokens)
+{
+  scan_ctx *ctx;
+  VALUE scan_ctx_init_err, string_keys;
+  TypedData_Get_Struct(self, scan_ctx, &selector_type, ctx);
+  string_keys = rb_ary_new();
+  scan_ctx_init_err = scan_ctx_init(ctx, path_ary, string_keys, key_tokens);
+  if (scan_ctx_init_err != Qundef)
+  {
+    rb_exc_raise(scan_ctx_init_err);
+  }
+  rb_iv_set(self, "string_keys", rb_obj_freeze(string_keys));
+  // Scans never change the selector, it's shareable between Ractors
+  rb_obj_freeze(self);
+  return self;
+}
+
+static VALUE selector_m_initialize(VALUE self, VALUE path_ary)
+{
+  return selector_init(self, path_ary, Qundef);
+}
+
+// range bounds are kept as doubles, integral ones are shown as integers
+static void predicate_bound_inspect(VALUE res, double bound)
+{
+  if (bound == floor(bound) && fabs(bound) < 1e15)
+    rb_str_catf(res, "%lld", (long long)bound);
+  else
+    rb_str_catf(res, "%" PRIsVALUE, rb_inspect(DBL2NUM(bound)));
+}
+
+static void predicate_inspect(VALUE res, predicate_t *pred)
+{
+  const char *sep = "";
+  rb_str_buf_cat_ascii(res, "{");
+  if (pred->types)
+  {
+    int types_len = 0;
+    for (int type = null_value; type <= array_value; type++)
+      types_len += (pred->types >> type) & 1;
+    rb_str_buf_cat_ascii(res, types_len > 1 ? "type: [" : "type: ");
+    for (int type = null_value, i = 0; type <= array_value; type++)
+    {
+      if ((pred->types >> type) & 1)
+        rb_str_catf(res, i++ ? ", %" PRIsVALUE : "%" PRIsVALUE, rb_inspect(value_type_sym((value_type)type)));
+    }
+    rb_str_buf_cat_ascii(res, types_len > 1 ? "]" : "");
+    sep = ", ";
+  }
+  if (pred->eq_type == string_value)
+    rb_str_catf(res, "%seq: '%.*s'", sep, (int)pred->eq_str.len, pred->eq_str.val);
+  else if (pred->eq_type == number_value && pred->eq_is_int)
+    rb_str_catf(res, "%seq: %.*s", sep, (int)pred->eq_digits_len, pred->eq_digits);
+  else if (pred->eq_type == number_value)
+    rb_str_catf(res, "%seq: %" PRIsVALUE, sep, rb_inspect(DBL2NUM(pred->eq_num)));
+  if (pred->eq_type >= 0)
+    sep = ", ";
+  if (pred->has_range)
+  {
+    rb_str_catf(res, "%sin: (", sep);
+    if (pred->range_begin != -HUGE_VAL)
+      predicate_bound_inspect(res, pred->range_begin);
+    rb_str_buf_cat_ascii(res, pred->range_exclude_end ? "..." : "..");
+    if (pred->range_end != HUGE_VAL)
+      predicate_bound_inspect(res, pred->range_end);
+    rb_str_buf_cat_ascii(res, ")");
+  }
+  rb_str_buf_cat_ascii(res, "}");
+}
+
+static VALUE selector_m_inspect(VALUE self)
+{
+  scan_ctx *ctx;
+  VALUE res;
+  TypedData_Get_Struct(self, scan_ctx, &selector_type, ctx);
+  res = rb_sprintf("#<%" PRIsVALUE " [", rb_class_name(CLASS_OF(self)));
+  for (int i = 0; ctx->paths && i < ctx->paths_len; i++)
+  {
+    rb_str_buf_cat_ascii(res, "[");
+    for (int j = 0; j < ctx->paths[i].len; j++)
+    {
+      switch (ctx->paths[i].elems[j].type)
+      {
+      case MATCHER_KEY:
+        rb_str_catf(res, "'%.*s'", (int)ctx->paths[i].elems[j].value.key.len, ctx->paths[i].elems[j].value.key.val);
+        break;
+      case MATCHER_INDEX:
+        rb_str_catf(res, "%ld", ctx->paths[i].elems[j].value.index);
+        break;
+      case MATCHER_INDEX_RANGE:
+        rb_str_catf(res, "(%ld..%ld)", ctx->paths[i].elems[j].value.range.start, ctx->paths[i].elems[j].value.range.end == LONG_MAX ? -1L : ctx->paths[i].elems[j].value.range.end);
+        break;
+      case MATCHER_ANY_KEY:
+        rb_str_buf_cat_ascii(res, "('*'..'*')");
+        break;
+      case MATCHER_ANY_DEPTH:
+        rb_str_buf_cat_ascii(res, "('**'..'**')");
+        break;
+      case MATCHER_KEYS_LIST:
+        rb_str_buf_cat_ascii(res, "{");
+        for (int k = 0; k < ctx->paths[i].elems[j].value.keys.len; k++)
+          rb_str_catf(res, k ? ", '%.*s'" : "'%.*s'", (int)ctx->paths[i].elems[j].value.keys.keys[k].len,
+                      ctx->paths[i].elems[j].value.keys.keys[k].val);
+        rb_str_buf_cat_ascii(res, "}");
+        break;
+      case MATCHER_KEY_OR_INDEX:
+        rb_str_catf(res, "('%.*s'|%ld)", (int)ctx->paths[i].elems[j].value.key_or_index.key.len,
+                    ctx->paths[i].elems[j].value.key_or_index.key.val, ctx->paths[i].elems[j].value.key_or_index.index);
+        break;
+      }
+      if (j < ctx->paths[i].len - 1)
+        rb_str_buf_cat_ascii(res, ", ");
+    }
+    if (ctx->paths[i].predicate != NULL)
+    {
+      rb_str_buf_cat_ascii(res, ctx->paths[i].len ? ", " : "");
+      predicate_inspect(res, ctx->paths[i].predicate);
+    }
+    rb_str_buf_cat_ascii(res, "]");
+    if (i < ctx->paths_len - 1)
+      rb_str_buf_cat_ascii(res, ", ");
+  }
+  rb_str_buf_cat_ascii(res, "]>");
+  return res;
+}
+
+static VALUE selector_m_length(VALUE self)
+{
+  scan_ctx *ctx;
+  TypedData_Get_Struct(self, scan_ctx, &selector_type, ctx);
+  return INT2FIX(ctx->paths_len);
+}
+
+// JSONPath and JSON Pointer expressions are parsed into the path arrays Selector.new takes
+typedef struct
+{
+  VALUE expr;
+  const char *str;
+  long len;
+  long pos;
+} expr_parser_t;
+
+NORETURN(static void expr_parser_error(expr_parser_t *p, const char *msg));
+static void expr_parser_error(expr_parser_t *p, const char *msg)
+{
+  rb_raise(rb_eArgError, "%s at %ld in %" PRIsVALUE, msg, p->pos, rb_inspect(p->expr));
+}
+
+static void expr_parser_skip_ws(expr_parser_t *p)
+{
+  while (p->pos < p->len && (p->str[p->pos] == ' ' || p->str[p->pos] == '\t'))
+    p->pos++;
+}
+
+// Returns an Integer or Qnil if there are no digits at the position
+static VALUE expr_parser_integer(expr_parser_t *p)
+{
+  long start = p->pos;
+  if (p->pos < p->len && p->str[p->pos] == '-')
+    expr_parser_error(p, "negative indexes aren't supported");
+  while (p->pos < p->len && p->str[p->pos] >= '0' && p->str[p->pos] <= '9')
+    p->pos++;
+  if (p->pos == start)
+    return Qnil;
+  return rb_str_to_inum(rb_str_new(p->str + start, p->pos - start), 10, false);
+}
+
+static VALUE json_path_parse_quoted(expr_parser_t *p)
+{
+  char quote = p->str[p->pos++];
+  VALUE key = rb_utf8_str_new(NULL, 0);
+  for (;;)
+  {
+    long start = p->pos;
+    char c;
+    while (p->pos < p->len && p->str[p->pos] != quote && p->str[p->pos] != '\\')
+      p->pos++;
+    rb_str_cat(key, p->str + start, p->pos - start);
+    if (p->pos >= p->len)
+      expr_parser_error(p, "unterminated string");
+    if (p->str[p->pos++] == quote)
+      return key;
+    if (p->pos >= p->len)
+      expr_parser_error(p, "unterminated string");
+    switch (p->str[p->pos])
+    {
+    case '\\':
+    case '\'':
+    case '"':
+    case '/':
+      c = p->str[p->pos];
+      break;
+    case 'b':
+      c = '\b';
+      break;
+    case 'f':
+      c = '\f';
+      break;
+    case 'n':
+      c = '\n';
+      break;
+    case 'r':
+      c = '\r';
+      break;
+    case 't':
+      c = '\t';
+      break;
+    default:
+      expr_parser_error(p, "unsupported escape");
+    }
+    p->pos++;
+    rb_str_cat(key, &c, 1);
+  }
+}
+
+// [*], ['name'], ['a', 'b'], [1], [1:3], [2:] and [:2]
+static VALUE json_path_parse_bracket(expr_parser_t *p)
+{
+  VALUE res;
+  expr_parser_skip_ws(p);
+  if (p->pos >= p->len)
+    expr_parser_error(p, "unexpected end");
+  if (p->str[p->pos] == '*')
+  {
+    p->pos++;
+    res = any_index_range;
+  }
+  else if (p->str[p->pos] == '\'' || p->str[p->pos] == '"')
+  {
+    VALUE keys = rb_ary_new();
+    for (;;)
+    {
+      rb_ary_push(keys, json_path_parse_quoted(p));
+      expr_parser_skip_ws(p);
+      if (p->pos >= p->len || p->str[p->pos] != ',')
+        break;
+      p->pos++;
+      expr_parser_skip_ws(p);
+      if (p->pos >= p->len || (p->str[p->pos] != '\'' && p->str[p->pos] != '"'))
+        expr_parser_error(p, "expected a quoted name");
+    }
+    res = RARRAY_LEN(keys) == 1 ? rb_ary_entry(keys, 0)
+                                : rb_funcall(rb_const_get(rb_cObject, rb_intern("Set")), rb_intern("new"), 1, keys);
+  }
+  else
+  {
+    VALUE start = expr_parser_integer(p);
+    if (p->pos < p->len && p->str[p->pos] == ':')
+    {
+      VALUE end;
+      p->pos++;
+      end = expr_parser_integer(p);
+      if (p->pos < p->len && p->str[p->pos] == ':')
+        expr_parser_error(p, "slice steps aren't supported");
+      if (NIL_P(start))
+        start = INT2FIX(0);
+      res = NIL_P(end) ? rb_range_new(start, INT2FIX(-1), false) : rb_range_new(start, end, true);
+    }
+    else if (NIL_P(start))
+    {
+      expr_parser_error(p, "expected '*', a quoted name, an index or a slice");
+    }
+    else
+    {
+      res = start;
+    }
+    expr_parser_skip_ws(p);
+    if (p->pos < p->len && p->str[p->pos] == ',')
+      expr_parser_error(p, "index unions aren't supported");
+  }
+  expr_parser_skip_ws(p);
+  if (p->pos >= p->len || p->str[p->pos] != ']')
+    expr_parser_error(p, "expected ']'");
+  p->pos++;
+  return res;
+}
+
+// $, .name, .*, ..name, ..*, ..[...] and [...]
+static VALUE json_path_parse(expr_parser_t *p)
+{
+  VALUE path = rb_ary_new();
+  p->pos = 1;
+  while (p->pos < p->len)
+  {
+    long start;
+    if (p->str[p->pos] == '[')
+    {
+      p->pos++;
+      rb_ary_push(path, json_path_parse_bracket(p));
+      continue;
+    }
+    if (p->str[p->pos] != '.')
+      expr_parser_error(p, "expected '.' or '['");
+    p->pos++;
+    if (p->pos < p->len && p->str[p->pos] == '.')
+    {
+      p->pos++;
+      rb_ary_push(path, any_depth_range);
+      if (p->pos < p->len && p->str[p->pos] == '[')
+        continue;
+    }
+    if (p->pos < p->len && p->str[p->pos] == '*')
+    {
+      p->pos++;
+      rb_ary_push(path, any_key_range);
+      continue;
+    }
+    // RFC 9535 shorthand names: letters, digits after the first character, '_' and non-ASCII characters
+    start = p->pos;
+    while (p->pos < p->len && (isalpha((unsigned char)p->str[p->pos]) || p->str[p->pos] == '_' ||
+                               (unsigned char)p->str[p->pos] >= 0x80 || (p->pos > start && isdigit((unsigned char)p->str[p->pos]))))
+      p->pos++;
+    if (p->pos == start)
+      expr_parser_error(p, "expected a member name");
+    rb_ary_push(path, rb_utf8_str_new(p->str + start, p->pos - start));
+  }
+  return path;
+}
+
+// RFC 6901, a token that is an array index, like 0 but not 01, is an index of an array or a key of an object.
+// Such tokens are pushed to key_tokens, nil for other ones
+static VALUE json_pointer_parse(expr_parser_t *p, VALUE key_tokens)
+{
+  VALUE path = rb_ary_new();
+  if (p->len > 0 && p->str[0] != '/')
+    expr_parser_error(p, "expected '$' or '/'");
+  while (p->pos < p->len)
+  {
+    VALUE token = rb_utf8_str_new(NULL, 0);
+    int is_index = true;
+    long start = ++p->pos;
+    while (p->pos < p->len && p->str[p->pos] != '/')
+    {
+      char c = p->str[p->pos];
+      if (c == '~')
+      {
+        if (p->pos + 1 >= p->len || (p->str[p->pos + 1] != '0' && p->str[p->pos + 1] != '1'))
+          expr_parser_error(p, "'~' must be followed by '0' or '1'");
+        c = p->str[++p->pos] == '0' ? '~' : '/';
+      }
+      if (c < '0' || c > '9' || (p->pos > start && p->str[start] == '0'))
+        is_index = false;
+      rb_str_cat(token, &c, 1);
+      p->pos++;
+    }
+    // longer ones can't be indexes of a text scan takes
+    if (is_index && p->pos > start && p->pos - start <= 18)
+    {
+      rb_ary_push(path, rb_str_to_inum(token, 10, false));
+      rb_ary_push(key_tokens, rb_obj_freeze(token));
+    }
+    else
+    {
+      rb_ary_push(path, token);
+      rb_ary_push(key_tokens, Qnil);
+    }
+  }
+  return path;
+}
+
+// key_tokens of the path are pushed to key_tokens_ary
+static VALUE expr_parse(VALUE expr, VALUE key_tokens_ary)
+{
+  expr_parser_t p;
+  VALUE key_tokens = rb_ary_new();
+  StringValue(expr);
+  p.expr = expr;
+  p.str = RSTRING_PTR(expr);
+  p.len = RSTRING_LEN(expr);
+  p.pos = 0;
+  rb_ary_push(key_tokens_ary, key_tokens);
+  return p.len > 0 && p.str[0] == '$' ? json_path_parse(&p) : json_pointer_parse(&p, key_tokens);
+}
+
+static VALUE selector_cache_get(void)
+{
+#ifdef HAVE_RUBY_RACTOR_H
+  VALUE selector_cache;
+  if (!rb_ractor_local_storage_value_lookup(selector_cache_key, &selector_cache))
+  {
+    selector_cache = rb_hash_new();
+    rb_ractor_local_storage_value_set(selector_cache_key, selector_cache);
+  }
+#endif
+  return selector_cache;
+}
+
+static int selector_cache_first_key(VALUE key, VALUE value, VALUE arg)
+{
+  *(VALUE *)arg = key;
+  return ST_STOP;
+}
+
+// def self.compile(expr_or_exprs)
+// Hash keeps insertion order, a hit is moved to the end, so the first entry is the least recently used.
+// Entries are [key, selector] arrays, a hit puts the frozen key it was stored with back, so it makes no allocations
+static VALUE selector_s_compile(VALUE self, VALUE exprs)
+{
+  VALUE entry, selector_cache = selector_cache_get();
+  if (!RB_TYPE_P(exprs, T_ARRAY))
+    StringValue(exprs);
+  entry = rb_hash_delete(selector_cache, exprs);
+  if (NIL_P(entry))
+  {
+    VALUE key, path_ary, key_tokens = rb_ary_new();
+    if (RB_TYPE_P(exprs, T_ARRAY))
+    {
+      key = rb_ary_new_capa(RARRAY_LEN(exprs));
+      path_ary = rb_ary_new_capa(RARRAY_LEN(exprs));
+      for (long i = 0; i < RARRAY_LEN(exprs); i++)
+      {
+        VALUE expr = rb_ary_entry(exprs, i);
+        expr = rb_str_new_frozen(StringValue(expr));
+        rb_ary_push(key, expr);
+        rb_ary_push(path_ary, expr_parse(expr, key_tokens));
+      }
+      rb_obj_freeze(key);
+    }
+    else
+    {
+      key = rb_str_new_frozen(exprs);
+      path_ary = rb_ary_new_from_args(1, expr_parse(key, key_tokens));
+    }
+    entry = rb_ary_new_from_args(2, key, selector_init(selector_alloc(rb_cJsonScannerSelector), path_ary, key_tokens));
+    rb_obj_freeze(entry);
+  }
+  rb_hash_aset(selector_cache, rb_ary_entry(entry, 0), entry);
+  if (RHASH_SIZE(selector_cache) > SELECTOR_CACHE_SIZE)
+  {
+    VALUE lru_key = Qundef;
+    rb_hash_foreach(selector_cache, selector_cache_first_key, (VALUE)&lru_key);
+    rb_hash_delete(selector_cache, lru_key);
+  }
+  return rb_ary_entry(entry, 1);
+}
+
+static size_t options_size(const void *data)
+{
+  return sizeof(scan_options);
+}
+
+static const rb_data_type_t options_type = {
+    .wrap_struct_name = "json_scanner_options",
+    .function = {
+        .dfree = RUBY_DEFAULT_FREE,
+        .dsize = options_size,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | JSON_SCANNER_TYPED_FROZEN_SHAREABLE,
+};
+
+static VALUE options_alloc(VALUE self)
+{
+  // NOT INITIALIZED
+  scan_options *options;
+  return TypedData_Make_Struct(self, scan_options, &options_type, options);
+}
+
+static VALUE options_m_initialize(int argc, VALUE *argv, VALUE self)
+{
+  VALUE kwargs;
+  scan_options *options;
+  TypedData_Get_Struct(self, scan_options, &options_type, options);
+#if RUBY_API_VERSION_MAJOR > 2 || (RUBY_API_VERSION_MAJOR == 2 && RUBY_API_VERSION_MINOR >= 7)
+  rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "0:", &kwargs);
+#else
+  rb_scan_args(argc, argv, "0:", &kwargs);
+#endif
+  scan_options_init(options, kwargs);
+  if (options->resume_from != Qnil)
+    rb_raise(rb_eArgError, "resume_from can't be stored in Options, pass it to the scan");
+  rb_obj_freeze(self);
+  return self;
+}
+
+static VALUE options_m_inspect(VALUE self)
+{
+  VALUE res;
+  scan_options *options;
+  TypedData_Get_Struct(self, scan_options, &options_type, options);
+  res = rb_sprintf("#<%" PRIsVALUE " {", rb_class_name(CLASS_OF(self)));
+  if (SCAN_OPTION_IS_SET(options, with_path))
+    rb_str_catf(res, "with_path: %s, ", SCAN_OPTION(options, with_path) ? "true" : "false");
+  if (SCAN_OPTION_IS_SET(options, verbose_error))
+    rb_str_catf(res, "verbose_error: %s, ", SCAN_OPTION(options, verbose_error) ? "true" : "false");
+  if (SCAN_OPTION_IS_SET(options, allow_comments))
+    rb_str_catf(res, "allow_comments: %s, ", SCAN_OPTION(options, allow_comments) ? "true" : "false");
+  if (SCAN_OPTION_IS_SET(options, dont_validate_strings))
+    rb_str_catf(res, "dont_validate_strings: %s, ", SCAN_OPTION(options, dont_validate_strings) ? "true" : "false");
+  if (SCAN_OPTION_IS_SET(options, allow_trailing_garbage))
+    rb_str_catf(res, "allow_trailing_garbage: %s, ", SCAN_OPTION(options, allow_trailing_garbage) ? "true" : "false");
+  if (SCAN_OPTION_IS_SET(options, allow_multiple_values))
+    rb_str_catf(res, "allow_multiple_values: %s, ", SCAN_OPTION(options, allow_multiple_values) ? "true" : "false");
+  if (SCAN_OPTION_IS_SET(options, allow_partial_values))
+    rb_str_catf(res, "allow_partial_values: %s, ", SCAN_OPTION(options, allow_partial_values) ? "true" : "false");
+  if (SCAN_OPTION_IS_SET(options, symbolize_path_keys))
+    rb_str_catf(res, "symbolize_path_keys: %s, ", SCAN_OPTION(options, symbolize_path_keys) ? "true" : "false");
+  if (SCAN_OPTION_IS_SET(options, with_roots_info))
+    rb_str_catf(res, "with_roots_info: %s, ", SCAN_OPTION(options, with_roots_info) ? "true" : "false");
+  if (SCAN_OPTION_IS_SET(options, stop_early))
+    rb_str_catf(res, "stop_early: %s, ", SCAN_OPTION(options, stop_early) ? "true" : "false");
+  if (SCAN_OPTION_IS_SET(options, skip_unmatched))
+    rb_str_catf(res, "skip_unmatched: %s, ", SCAN_OPTION(options, skip_unmatched) ? ":fast" : "nil");
+  if (SCAN_OPTION_IS_SET(options, engine))
+    rb_str_catf(res, "engine: %s, ", SCAN_OPTION(options, engine) ? ":simd" : ":yajl");
+  if (SCAN_OPTION_IS_SET(options, format))
+    rb_str_catf(res, "format: %s, ", SCAN_OPTION(options, format) ? ":packed" : ":arrays");
+  if (options->threads)
+    rb_str_catf(res, "threads: %d, ", options->threads);
+  if (SCAN_OPTION_IS_SET(options, values))
+    rb_str_catf(res, "values: %s, ", SCAN_OPTION(options, values) ? "true" : "false");
+  if (SCAN_OPTION_IS_SET(options, stats))
+    rb_str_catf(res, "stats: %s, ", SCAN_OPTION(options, stats) ? "true" : "false");
+  if (RSTRING_END(res)[-1] == ' ')
+    rb_str_resize(res, RSTRING_LEN(res) - 2);
+  rb_str_buf_cat_ascii(res, "}>");
+  return res;
+}
+
+static yajl_callbacks scan_callbacks = {
+    scan_on_null,
+    scan_on_boolean,
+    NULL,
+    NULL,
+    scan_on_number,
+    scan_on_string,
+    scan_on_start_object,
+    scan_on_key,
+    scan_on_end_object,
+    scan_on_start_array,
+    scan_on_end_array};
+
+static void scan_options_get(scan_options *options, VALUE rb_options)
+{
+  switch (TYPE(rb_options))
+  {
+  case T_HASH:
+    // rb_get_kwargs removes extracted keys
+    scan_options_init(options, rb_hash_dup(rb_options));
+    break;
+  case T_NIL:
+    scan_options_init(options, rb_options);
+    break;
+  case T_DATA:
+    if (rb_obj_is_kind_of(rb_options, rb_cJsonScannerOptions))
+    {
+      scan_options *ptr;
+      TypedData_Get_Struct(rb_options, scan_options, &options_type, ptr);
+      *options = *ptr;
+    }
+    else
+    {
+      rb_raise(rb_eTypeError, "Expected a Hash or %" PRIsVALUE ", got %" PRIsVALUE, rb_cJsonScannerOptions, rb_obj_class(rb_options));
+    }
+    break;
+  default:
+    rb_raise(rb_eTypeError, "Expected a Hash or %" PRIsVALUE ", got %" PRIsVALUE, rb_cJsonScannerOptions, rb_obj_class(rb_options));
+    break;
+  }
+}
+
+static VALUE scan_points_list_new(int paths_len, scan_options *options)
+{
+  VALUE points_list = rb_ary_new_capa(paths_len);
+  for (int i = 0; i < paths_len; i++)
+  {
+    rb_ary_push(points_list, SCAN_OPTION(options, format) ? packed_result_new() : rb_ary_new());
+  }
+  return points_list;
+}
+
+static void scan_ctx_reset_with_options(scan_ctx *ctx, VALUE points_list, VALUE roots_info_list, scan_options *options)
+{
+  // Any value can follow, can't stop
+  int stop_early = SCAN_OPTION(options, stop_early) && !SCAN_OPTION(options, allow_multiple_values);
+  scan_ctx_reset(ctx, points_list, roots_info_list, SCAN_OPTION(options, with_path), SCAN_OPTION(options, symbolize_path_keys), stop_early);
+  ctx->skip_fast = SCAN_OPTION(options, skip_unmatched);
+  ctx->packed = SCAN_OPTION(options, format);
+  ctx->values = SCAN_OPTION(options, values);
+  ctx->decoded_value = NULL;
+  ctx->parse_text = options->parse_text;
+  ctx->aggregate = options->aggregate;
+  if (ctx->aggregate && !scan_ctx_reset_aggregates(ctx))
+    ctx->nomem = true;
+}
+
+// noexcept, doesn't need the GVL
+static void scan_ctx_free_handle(scan_ctx *ctx)
+{
+  yajl_free(ctx->handle);
+  ctx->handle = NULL;
+  if (ctx->scratch)
+    scan_arena_reset(ctx->scratch);
+}
+
+static yajl_handle scan_ctx_alloc_handle(scan_ctx *ctx, scan_options *options)
+{
+  yajl_handle handle = yajl_alloc(ctx->stats ? &scan_stats_callbacks : &scan_callbacks,
+                                  ctx->scratch ? &ctx->scratch->alloc_funcs : NULL, (void *)ctx);
+  ctx->handle = handle;
+  if (handle == NULL)
+    return NULL;
+  if (SCAN_OPTION_IS_SET(options, allow_comments))
+    yajl_config(handle, yajl_allow_comments, SCAN_OPTION(options, allow_comments));
+  if (SCAN_OPTION_IS_SET(options, dont_validate_strings))
+    yajl_config(handle, yajl_dont_validate_strings, SCAN_OPTION(options, dont_validate_strings));
+  if (SCAN_OPTION_IS_SET(options, allow_trailing_garbage))
+    yajl_config(handle, yajl_allow_trailing_garbage, SCAN_OPTION(options, allow_trailing_garbage));
+  if (SCAN_OPTION_IS_SET(options, allow_multiple_values))
+    yajl_config(handle, yajl_allow_multiple_values, SCAN_OPTION(options, allow_multiple_values));
+  if (SCAN_OPTION_IS_SET(options, allow_partial_values))
+    yajl_config(handle, yajl_allow_partial_values, SCAN_OPTION(options, allow_partial_values));
+  ctx->handle = handle;
+  return handle;
+}
+
+// Returns the exception, the caller should free its resources before raising
+static VALUE scan_parse_error_new(const char *msg, size_t bytes_consumed)
+{
+  VALUE err = rb_exc_new_str(rb_eJsonScannerParseError, rb_utf8_str_new_cstr(msg));
+  rb_ivar_set(err, rb_iv_bytes_consumed, SIZET2NUM(bytes_consumed));
+  return err;
+}
+
+static VALUE scan_ctx_parse_error(scan_ctx *ctx, int verbose_error, const unsigned char *json_text, size_t json_text_len)
+{
+  VALUE err;
+  char *str = (char *)yajl_get_error(ctx->handle, verbose_error, json_text, json_text_len);
+  err = scan_parse_error_new(str, scan_ctx_get_bytes_consumed(ctx));
+  yajl_free_error(ctx->handle, (unsigned char *)str);
+  return err;
+}
+
+#if defined(__GNUC__) && defined(HAVE_AVX2_DISPATCH) && !defined(__AVX2__) && defined(__x86_64__)
+// The AVX2 kernels are compiled along with the default ones and used if the CPU has AVX2, see simd_avx2
+#define SIMD_AVX2_DISPATCH 1
+#define SIMD_AVX2_TARGET __attribute__((target("avx2,pclmul")))
+// the kernel is a constant, so it's inlined as well
+#define SIMD_KERNEL_INLINE inline __attribute__((always_inline))
+static int simd_avx2 = false;
+#elif defined(__GNUC__) && defined(__AVX2__)
+#define SIMD_AVX2_TARGET
+#endif
+#ifndef SIMD_KERNEL_INLINE
+#define SIMD_KERNEL_INLINE inline
+#endif
+
+#if defined(__GNUC__) && (defined(__AVX2__) || defined(SIMD_AVX2_DISPATCH))
+// Skips 32 bytes at a time while there is nothing to find in them, see skip_find
+static inline SIMD_AVX2_TARGET size_t skip_find_avx2_blocks(const unsigned char *text, size_t pos, size_t len, int in_string)
+{
+  while (pos + 32 <= len)
+  {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(text + pos));
+    __m256i found = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('"'));
+    unsigned int mask;
+    if (in_string)
+    {
+      found = _mm256_or_si256(found, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\\')));
+    }
+    else
+    {
+      // '[' | 0x20 == '{' and ']' | 0x20 == '}'
+      __m256i lower = _mm256_or_si256(chunk, _mm256_set1_epi8(0x20));
+      found = _mm256_or_si256(found, _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')));
+      found = _mm256_or_si256(found, _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}')));
+      found = _mm256_or_si256(found, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('/')));
+    }
+    mask = (unsigned int)_mm256_movemask_epi8(found);
+    if (mask)
+      return pos + __builtin_ctz(mask);
+    pos += 32;
+  }
+  return pos;
+}
+#endif
+
+// Returns the position of the first byte which can change the state of skip_to_close:
+// a quote or a backslash in a string; a quote, a bracket, or a slash outside
+static inline size_t skip_find(const unsigned char *text, size_t pos, size_t len, int in_string)
+{
+#if defined(__GNUC__) && defined(__AVX2__)
+  pos = skip_find_avx2_blocks(text, pos, len, in_string);
+#endif
+#if defined(__GNUC__) && defined(__SSE2__)
+  while (pos + 16 <= len)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(text + pos));
+    __m128i found = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"'));
+    unsigned int mask;
+    if (in_string)
+    {
+      found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\')));
+    }
+    else
+    {
+      __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+      found = _mm_or_si128(found, _mm_cmpeq_epi8(lower, _mm_set1_epi8('{')));
+      found = _mm_or_si128(found, _mm_cmpeq_epi8(lower, _mm_set1_epi8('}')));
+      found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('/')));
+    }
+    mask = (unsigned int)_mm_movemask_epi8(found);
+    if (mask)
+      return pos + __builtin_ctz(mask);
+    pos += 16;
+  }
+#elif defined(__GNUC__) && defined(__ARM_NEON) && defined(__aarch64__)
+  while (pos + 16 <= len)
+  {
+    uint8x16_t chunk = vld1q_u8(text + pos);
+    uint8x16_t found = vceqq_u8(chunk, vdupq_n_u8('"'));
+    uint64_t mask;
+    if (in_string)
+    {
+      found = vorrq_u8(found, vceqq_u8(chunk, vdupq_n_u8('\\')));
+    }
+    else
+    {
+      uint8x16_t lower = vorrq_u8(chunk, vdupq_n_u8(0x20));
+      found = vorrq_u8(found, vceqq_u8(lower, vdupq_n_u8('{')));
+      found = vorrq_u8(found, vceqq_u8(lower, vdupq_n_u8('}')));
+      found = vorrq_u8(found, vceqq_u8(chunk, vdupq_n_u8('/')));
+    }
+    // 4 bits per byte
+    mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(found), 4)), 0);
+    if (mask)
+      return pos + (__builtin_ctzll(mask) >> 2);
+    pos += 16;
+  }
+#endif
+  for (; pos < len; pos++)
+  {
+    unsigned char c = text[pos];
+    if (c == '"' || (in_string ? c == '\\' : ((c | 0x20) == '{' || (c | 0x20) == '}' || c == '/')))
+      return pos;
+  }
+  return len;
+}
+
+#ifdef SIMD_AVX2_DISPATCH
+static inline SIMD_AVX2_TARGET size_t skip_find_avx2(const unsigned char *text, size_t pos, size_t len, int in_string)
+{
+  return skip_find(text, skip_find_avx2_blocks(text, pos, len, in_string), len, in_string);
+}
+#endif
+
+typedef size_t (*skip_find_t)(const unsigned char *text, size_t pos, size_t len, int in_string);
+
+// text[pos] opens a container, returns the position of its closing bracket or len if it isn't closed
+// Nothing is validated, brackets of different types are not distinguished
+static SIMD_KERNEL_INLINE size_t skip_to_close_with(const unsigned char *text, size_t pos, size_t len,
+                                                    int allow_comments, skip_find_t find)
+{
+  size_t depth = 0;
+  int in_string = false;
+  for (; (pos = find(text, pos, len, in_string)) < len; pos++)
+  {
+    switch (text[pos])
+    {
+    case '"':
+      in_string = !in_string;
+      break;
+    case '\\':
+      pos++;
+      break;
+    case '[':
+    case '{':
+      depth++;
+      break;
+    case ']':
+    case '}':
+      if (--depth == 0)
+        return pos;
+      break;
+    case '/':
+      if (!allow_comments || pos + 1 >= len)
+        break;
+      if (text[pos + 1] == '/')
+      {
+        const unsigned char *end = memchr(text + pos + 2, '\n', len - pos - 2);
+        pos = end ? (size_t)(end - text) : len;
+      }
+      else if (text[pos + 1] == '*')
+      {
+        for (pos += 2; pos + 1 < len && !(text[pos] == '*' && text[pos + 1] == '/'); pos++)
+          ;
+        pos = pos + 1 < len ? pos + 1 : len;
+      }
+      break;
+    }
+  }
+  return len;
+}
+
+#ifdef SIMD_AVX2_DISPATCH
+static SIMD_AVX2_TARGET size_t skip_to_close_avx2(const unsigned char *text, size_t pos, size_t len, int allow_comments)
+{
+  return skip_to_close_with(text, pos, len, allow_comments, skip_find_avx2);
+}
+#endif
+
+static size_t skip_to_close(const unsigned char *text, size_t pos, size_t len, int allow_comments)
+{
+#ifdef SIMD_AVX2_DISPATCH
+  if (simd_avx2)
+    return skip_to_close_avx2(text, pos, len, allow_comments);
+#endif
+  return skip_to_close_with(text, pos, len, allow_comments, skip_find);
+}
+
+// Parses a synthetic prefix with a new handle, so it's in the state the old one had inside the containers
+// enclosing the skipped one, then the value
+static void scan_ctx_replay(scan_ctx *ctx, int depth, const char *value)
+{
+  int current_path_len = ctx->current_path_len;
+  scan_stats_t stats;
+  // callbacks do nothing this deep, and the replayed tokens aren't counted
+  if (ctx->stats)
+    stats = *ctx->stats;
+  ctx->current_path_len = ctx->max_path_len + 1;
+  for (int i = 0; i < depth; i++)
+  {
+    if (ctx->current_path[i].type == PATH_KEY)
+      yajl_parse(ctx->handle, (const unsigned char *)"{\"\":", 4);
+    else
+      yajl_parse(ctx->handle, (const unsigned char *)"[", 1);
+  }
+  yajl_parse(ctx->handle, (const unsigned char *)value, strlen(value));
+  ctx->current_path_len = current_path_len;
+  if (ctx->stats)
+    *ctx->stats = stats;
+}
+
+static VALUE scan_checkpoint_fetch(VALUE checkpoint, const char *name)
+{
+  VALUE key = ID2SYM(rb_intern(name)), value = rb_hash_lookup2(checkpoint, key, Qundef);
+  // the keys are strings if the checkpoint has been stored as JSON
+  if (value == Qundef)
+    value = rb_hash_lookup2(checkpoint, rb_sym2str(key), Qundef);
+  if (value == Qundef)
+    rb_raise(rb_eArgError, "invalid checkpoint: no %s", name);
+  return value;
+}
+
+// Needs the GVL
+// Reads a Hash returned by StreamScanner#checkpoint, returns the nodes done
+static VALUE scan_checkpoint_get(VALUE checkpoint, scan_checkpoint_t *cp)
+{
+  VALUE path = scan_checkpoint_fetch(checkpoint, "path"), starts = scan_checkpoint_fetch(checkpoint, "starts");
+  VALUE done = scan_checkpoint_fetch(checkpoint, "done_nodes");
+  rb_check_type(path, T_ARRAY);
+  rb_check_type(starts, T_ARRAY);
+  rb_check_type(done, T_ARRAY);
+  if (RARRAY_LEN(path) > 1 || RARRAY_LEN(starts) != RARRAY_LEN(path) || RARRAY_LEN(done) > INT_MAX)
+    rb_raise(rb_eArgError, "invalid checkpoint: only top-level values and elements of a top-level array are resumed");
+  cp->offset = NUM2SIZET(scan_checkpoint_fetch(checkpoint, "offset"));
+  cp->roots = NUM2SIZET(scan_checkpoint_fetch(checkpoint, "roots"));
+  // a value of depth 0 is a top-level one, it's counted in roots
+  cp->depth = RARRAY_LEN(path) ? 1 : cp->roots ? 0 : -1;
+  cp->index = cp->depth == 1 ? NUM2LONG(rb_ary_entry(path, 0)) : 0;
+  cp->start = cp->depth == 1 ? NUM2SIZET(rb_ary_entry(starts, 0)) : 0;
+  cp->done_len = (int)RARRAY_LEN(done);
+  if (cp->depth == 1 && (cp->index < 0 || cp->start >= cp->offset))
+    rb_raise(rb_eArgError, "invalid checkpoint: path and starts don't match the offset");
+  return done;
+}
+
+// Needs the GVL, the ctx must be reset
+// Puts the scan into the state it had at the checkpoint, scan_ctx_replay does the same for the handle
+static void scan_ctx_restore(scan_ctx *ctx, const scan_checkpoint_t *cp, VALUE done)
+{
+  for (int i = 0; i < cp->done_len; i++)
+  {
+    int node = NUM2INT(rb_ary_entry(done, i));
+    if (node <= 0 || node >= ctx->nodes_len || ctx->node_states[node].done)
+      rb_raise(rb_eArgError, "invalid checkpoint: it's made with other paths");
+    mark_node_done(ctx, node);
+  }
+  if (cp->depth == 1)
+  {
+    if (ctx->max_path_len < 1)
+      rb_raise(rb_eArgError, "invalid checkpoint: it's made with other paths");
+    ctx->starts[0] = cp->start;
+    ctx->current_path[0].type = PATH_INDEX;
+    ctx->current_path[0].value.index = cp->index;
+    update_states(ctx, 0);
+    ctx->current_path_len = 1;
+  }
+  ctx->yajl_bytes_consumed = cp->offset;
+  ctx->roots = cp->roots;
+  ctx->checkpoint = *cp;
+  ctx->checkpoint.done_len = ctx->done_log_len;
+  ctx->resumed = cp->depth >= 0;
+}
+
+// noexcept
+// The checkpoint resumed from is where stop_early cancelled the scan: the element of the top-level array before it
+// was the last one anything could match, so the scan stops there again without parsing the rest
+static inline int scan_ctx_resumed_done(const scan_ctx *ctx)
+{
+  return ctx->resumed && ctx->stop_early && ctx->current_path_len == 1 && ctx->done_paths_len == ctx->paths_len;
+}
+
+// Parsing was cancelled at the container at skip_pos, resumes it after the closing bracket
+static yajl_status scan_ctx_skip(scan_ctx *ctx, scan_options *options, const unsigned char *json_text, size_t json_text_len)
+{
+  int depth = ctx->current_path_len - 1;
+  size_t end = skip_to_close(json_text, ctx->skip_pos, json_text_len, SCAN_OPTION(options, allow_comments));
+  ctx->skip_pending = false;
+  scan_ctx_free_handle(ctx);
+  if (scan_ctx_alloc_handle(ctx, options) == NULL)
+  {
+    ctx->nomem = true;
+    return yajl_status_client_canceled;
+  }
+  if (end == json_text_len)
+  {
+    // Not closed, let yajl decide if it's a premature EOF or a partial value
+    scan_ctx_replay(ctx, depth, ctx->skip_object ? "{" : "[");
+    ctx->yajl_bytes_consumed = json_text_len;
+    ctx->chunk = json_text + json_text_len;
+    ctx->chunk_len = 0;
+    return yajl_parse(ctx->handle, ctx->chunk, 0);
+  }
+  ctx->yajl_bytes_consumed = end + 1;
+  // the same the end callbacks do
+  ctx->current_path_len--;
+  save_point(ctx, ctx->skip_object ? object_value : array_value, 0);
+  if (!value_done(ctx))
+    return yajl_status_client_canceled;
+  scan_ctx_replay(ctx, depth, "null");
+  ctx->chunk = json_text + end + 1;
+  ctx->chunk_len = json_text_len - end - 1;
+  return yajl_parse(ctx->handle, ctx->chunk, ctx->chunk_len);
+}
+
+// engine: :simd scans in two stages like simdjson does: the first one builds an index of structural characters,
+// quotes and first bytes of other tokens for the whole text using vector instructions, the second one walks the index
+// and calls the same callbacks yajl does. Anything it can't handle exactly the way yajl does is reported as an error,
+// and the text is scanned with yajl then, so yajl is responsible for the errors and all the relaxed modes
+typedef enum
+{
+  simd_status_ok,
+  simd_status_client_canceled,
+  simd_status_error,
+} simd_status;
+
+typedef struct
+{
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t whitespace;
+  uint64_t op;
+} simd_block_t;
+
+#if defined(__GNUC__) && defined(__ARM_NEON) && defined(__aarch64__) && !defined(__SSE2__)
+// A bit per byte of 4 vectors of comparison results
+static inline uint64_t simd_neon_mask(uint8x16_t v0, uint8x16_t v1, uint8x16_t v2, uint8x16_t v3)
+{
+  const uint8x16_t bits = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t sum0 = vpaddq_u8(vandq_u8(v0, bits), vandq_u8(v1, bits));
+  uint8x16_t sum1 = vpaddq_u8(vandq_u8(v2, bits), vandq_u8(v3, bits));
+  sum0 = vpaddq_u8(sum0, sum1);
+  sum0 = vpaddq_u8(sum0, sum0);
+  return vgetq_lane_u64(vreinterpretq_u64_u8(sum0), 0);
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__AVX2__) || defined(SIMD_AVX2_DISPATCH))
+static inline SIMD_AVX2_TARGET void simd_classify_avx2(const unsigned char *block, simd_block_t *masks)
+{
+  masks->quote = masks->backslash = masks->whitespace = masks->op = 0;
+  for (int i = 0; i < 2; i++)
+  {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(block + 32 * i));
+    // '[' | 0x20 == '{' and ']' | 0x20 == '}'
+    __m256i lower = _mm256_or_si256(chunk, _mm256_set1_epi8(0x20));
+    __m256i ws = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\r'))));
+    __m256i op = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(','))));
+    masks->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('"'))) << (32 * i);
+    masks->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\\'))) << (32 * i);
+    masks->whitespace |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ws) << (32 * i);
+    masks->op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << (32 * i);
+  }
+}
+#endif
+
+// Bit masks of the characters the index is built from for 64 bytes
+static inline void simd_classify(const unsigned char *block, simd_block_t *masks)
+{
+#if defined(__GNUC__) && defined(__AVX2__)
+  simd_classify_avx2(block, masks);
+#elif defined(__GNUC__) && defined(__SSE2__)
+  masks->quote = masks->backslash = masks->whitespace = masks->op = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(block + 16 * i));
+    __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+    __m128i ws = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+    __m128i op = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')), _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(':')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8(','))));
+    masks->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('"'))) << (16 * i);
+    masks->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\'))) << (16 * i);
+    masks->whitespace |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << (16 * i);
+    masks->op |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << (16 * i);
+  }
+#elif defined(__GNUC__) && defined(__ARM_NEON) && defined(__aarch64__)
+  uint8x16_t chunk[4], quote[4], backslash[4], ws[4], op[4];
+  for (int i = 0; i < 4; i++)
+  {
+    uint8x16_t lower;
+    chunk[i] = vld1q_u8(block + 16 * i);
+    lower = vorrq_u8(chunk[i], vdupq_n_u8(0x20));
+    quote[i] = vceqq_u8(chunk[i], vdupq_n_u8('"'));
+    backslash[i] = vceqq_u8(chunk[i], vdupq_n_u8('\\'));
+    ws[i] = vorrq_u8(vorrq_u8(vceqq_u8(chunk[i], vdupq_n_u8(' ')), vceqq_u8(chunk[i], vdupq_n_u8('\t'))),
+                     vorrq_u8(vceqq_u8(chunk[i], vdupq_n_u8('\n')), vceqq_u8(chunk[i], vdupq_n_u8('\r'))));
+    op[i] = vorrq_u8(vorrq_u8(vceqq_u8(lower, vdupq_n_u8('{')), vceqq_u8(lower, vdupq_n_u8('}'))),
+                     vorrq_u8(vceqq_u8(chunk[i], vdupq_n_u8(':')), vceqq_u8(chunk[i], vdupq_n_u8(','))));
+  }
+  masks->quote = simd_neon_mask(quote[0], quote[1], quote[2], quote[3]);
+  masks->backslash = simd_neon_mask(backslash[0], backslash[1], backslash[2], backslash[3]);
+  masks->whitespace = simd_neon_mask(ws[0], ws[1], ws[2], ws[3]);
+  masks->op = simd_neon_mask(op[0], op[1], op[2], op[3]);
+#else
+  masks->quote = masks->backslash = masks->whitespace = masks->op = 0;
+  for (int i = 0; i < 64; i++)
+  {
+    uint64_t bit = (uint64_t)1 << i;
+    switch (block[i])
+    {
+    case '"':
+      masks->quote |= bit;
+      break;
+    case '\\':
+      masks->backslash |= bit;
+      break;
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+      masks->whitespace |= bit;
+      break;
+    case '{':
+    case '}':
+    case '[':
+    case ']':
+    case ':':
+    case ',':
+      masks->op |= bit;
+      break;
+    }
+  }
+#endif
+}
+
+// Characters escaped by backslashes, prev_escaped carries the escape over to the next block
+static inline uint64_t simd_escaped(uint64_t backslash, uint64_t *prev_escaped)
+{
+  const uint64_t even_bits = 0x5555555555555555ULL;
+  uint64_t follows_escape, odd_starts, even_starts;
+  // an escaped backslash doesn't escape anything
+  backslash &= ~*prev_escaped;
+  follows_escape = backslash << 1 | *prev_escaped;
+  // the carry clears sequences of backslashes starting on odd bits
+  odd_starts = backslash & ~even_bits & ~follows_escape;
+  even_starts = odd_starts + backslash;
+  *prev_escaped = even_starts < odd_starts;
+  return (even_bits ^ (even_starts << 1)) & follows_escape;
+}
+
+// Each bit is the xor of the bits up to it, so the bits between quotes are set
+static inline uint64_t simd_prefix_xor(uint64_t bits)
+{
+#if defined(__GNUC__) && defined(__PCLMUL__) && defined(__x86_64__)
+  return (uint64_t)_mm_cvtsi128_si64(
+      _mm_clmulepi64_si128(_mm_set_epi64x(0, (long long)bits), _mm_set1_epi8((char)0xFF), 0));
+#else
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+#endif
+}
+
+#ifdef SIMD_AVX2_DISPATCH
+static inline SIMD_AVX2_TARGET uint64_t simd_prefix_xor_clmul(uint64_t bits)
+{
+  return (uint64_t)_mm_cvtsi128_si64(
+      _mm_clmulepi64_si128(_mm_set_epi64x(0, (long long)bits), _mm_set1_epi8((char)0xFF), 0));
+}
+#endif
+
+static inline int simd_ctz(uint64_t bits)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(bits);
+#else
+  int n = 0;
+  for (; !(bits & 1); bits >>= 1)
+    n++;
+  return n;
+#endif
+}
+
+// Doesn't need the GVL
+// Returns false if there is a backslash outside strings, the second stage would see different tokens than yajl,
+// or if the scan is aborted
+static SIMD_KERNEL_INLINE int simd_index_build_with(scan_ctx *ctx, simd_index_t *index, const unsigned char *text,
+                                                    size_t len, void (*classify)(const unsigned char *, simd_block_t *),
+                                                    uint64_t (*prefix_xor)(uint64_t))
+{
+  uint64_t prev_escaped = 0, prev_in_string = 0, prev_scalar = 0, stray_backslash = 0;
+  unsigned char tail[64];
+  index->len = 0;
+  if (!scan_ctx_reserve(ctx, (void **)&index->pos, &index->cap, len / 8 + 64, sizeof(uint32_t)))
+    return false;
+  for (size_t base = 0; base < len; base += 64)
+  {
+    const unsigned char *block = text + base;
+    simd_block_t masks;
+    uint64_t quote, in_string, scalar, structural;
+    if (len - base < 64)
+    {
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, block, len - base);
+      block = tail;
+    }
+    classify(block, &masks);
+    quote = masks.quote & ~simd_escaped(masks.backslash, &prev_escaped);
+    // opening quotes and string contents, but not closing quotes
+    in_string = prefix_xor(quote) ^ prev_in_string;
+    prev_in_string = 0 - (in_string >> 63);
+    stray_backslash |= masks.backslash & ~in_string;
+    scalar = ~(masks.op | masks.whitespace | quote | in_string);
+    structural = (masks.op & ~in_string) | quote | (scalar & ~(scalar << 1 | prev_scalar));
+    prev_scalar = scalar >> 63;
+    // every 64 KiB
+    if ((base & 0xFFFF) == 0 && ctx->interrupted)
+      return false;
+    if (!scan_ctx_reserve(ctx, (void **)&index->pos, &index->cap, index->len + 64, sizeof(uint32_t)))
+      return false;
+    for (; structural; structural &= structural - 1)
+      index->pos[index->len++] = (uint32_t)(base + simd_ctz(structural));
+  }
+  return !stray_backslash;
+}
+
+#ifdef SIMD_AVX2_DISPATCH
+static SIMD_AVX2_TARGET int simd_index_build_avx2(scan_ctx *ctx, simd_index_t *index, const unsigned char *text,
+                                                  size_t len)
+{
+  return simd_index_build_with(ctx, index, text, len, simd_classify_avx2, simd_prefix_xor_clmul);
+}
+#endif
+
+static int simd_index_build(scan_ctx *ctx, simd_index_t *index, const unsigned char *text, size_t len)
+{
+#ifdef SIMD_AVX2_DISPATCH
+  if (simd_avx2)
+    return simd_index_build_avx2(ctx, index, text, len);
+#endif
+  return simd_index_build_with(ctx, index, text, len, simd_classify, simd_prefix_xor);
+}
+
+// The string between quotes at text[begin] and text[end] is valid for yajl, escapes are checked always,
+// UTF-8 sequences - the same way yajl does it unless dont_validate_strings is set
+static int simd_valid_string(const unsigned char *text, size_t begin, size_t end, int validate_utf8, int *escaped)
+{
+  size_t i = begin + 1;
+#if defined(__GNUC__) && defined(__SSE2__)
+  // skip plain ASCII quickly
+  while (i + 16 <= end)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(text + i));
+    __m128i special = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(chunk, _mm_set1_epi8(0x1F)), _mm_set1_epi8(0x1F)),
+                                   _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\')));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(special, chunk));
+    if (mask)
+    {
+      i += __builtin_ctz(mask);
+      break;
+    }
+    i += 16;
+  }
+#endif
+  for (; i < end; i++)
+  {
+    unsigned char c = text[i];
+    int follows;
+    if (c >= 0x20 && c < 0x80 && c != '\\')
+      continue;
+    if (c < 0x20)
+      return false;
+    if (c == '\\')
+    {
+      *escaped = true;
+      switch (text[++i])
+      {
+      case '"':
+      case '\\':
+      case '/':
+      case 'b':
+      case 'f':
+      case 'n':
+      case 'r':
+      case 't':
+        break;
+      case 'u':
+        if (i + 4 >= end)
+          return false;
+        for (int j = 1; j <= 4; j++)
+        {
+          if (!isxdigit(text[i + j]))
+            return false;
+        }
+        i += 4;
+        break;
+      default:
+        return false;
+      }
+      continue;
+    }
+    if (!validate_utf8)
+      continue;
+    if ((c >> 5) == 0x06)
+      follows = 1;
+    else if ((c >> 4) == 0x0E)
+      follows = 2;
+    else if ((c >> 3) == 0x1E)
+      follows = 3;
+    else
+      return false;
+    for (; follows; follows--)
+    {
+      if (++i >= end || (text[i] >> 6) != 0x02)
+        return false;
+    }
+  }
+  return true;
+}
+
+static inline unsigned int simd_hex(const unsigned char *hex)
+{
+  unsigned int value = 0;
+  for (int i = 0; i < 4; i++)
+    value = (value << 4) | (unsigned int)(hex[i] <= '9' ? hex[i] - '0' : (hex[i] | 0x20) - 'a' + 10);
+  return value;
+}
+
+// Doesn't need the GVL
+// Decodes a valid escaped string the way yajl does, returns NULL for broken surrogate pairs, yajl mangles them
+static const unsigned char *simd_decode_string(scan_ctx *ctx, simd_index_t *index, const unsigned char *key, size_t len,
+                                            size_t *decoded_len)
+{
+  unsigned char *out;
+  size_t j = 0;
+  // decoded strings are never longer
+  if (!scan_ctx_reserve(ctx, (void **)&index->key_buf, &index->key_cap, len, sizeof(char)))
+    return NULL;
+  out = (unsigned char *)index->key_buf;
+  for (size_t i = 0; i < len; i++)
+  {
+    unsigned int codepoint;
+    if (key[i] != '\\')
+    {
+      out[j++] = key[i];
+      continue;
+    }
+    switch (key[++i])
+    {
+    case 'b':
+      out[j++] = '\b';
+      continue;
+    case 'f':
+      out[j++] = '\f';
+      continue;
+    case 'n':
+      out[j++] = '\n';
+      continue;
+    case 'r':
+      out[j++] = '\r';
+      continue;
+    case 't':
+      out[j++] = '\t';
+      continue;
+    case 'u':
+      break;
+    default:
+      out[j++] = key[i];
+      continue;
+    }
+    codepoint = simd_hex(key + i + 1);
+    i += 4;
+    if ((codepoint & 0xFC00) == 0xD800)
+    {
+      unsigned int surrogate;
+      if (i + 6 >= len || key[i + 1] != '\\' || key[i + 2] != 'u')
+        return NULL;
+      surrogate = simd_hex(key + i + 3);
+      if ((surrogate & 0xFC00) != 0xDC00)
+        return NULL;
+      codepoint = (((codepoint & 0x3F) << 10) | ((((codepoint >> 6) & 0xF) + 1) << 16) | (surrogate & 0x3FF));
+      i += 6;
+    }
+    // yajl encodes U+FFFF with 4 bytes
+    if (codepoint < 0x80)
+    {
+      out[j++] = (unsigned char)codepoint;
+    }
+    else if (codepoint < 0x800)
+    {
+      out[j++] = (unsigned char)(0xC0 | (codepoint >> 6));
+      out[j++] = (unsigned char)(0x80 | (codepoint & 0x3F));
+    }
+    else if (codepoint < 0xFFFF)
+    {
+      out[j++] = (unsigned char)(0xE0 | (codepoint >> 12));
+      out[j++] = (unsigned char)(0x80 | ((codepoint >> 6) & 0x3F));
+      out[j++] = (unsigned char)(0x80 | (codepoint & 0x3F));
+    }
+    else
+    {
+      out[j++] = (unsigned char)(0xF0 | (codepoint >> 18));
+      out[j++] = (unsigned char)(0x80 | ((codepoint >> 12) & 0x3F));
+      out[j++] = (unsigned char)(0x80 | ((codepoint >> 6) & 0x3F));
+      out[j++] = (unsigned char)(0x80 | (codepoint & 0x3F));
+    }
+  }
+  *decoded_len = j;
+  return out;
+}
+
+// The length of the number at num, the part before a fraction or an exponent without digits if there is one
+static size_t simd_number_len(const unsigned char *num, size_t len)
+{
+  size_t i = 0, end;
+  if (num[i] == '-')
+    i++;
+  if (i < len && num[i] == '0')
+    i++;
+  else if (i < len && num[i] >= '1' && num[i] <= '9')
+    for (; i < len && isdigit(num[i]); i++)
+      ;
+  else
+    return 0;
+  end = i;
+  if (i < len && num[i] == '.')
+  {
+    if (++i >= len || !isdigit(num[i]))
+      return end;
+    for (; i < len && isdigit(num[i]); i++)
+      ;
+    end = i;
+  }
+  if (i < len && (num[i] | 0x20) == 'e')
+  {
+    if (++i < len && (num[i] == '+' || num[i] == '-'))
+      i++;
+    if (i >= len || !isdigit(num[i]))
+      return end;
+    for (; i < len && isdigit(num[i]); i++)
+      ;
+    end = i;
+  }
+  return end;
+}
+
+static int simd_valid_number(const unsigned char *num, size_t len)
+{
+  return simd_number_len(num, len) == len;
+}
+
+// Whitespace, quotes and structural characters end other tokens
+static const char simd_token_end[256] = {
+    ['\t'] = 1, ['\n'] = 1, ['\r'] = 1, [' '] = 1, ['"'] = 1, [','] = 1, [':'] = 1, ['['] = 1, [']'] = 1, ['{'] = 1, ['}'] = 1};
+
+// Scans a token which is not a string or a container, the index doesn't keep where they end
+static simd_status simd_scan_scalar(scan_ctx *ctx, const unsigned char *text, size_t len, size_t begin)
+{
+  size_t end = begin;
+  int ret;
+  while (end < len && !simd_token_end[text[end]])
+    end++;
+  ctx->yajl_bytes_consumed = end;
+  if (end - begin == 4 && memcmp(text + begin, "null", 4) == 0)
+    ret = scan_on_null(ctx);
+  else if (end - begin == 4 && memcmp(text + begin, "true", 4) == 0)
+    ret = scan_on_boolean(ctx, true);
+  else if (end - begin == 5 && memcmp(text + begin, "false", 5) == 0)
+    ret = scan_on_boolean(ctx, false);
+  else if (simd_valid_number(text + begin, end - begin))
+    ret = scan_on_number(ctx, (const char *)text + begin, end - begin);
+  else
+    return simd_status_error;
+  return ret ? simd_status_ok : simd_status_client_canceled;
+}
+
+enum simd_expect
+{
+  simd_expect_value,
+  simd_expect_first_value,
+  simd_expect_key,
+  simd_expect_first_key,
+  simd_expect_comma,
+};
+
+// Doesn't need the GVL
+// Walks the index, the current position is kept in yajl_bytes_consumed, callbacks see it as if yajl called them.
+// The index may start inside containers, their closing brackets are on the index stack up to depth
+static simd_status simd_scan_from(scan_ctx *ctx, scan_options *options, simd_index_t *index, const unsigned char *text,
+                                  size_t len, enum simd_expect expect, size_t depth)
+{
+  int validate_utf8 = !SCAN_OPTION(options, dont_validate_strings);
+  size_t i = 0;
+  while (true)
+  {
+    size_t pos;
+    unsigned char c;
+    simd_status stat;
+    int escaped = false;
+    if (expect == simd_expect_comma && depth == 0)
+    {
+      // the root value is complete
+      if (i == index->len)
+        return simd_status_ok;
+      if (SCAN_OPTION(options, allow_multiple_values))
+        expect = simd_expect_value;
+      else if (SCAN_OPTION(options, allow_trailing_garbage))
+        return simd_status_ok;
+      else
+        return simd_status_error;
+    }
+    if (i == index->len)
+      return simd_status_error;
+    pos = index->pos[i++];
+    c = text[pos];
+    ctx->yajl_bytes_consumed = pos + 1;
+    if ((c == '}' || c == ']') &&
+        (expect == simd_expect_comma || expect == simd_expect_first_key || expect == simd_expect_first_value))
+    {
+      if (index->stack[--depth] != c)
+        return simd_status_error;
+      if (!(c == '}' ? scan_on_end_object(ctx) : scan_on_end_array(ctx)))
+        return simd_status_client_canceled;
+      expect = simd_expect_comma;
+      continue;
+    }
+    switch (expect)
+    {
+    case simd_expect_comma:
+      if (c != ',')
+        return simd_status_error;
+      expect = index->stack[depth - 1] == '}' ? simd_expect_key : simd_expect_value;
+      break;
+    case simd_expect_key:
+    case simd_expect_first_key:
+    {
+      const unsigned char *key = text + pos + 1;
+      size_t end, key_len;
+      if (c != '"' || i + 1 >= index->len || text[index->pos[i + 1]] != ':')
+        return simd_status_error;
+      end = index->pos[i];
+      i += 2;
+      if (!simd_valid_string(text, pos, end, validate_utf8, &escaped))
+        return simd_status_error;
+      key_len = end - pos - 1;
+      // scan_on_key ignores keys deeper than the longest path
+      if (escaped && ctx->current_path_len <= ctx->max_path_len &&
+          (key = simd_decode_string(ctx, index, key, key_len, &key_len)) == NULL)
+        return simd_status_error;
+      ctx->yajl_bytes_consumed = end + 1;
+      scan_on_key(ctx, key, key_len);
+      expect = simd_expect_value;
+      break;
+    }
+    case simd_expect_value:
+    case simd_expect_first_value:
+      expect = simd_expect_comma;
+      switch (c)
+      {
+      case '{':
+      case '[':
+        if (c == '{' ? scan_on_start_object(ctx) : scan_on_start_array(ctx))
+        {
+          if (!scan_ctx_reserve(ctx, (void **)&index->stack, &index->stack_cap, depth + 1, sizeof(char)))
+            return simd_status_error;
+          index->stack[depth++] = c == '{' ? '}' : ']';
+          expect = c == '{' ? simd_expect_first_key : simd_expect_first_value;
+          break;
+        }
+        if (!ctx->skip_pending)
+          return simd_status_client_canceled;
+        // the same skip_to_close does, brackets of different types are not distinguished
+        for (size_t open = 1; i < index->len; i++)
+        {
+          c = text[index->pos[i]];
+          if ((c | 0x20) == '{')
+            open++;
+          else if ((c | 0x20) == '}' && --open == 0)
+            break;
+        }
+        // not closed, let yajl decide
+        if (i == index->len)
+          return simd_status_error;
+        ctx->skip_pending = false;
+        ctx->yajl_bytes_consumed = index->pos[i++] + 1;
+        // the same scan_ctx_skip does
+        ctx->current_path_len--;
+        save_point(ctx, ctx->skip_object ? object_value : array_value, 0);
+        if (!value_done(ctx))
+          return simd_status_client_canceled;
+        break;
+      case '"':
+      {
+        size_t end;
+        if (i == index->len)
+          return simd_status_error;
+        end = index->pos[i++];
+        if (!simd_valid_string(text, pos, end, validate_utf8, &escaped))
+          return simd_status_error;
+        // scan_on_string needs the string as it is in the text to find where it begins
+        if (escaped && (ctx->values || ctx->string_predicates) && ctx->current_path_len <= ctx->max_path_len &&
+            (ctx->decoded_value = simd_decode_string(ctx, index, text + pos + 1, end - pos - 1,
+                                                     &ctx->decoded_value_len)) == NULL)
+          return simd_status_error;
+        ctx->yajl_bytes_consumed = end + 1;
+        if (!scan_on_string(ctx, text + pos + 1, end - pos - 1))
+          return simd_status_client_canceled;
+        break;
+      }
+      case ',':
+      case ':':
+      case '}':
+      case ']':
+        return simd_status_error;
+      default:
+        if ((stat = simd_scan_scalar(ctx, text, len, pos)) != simd_status_ok)
+          return stat;
+        break;
+      }
+      break;
+    }
+  }
+}
+
+// Doesn't need the GVL
+static simd_status simd_scan(scan_ctx *ctx, scan_options *options, simd_index_t *index, const unsigned char *text, size_t len)
+{
+  return simd_scan_from(ctx, options, index, text, len, simd_expect_value, 0);
+}
+
+// The index uses 32-bit positions; comments aren't supported at all
+static inline int simd_supported(scan_options *options, size_t json_text_len)
+{
+  // stats are gathered by wrapping the callbacks of yajl, the walk of the index calls them directly
+  return SCAN_OPTION(options, engine) && !SCAN_OPTION(options, allow_comments) && !SCAN_OPTION(options, stats) &&
+         NIL_P(options->resume_from) && json_text_len <= UINT32_MAX;
+}
+
+// noexcept, doesn't need the GVL
+static simd_status scan_ctx_parse_simd(scan_ctx *ctx, scan_options *options, const unsigned char *json_text, size_t json_text_len)
+{
+  simd_index_t index = {0};
+  simd_status stat = simd_status_error;
+  if (ctx->scratch != NULL)
+  {
+    index = ctx->scratch->simd_index;
+    memset(&ctx->scratch->simd_index, 0, sizeof(simd_index_t));
+  }
+  ctx->handle = NULL;
+  ctx->chunk = json_text;
+  ctx->chunk_len = json_text_len;
+  if (simd_index_build(ctx, &index, json_text, json_text_len))
+    stat = simd_scan(ctx, options, &index, json_text, json_text_len);
+  ctx->chunk = NULL;
+  if (ctx->scratch != NULL && index.cap * sizeof(uint32_t) + index.stack_cap + index.key_cap <= SCAN_SCRATCH_MAX_BYTES)
+  {
+    ctx->scratch->simd_index = index;
+    return stat;
+  }
+  free(index.pos);
+  free(index.stack);
+  free(index.key_buf);
+  return stat;
+}
+
+// JsonScanner::Index, the values of a validated text up to max_depth in preorder, so a scan jumps over containers
+// with nothing to match inside; the contents of the containers at max_depth are scanned from the text
+#define INDEX_NODE_ESCAPED_KEY 1
+#define INDEX_NODE_ESCAPED 2
+#define INDEX_NODE_TRUNCATED 4
+
+typedef struct
+{
+  // the value is text[begin, end)
+  uint32_t begin;
+  uint32_t end;
+  // the quotes of the key of an object member
+  uint32_t key_begin;
+  uint32_t key_end;
+  // the node after the subtree, the children of a container follow it
+  uint32_t next;
+  uint8_t type;
+  uint8_t flags;
+} index_node_t;
+
+typedef struct
+{
+  // frozen, offsets of the nodes point into it
+  VALUE json_str;
+  index_node_t *nodes;
+  size_t nodes_len;
+  size_t nodes_cap;
+  int max_depth;
+  // the text was validated with these, they apply to the scans as well
+  int allow_multiple_values;
+  int dont_validate_strings;
+} json_index_t;
+
+// noexcept, doesn't need the GVL
+// Records the values from the structural index of a valid text, ends after the first one unless
+// allow_multiple_values is set. Returns false if a buffer can't grow
+static int index_build_nodes(scan_ctx *ctx, json_index_t *index, simd_index_t *si, const unsigned char *text,
+                             size_t len)
+{
+  // nodes of the open containers up to max_depth
+  uint32_t *open = NULL;
+  size_t open_cap = 0, depth = 0;
+  uint32_t key_begin = 0, key_end = 0;
+  int ok = true;
+  index->nodes_len = 0;
+  for (size_t i = 0; i < si->len; i++)
+  {
+    uint32_t pos = si->pos[i];
+    unsigned char c = text[pos];
+    index_node_t *node;
+    if (c == ',' || c == ':')
+      continue;
+    if (c == '}' || c == ']')
+    {
+      if (depth == 0)
+        break;
+      if (--depth <= (size_t)index->max_depth)
+      {
+        node = &index->nodes[open[depth]];
+        node->end = pos + 1;
+        node->next = (uint32_t)index->nodes_len;
+      }
+      if (depth == 0 && !index->allow_multiple_values)
+        break;
+      continue;
+    }
+    if (c == '"' && i + 2 < si->len && text[si->pos[i + 2]] == ':')
+    {
+      key_begin = pos;
+      key_end = si->pos[i + 1];
+      i += 2;
+      continue;
+    }
+    if (depth > (size_t)index->max_depth)
+    {
+      // skips the closing quote
+      if (c == '"')
+        i++;
+      else if (c == '{' || c == '[')
+        depth++;
+      continue;
+    }
+    if (!(ok = scan_ctx_reserve(ctx, (void **)&index->nodes, &index->nodes_cap, index->nodes_len + 1,
+                                sizeof(index_node_t))))
+      break;
+    node = &index->nodes[index->nodes_len];
+    node->begin = pos;
+    node->flags = 0;
+    node->key_begin = node->key_end = 0;
+    if (depth > 0 && index->nodes[open[depth - 1]].type == object_value)
+    {
+      node->key_begin = key_begin;
+      node->key_end = key_end;
+      if (memchr(text + key_begin + 1, '\\', key_end - key_begin - 1) != NULL)
+        node->flags |= INDEX_NODE_ESCAPED_KEY;
+    }
+    node->next = (uint32_t)++index->nodes_len;
+    switch (c)
+    {
+    case '{':
+    case '[':
+      node->type = c == '{' ? object_value : array_value;
+      if (depth == (size_t)index->max_depth)
+        node->flags |= INDEX_NODE_TRUNCATED;
+      if (!(ok = scan_ctx_reserve(ctx, (void **)&open, &open_cap, depth + 1, sizeof(uint32_t))))
+        break;
+      open[depth++] = (uint32_t)(index->nodes_len - 1);
+      continue;
+    case '"':
+      node->type = string_value;
+      node->end = si->pos[++i] + 1;
+      if (memchr(text + pos + 1, '\\', node->end - pos - 2) != NULL)
+        node->flags |= INDEX_NODE_ESCAPED;
+      break;
+    default:
+      // The index has the first byte of a run of scalars only, top-level values may follow each other without
+      // whitespace, "1false" is two of them as yajl sees it
+      while (true)
+      {
+        size_t scalar_len;
+        c = text[node->begin];
+        node->type = c == 'n' ? null_value : (c == 't' || c == 'f') ? boolean_value : number_value;
+        if (c == 'n' || c == 't' || c == 'f')
+          scalar_len = c == 'f' ? 5 : 4;
+        else if ((scalar_len = simd_number_len(text + node->begin, len - node->begin)) == 0)
+          scalar_len = 1;
+        node->end = node->begin + (uint32_t)scalar_len;
+        if (node->end >= len || simd_token_end[text[node->end]] || depth > 0 || !index->allow_multiple_values)
+          break;
+        if (!(ok = scan_ctx_reserve(ctx, (void **)&index->nodes, &index->nodes_cap, index->nodes_len + 1,
+                                    sizeof(index_node_t))))
+          break;
+        pos = index->nodes[index->nodes_len - 1].end;
+        node = &index->nodes[index->nodes_len];
+        node->begin = pos;
+        node->flags = 0;
+        node->key_begin = node->key_end = 0;
+        node->next = (uint32_t)++index->nodes_len;
+      }
+      break;
+    }
+    if (!ok || (depth == 0 && !index->allow_multiple_values))
+      break;
+  }
+  free(open);
+  return ok;
+}
+
+// noexcept, doesn't need the GVL
+// The contents of a container at max_depth, the start callback has been called for it
+static simd_status index_scan_contents(scan_ctx *ctx, scan_options *options, simd_index_t *si, const unsigned char *text,
+                                       size_t len, const index_node_t *node)
+{
+  uint32_t offset = node->begin + 1;
+  if (!simd_index_build(ctx, si, text + offset, node->end - offset) ||
+      !scan_ctx_reserve(ctx, (void **)&si->stack, &si->stack_cap, 1, sizeof(char)))
+    return simd_status_error;
+  for (size_t i = 0; i < si->len; i++)
+    si->pos[i] += offset;
+  si->stack[0] = node->type == object_value ? '}' : ']';
+  return simd_scan_from(ctx, options, si, text, len,
+                        node->type == object_value ? simd_expect_first_key : simd_expect_first_value, 1);
+}
+
+// noexcept, doesn't need the GVL
+// Calls the callbacks for the nodes the way simd_scan does, containers are skipped with skip_unmatched: :fast
+static simd_status index_walk(scan_ctx *ctx, scan_options *options, const json_index_t *index, simd_index_t *si,
+                              const unsigned char *text, size_t len)
+{
+  const index_node_t *nodes = index->nodes;
+  uint32_t *open = NULL;
+  size_t open_cap = 0, depth = 0, i = 0;
+  simd_status stat = simd_status_ok;
+  ctx->skip_fast = true;
+  while (true)
+  {
+    const index_node_t *node;
+    int ret;
+    while (depth > 0 && i == nodes[open[depth - 1]].next)
+    {
+      node = &nodes[open[--depth]];
+      ctx->yajl_bytes_consumed = node->end;
+      if (!(node->type == object_value ? scan_on_end_object(ctx) : scan_on_end_array(ctx)))
+      {
+        stat = simd_status_client_canceled;
+        goto done;
+      }
+    }
+    if (i == index->nodes_len)
+      break;
+    node = &nodes[i];
+    if (depth > 0 && nodes[open[depth - 1]].type == object_value)
+    {
+      const unsigned char *key = text + node->key_begin + 1;
+      size_t key_len = node->key_end - node->key_begin - 1;
+      // scan_on_key ignores keys deeper than the longest path
+      if ((node->flags & INDEX_NODE_ESCAPED_KEY) && ctx->current_path_len <= ctx->max_path_len &&
+          (key = simd_decode_string(ctx, si, key, key_len, &key_len)) == NULL)
+      {
+        stat = simd_status_error;
+        goto done;
+      }
+      ctx->yajl_bytes_consumed = node->key_end + 1;
+      scan_on_key(ctx, key, key_len);
+    }
+    switch (node->type)
+    {
+    case object_value:
+    case array_value:
+      ctx->yajl_bytes_consumed = node->begin + 1;
+      if (node->type == object_value ? scan_on_start_object(ctx) : scan_on_start_array(ctx))
+      {
+        if (node->flags & INDEX_NODE_TRUNCATED)
+        {
+          if ((stat = index_scan_contents(ctx, options, si, text, len, node)) != simd_status_ok)
+            goto done;
+          i = node->next;
+          continue;
+        }
+        if (!scan_ctx_reserve(ctx, (void **)&open, &open_cap, depth + 1, sizeof(uint32_t)))
+        {
+          stat = simd_status_error;
+          goto done;
+        }
+        open[depth++] = (uint32_t)i++;
+        continue;
+      }
+      if (!ctx->skip_pending)
+      {
+        stat = simd_status_client_canceled;
+        goto done;
+      }
+      // the same scan_ctx_skip does
+      ctx->skip_pending = false;
+      ctx->yajl_bytes_consumed = node->end;
+      ctx->current_path_len--;
+      save_point(ctx, ctx->skip_object ? object_value : array_value, 0);
+      ret = value_done(ctx);
+      break;
+    case string_value:
+      if ((node->flags & INDEX_NODE_ESCAPED) && (ctx->values || ctx->string_predicates) &&
+          ctx->current_path_len <= ctx->max_path_len &&
+          (ctx->decoded_value = simd_decode_string(ctx, si, text + node->begin + 1, node->end - node->begin - 2,
+                                                   &ctx->decoded_value_len)) == NULL)
+      {
+        stat = simd_status_error;
+        goto done;
+      }
+      ctx->yajl_bytes_consumed = node->end;
+      ret = scan_on_string(ctx, text + node->begin + 1, node->end - node->begin - 2);
+      break;
+    case number_value:
+      ctx->yajl_bytes_consumed = node->end;
+      ret = scan_on_number(ctx, (const char *)text + node->begin, node->end - node->begin);
+      break;
+    case boolean_value:
+      ctx->yajl_bytes_consumed = node->end;
+      ret = scan_on_boolean(ctx, text[node->begin] == 't');
+      break;
+    default:
+      ctx->yajl_bytes_consumed = node->end;
+      ret = scan_on_null(ctx);
+      break;
+    }
+    if (!ret)
+    {
+      stat = simd_status_client_canceled;
+      goto done;
+    }
+    i = node->next;
+  }
+done:
+  free(open);
+  return stat;
+}
+
+// noexcept, doesn't need the GVL
+static simd_status scan_ctx_walk_index(scan_ctx *ctx, scan_options *options, const json_index_t *index,
+                                       const unsigned char *json_text, size_t json_text_len)
+{
+  simd_index_t si = {0};
+  simd_status stat;
+  if (ctx->scratch != NULL)
+  {
+    si = ctx->scratch->simd_index;
+    memset(&ctx->scratch->simd_index, 0, sizeof(simd_index_t));
+  }
+  ctx->handle = NULL;
+  ctx->chunk = json_text;
+  ctx->chunk_len = json_text_len;
+  stat = index_walk(ctx, options, index, &si, json_text, json_text_len);
+  ctx->chunk = NULL;
+  if (ctx->scratch != NULL && si.cap * sizeof(uint32_t) + si.stack_cap + si.key_cap <= SCAN_SCRATCH_MAX_BYTES)
+  {
+    ctx->scratch->simd_index = si;
+    return stat;
+  }
+  free(si.pos);
+  free(si.stack);
+  free(si.key_buf);
+  return stat;
+}
+
+// Needs the GVL
+static size_t scan_stats_objects(void)
+{
+  return rb_gc_stat(total_allocated_objects_sym);
+}
+
+// Needs the GVL, see JsonScanner.last_stats
+static void scan_stats_save(const scan_stats_t *stats)
+{
+  scan_scratch_t *scratch = thread_scratch_get();
+  scratch->last_stats = *stats;
+  scratch->has_last_stats = true;
+}
+
+// Texts shorter than this are scanned holding the GVL, getting it back may take longer than the scan itself
+#define SCAN_NOGVL_MIN_LEN (64 * 1024)
+
+typedef struct
+{
+  VALUE path_ary;
+  scan_options *options;
+  const char *json_text;
+  size_t json_text_len;
+  // owned by the scan, shares the compiled paths of a Selector, released by scan_text_release
+  scan_ctx *ctx;
+  // JsonScanner::Index#scan, the text is walked by the index instead of being parsed
+  const json_index_t *index;
+  // set by scan_text_parse
+  yajl_status stat;
+  const unsigned char *error_text;
+  size_t error_text_len;
+  size_t bytes_consumed;
+} scan_text_args;
+
+// Doesn't need the GVL, the handle is kept for the error message
+static void *scan_text_parse(void *data)
+{
+  scan_text_args *args = (scan_text_args *)data;
+  scan_ctx *ctx = args->ctx;
+  scan_options *options = args->options;
+  const unsigned char *json_text = (const unsigned char *)args->json_text;
+  size_t json_text_len = args->json_text_len;
+  yajl_status stat;
+
+  args->bytes_consumed = json_text_len;
+  args->error_text = json_text;
+  args->error_text_len = json_text_len;
+  if (scan_ctx_resumed_done(ctx))
+  {
+    args->stat = yajl_status_client_canceled;
+    args->bytes_consumed = ctx->yajl_bytes_consumed;
+    return NULL;
+  }
+  if (args->index != NULL)
+  {
+    // The text has been validated, the walk stops only if it's cancelled
+    simd_status index_stat = scan_ctx_walk_index(ctx, options, args->index, json_text, json_text_len);
+    args->stat = index_stat == simd_status_ok ? yajl_status_ok : yajl_status_client_canceled;
+    args->bytes_consumed = index_stat == simd_status_ok ? json_text_len : scan_ctx_get_bytes_consumed(ctx);
+    return NULL;
+  }
+  if (simd_supported(options, json_text_len))
+  {
+    simd_status simd_stat = scan_ctx_parse_simd(ctx, options, json_text, json_text_len);
+    if (simd_stat != simd_status_error || scan_ctx_aborted(ctx))
+    {
+      args->stat = simd_stat == simd_status_ok ? yajl_status_ok : yajl_status_client_canceled;
+      args->bytes_consumed = simd_stat == simd_status_ok ? json_text_len : scan_ctx_get_bytes_consumed(ctx);
+      return NULL;
+    }
+    // Start over, yajl either reports the error or knows what to do with the text
+    scan_ctx_reset_with_options(ctx, ctx->points_list, ctx->roots_info_list, options);
+  }
+
+  if (scan_ctx_alloc_handle(ctx, options) == NULL)
+  {
+    ctx->nomem = true;
+    args->stat = yajl_status_client_canceled;
+    return NULL;
+  }
+  // resume_from, the text before the checkpoint isn't parsed again
+  if (ctx->resumed)
+    scan_ctx_replay(ctx, ctx->current_path_len, "null");
+  ctx->chunk = json_text + ctx->yajl_bytes_consumed;
+  ctx->chunk_len = json_text_len - ctx->yajl_bytes_consumed;
+  stat = yajl_parse(ctx->handle, ctx->chunk, ctx->chunk_len);
+  while (stat == yajl_status_client_canceled && ctx->skip_pending)
+    stat = scan_ctx_skip(ctx, options, json_text, json_text_len);
+  // the handle is replaced when a container is skipped
+  args->error_text = ctx->chunk;
+  args->error_text_len = ctx->chunk_len;
+  if (stat == yajl_status_ok)
+  {
+    scan_ctx_save_bytes_consumed(ctx);
+    ctx->chunk = NULL;
+    stat = yajl_complete_parse(ctx->handle);
+    args->error_text = json_text;
+    args->error_text_len = json_text_len;
+    // Don't count the final " " chunk
+  }
+  // Callbacks cancel parsing only when nothing else can match
+  if (stat == yajl_status_client_canceled)
+    args->bytes_consumed = scan_ctx_get_bytes_consumed(ctx);
+  ctx->chunk = NULL;
+  // // Needed when yajl_allow_partial_values is set
+  // if (ctx->current_path_len > 0)
+  // {
+  //   if (ctx->current_path_len > ctx->max_path_len)
+  //     ctx->current_path_len = ctx->max_path_len;
+  //   for (int i = ctx->current_path_len - 1; i > 0; i--)
+  //   {
+  //     switch (ctx->current_path[i].type)
+  //     {
+  //     case PATH_KEY:
+  //       scan_on_end_object(ctx);
+  //       break;
+  //     case PATH_INDEX:
+  //       scan_on_end_array(ctx);
+  //       break;
+  //     }
+  //   }
+  // }
+  args->stat = stat;
+  return NULL;
+}
+
+static void scan_ctx_unblock(void *data)
+{
+  ((scan_ctx *)data)->interrupted = true;
+}
+
+static VALUE scan_text_release(VALUE data)
+{
+  scan_text_args *args = (scan_text_args *)data;
+  scan_ctx *ctx = args->ctx;
+  if (ctx == NULL)
+    return Qnil;
+  args->ctx = NULL;
+  if (ctx->handle)
+    scan_ctx_free_handle(ctx);
+  scan_ctx_return_scratch(ctx);
+  ctx->chunk = NULL;
+  scan_ctx_free(ctx);
+  ruby_xfree(ctx);
+  return Qnil;
+}
+
+// Adds roots info and bytes consumed to the points list if requested
+static VALUE scan_result_new(VALUE points_list, VALUE roots_info_list, scan_options *options, size_t bytes_consumed)
+{
+  VALUE result = points_list;
+  if (roots_info_list != Qundef)
+  {
+    result = rb_ary_new_from_args(2, result, roots_info_list);
+    if (SCAN_OPTION(options, stop_early))
+      rb_ary_push(result, SIZET2NUM(bytes_consumed));
+  }
+  else if (SCAN_OPTION(options, stop_early))
+  {
+    result = rb_ary_new_from_args(2, result, SIZET2NUM(bytes_consumed));
+  }
+  return result;
+}
+
+static int scan_ndjson_supported(scan_options *options, size_t json_text_len);
+static VALUE scan_ndjson(scan_ctx *ctx, scan_text_args *args);
+
+// Scans a buffer which must stay valid and unchanged until it returns, the signature is suitable for rb_ensure,
+// scan_text_release must be called afterwards
+static VALUE scan_text(VALUE data)
+{
+  scan_text_args *args = (scan_text_args *)data;
+  VALUE path_ary = args->path_ary;
+  scan_options *options = args->options;
+
+  scan_ctx *ctx;
+  VALUE result, roots_info_result = Qundef;
+  scan_stats_t stats;
+  uint64_t start_ns = 0;
+  size_t objects = 0;
+  scan_checkpoint_t resume;
+  VALUE resume_done = Qnil;
+  // Turned out callbacks can't raise exceptions
+  // VALUE callback_err;
+  if (rb_obj_is_kind_of(path_ary, rb_cJsonScannerSelector))
+  {
+    scan_ctx *selector;
+    TypedData_Get_Struct(path_ary, scan_ctx, &selector_type, selector);
+    // The selector is never changed by scans, so other threads and Ractors can use it at the same time
+    ctx = ruby_xmalloc(sizeof(scan_ctx));
+    scan_ctx_init_shared(ctx, selector);
+  }
+  else
+  {
+    VALUE scan_ctx_init_err;
+    ctx = ruby_xmalloc(sizeof(scan_ctx));
+    scan_ctx_init_err = scan_ctx_init(ctx, path_ary, Qundef, Qundef);
+    if (scan_ctx_init_err != Qundef)
+    {
+      ruby_xfree(ctx);
+      rb_exc_raise(scan_ctx_init_err);
+    }
+  }
+  args->ctx = ctx;
+  if (options->resume_from != Qnil)
+  {
+    resume_done = scan_checkpoint_get(options->resume_from, &resume);
+    if (resume.offset > args->json_text_len)
+      rb_raise(rb_eArgError, "invalid checkpoint: offset is beyond the end of the text");
+  }
+  if (scan_ndjson_supported(options, args->json_text_len))
+  {
+    result = scan_ndjson(ctx, args);
+    if (result != Qundef)
+      return result;
+  }
+  scan_ctx_take_scratch(ctx);
+  for (int restarted = false;; restarted = true)
+  {
+    if (SCAN_OPTION(options, stats))
+      objects = scan_stats_objects();
+    // Need to keep a ref to result array on the stack to prevent it from being GC-ed
+    result = scan_points_list_new(ctx->paths_len, options);
+    if (SCAN_OPTION(options, with_roots_info))
+      roots_info_result = rb_ary_new();
+    scan_ctx_reset_with_options(ctx, result, roots_info_result, options);
+    if (resume_done != Qnil)
+      scan_ctx_restore(ctx, &resume, resume_done);
+    if (SCAN_OPTION(options, stats))
+    {
+      memset(&stats, 0, sizeof(stats));
+      stats.ruby_objects = scan_stats_objects() - objects;
+      ctx->stats = &stats;
+      start_ns = scan_stats_now_ns();
+    }
+    // scan_ctx_debug(ctx);
+    ctx->interrupted = false;
+    // A restarted scan keeps the GVL, otherwise frequent interrupts like signal traps could restart it forever
+    if (args->json_text_len >= SCAN_NOGVL_MIN_LEN && !restarted)
+      // Pending interrupts are handled when the GVL is acquired again, exceptions are raised from there
+      rb_thread_call_without_gvl(scan_text_parse, args, scan_ctx_unblock, ctx);
+    else
+      scan_text_parse(args);
+    if (ctx->stats)
+      stats.parse_ns = scan_stats_now_ns() - start_ns;
+    if (ctx->nomem)
+      rb_memerror();
+    if (!ctx->interrupted || args->stat != yajl_status_client_canceled)
+      break;
+    // Interrupted and handled without an exception, start over
+    if (ctx->handle)
+      scan_ctx_free_handle(ctx);
+  }
+  if (ctx->stats)
+  {
+    stats.bytes = args->stat == yajl_status_ok || args->stat == yajl_status_client_canceled
+                      ? args->bytes_consumed
+                      : scan_ctx_get_bytes_consumed(ctx);
+    stats.points = ctx->saved_points_len;
+    // the stats of a scan failing to parse are kept as well
+    scan_stats_save(&stats);
+    objects = scan_stats_objects();
+    start_ns = scan_stats_now_ns();
+  }
+  if (args->stat != yajl_status_ok && args->stat != yajl_status_client_canceled)
+    rb_exc_raise(scan_ctx_parse_error(ctx, SCAN_OPTION(options, verbose_error), args->error_text, args->error_text_len));
+  scan_ctx_save_results(ctx);
+  // callback_err = ctx->rb_err;
+  // if (callback_err != Qnil)
+  //   rb_exc_raise(callback_err);
+  result = scan_result_new(result, roots_info_result, options, args->bytes_consumed);
+  if (ctx->stats)
+  {
+    stats.results_ns = scan_stats_now_ns() - start_ns;
+    stats.ruby_objects += scan_stats_objects() - objects;
+    scan_stats_save(&stats);
+  }
+  return result;
+}
+
+static VALUE scan_string(VALUE json_str, VALUE path_ary, scan_options *options)
+{
+  VALUE result;
+  scan_text_args args;
+  // The scan runs without the GVL, a frozen string can't be changed by another thread meanwhile
+  if ((size_t)RSTRING_LEN(json_str) >= SCAN_NOGVL_MIN_LEN)
+    json_str = rb_str_new_frozen(json_str);
+  args.path_ary = path_ary;
+  args.options = options;
+  args.json_text = RSTRING_PTR(json_str);
+  args.json_text_len = (size_t)RSTRING_LEN(json_str);
+  args.ctx = NULL;
+  args.index = NULL;
+  result = rb_ensure(scan_text, (VALUE)&args, scan_text_release, (VALUE)&args);
+  RB_GC_GUARD(json_str);
+  return result;
+}
+
+// def scan(json_str, path_arr, opts)
+// opts
+// with_path: false, verbose_error: false, symbolize_path_keys: false, with_roots_info: false, stop_early: false,
+// skip_unmatched: nil, engine: :yajl, format: :arrays
+// stop_early has no effect together with allow_multiple_values
+// skip_unmatched: :fast skips containers with nothing to match inside without validation
+// engine: :simd builds a structural index of the text first, falls back to yajl for errors and comments
+// format: :packed returns a PackedResult per path instead of arrays of points, can't be used with with_path
+// threads: n > 1 with allow_multiple_values scans newline separated values in parallel
+// values: true adds the value of scalars to points: [begin, end, type, value], nil for containers
+// stats: true records counters and timings of the scan for JsonScanner.last_stats, runs with yajl in one thread
+// resume_from: a StreamScanner#checkpoint of the text, the scan starts at its offset with the state it had there
+// the following opts converted to bool and passed to yajl_config if provided, ignored if not provided
+// allow_comments, dont_validate_strings, allow_trailing_garbage, allow_multiple_values, allow_partial_values
+static VALUE scan(int argc, VALUE *argv, VALUE self)
+{
+  VALUE json_str, path_ary, rb_options;
+  scan_options options;
+  rb_scan_args(argc, argv, "21", &json_str, &path_ary, &rb_options);
+  rb_check_type(json_str, T_STRING);
+  // rb_io_write(rb_stderr, rb_sprintf("with_path_flag: %" PRIsVALUE " \n", with_path_flag));
+  scan_options_get(&options, rb_options);
+  return scan_string(json_str, path_ary, &options);
+}
+
+// def parse_tree(json_str, path_arr, opts)
+// Backs JsonScanner.parse: returns the roots with the matched values inserted, the opts of scan except
+// with_path, with_roots_info, format and values
+static VALUE parse_tree(VALUE self, VALUE json_str, VALUE path_ary, VALUE rb_options)
+{
+  scan_options options;
+  rb_check_type(json_str, T_STRING);
+  scan_options_get(&options, rb_options);
+  SCAN_OPTION_SET(&options, with_path, true);
+  SCAN_OPTION_SET(&options, with_roots_info, true);
+  SCAN_OPTION_SET(&options, values, true);
+  SCAN_OPTION_SET(&options, format, false);
+  // Containers are parsed from the same string which is scanned, see scan_string
+  if ((size_t)RSTRING_LEN(json_str) >= SCAN_NOGVL_MIN_LEN)
+    json_str = rb_str_new_frozen(json_str);
+  options.parse_text = json_str;
+  return rb_ary_entry(scan_string(json_str, path_ary, &options), 1);
+}
+
+// def allocation_counts
+// Counts for the scans made by the calling thread: scans, yajl_allocs - allocations made by yajl, which are served by
+// the arena of the thread, mallocs - the ones of the arena and of the buffers for matches, which stop once they fit
+static VALUE allocation_counts(VALUE self)
+{
+  scan_scratch_t *scratch = thread_scratch_get();
+  VALUE res = rb_hash_new();
+  rb_hash_aset(res, ID2SYM(rb_intern("scans")), SIZET2NUM(scratch->scans));
+  rb_hash_aset(res, ID2SYM(rb_intern("yajl_allocs")), SIZET2NUM(scratch->yajl_allocs));
+  rb_hash_aset(res, ID2SYM(rb_intern("mallocs")), SIZET2NUM(scratch->mallocs));
+  return res;
+}
+
+static VALUE last_stats_time(uint64_t ns)
+{
+#ifdef HAVE_CLOCK_GETTIME
+  return DBL2NUM((double)ns / 1e9);
+#else
+  return Qnil;
+#endif
+}
+
+// def last_stats
+// Stats of the last scan made by the calling thread with stats: true, nil if there is none. The time the callbacks
+// take is matching, the rest of the parse is lexing, the cost of reading the clock around them is subtracted
+static VALUE last_stats(VALUE self)
+{
+  scan_scratch_t *scratch = thread_scratch_get();
+  scan_stats_t *stats = &scratch->last_stats;
+  VALUE res, tokens;
+  uint64_t clock_ns = stats->callbacks * scan_stats_clock_ns;
+  uint64_t matching_ns = stats->callbacks_ns > clock_ns ? stats->callbacks_ns - clock_ns : 0;
+  uint64_t lexing_ns = stats->parse_ns > stats->callbacks_ns + clock_ns ? stats->parse_ns - stats->callbacks_ns - clock_ns : 0;
+  if (!scratch->has_last_stats)
+    return Qnil;
+  tokens = rb_hash_new();
+  rb_hash_aset(tokens, null_sym, SIZET2NUM(stats->tokens[null_value]));
+  rb_hash_aset(tokens, boolean_sym, SIZET2NUM(stats->tokens[boolean_value]));
+  rb_hash_aset(tokens, number_sym, SIZET2NUM(stats->tokens[number_value]));
+  rb_hash_aset(tokens, string_sym, SIZET2NUM(stats->tokens[string_value]));
+  rb_hash_aset(tokens, ID2SYM(rb_intern("key")), SIZET2NUM(stats->keys));
+  rb_hash_aset(tokens, object_sym, SIZET2NUM(stats->tokens[object_value]));
+  rb_hash_aset(tokens, array_sym, SIZET2NUM(stats->tokens[array_value]));
+  res = rb_hash_new();
+  rb_hash_aset(res, ID2SYM(rb_intern("bytes")), SIZET2NUM(stats->bytes));
+  rb_hash_aset(res, ID2SYM(rb_intern("tokens")), tokens);
+  rb_hash_aset(res, ID2SYM(rb_intern("max_depth")), INT2NUM(stats->max_depth));
+  rb_hash_aset(res, ID2SYM(rb_intern("deep_containers")), SIZET2NUM(stats->deep_containers));
+  rb_hash_aset(res, ID2SYM(rb_intern("skipped_containers")), SIZET2NUM(stats->skipped_containers));
+  rb_hash_aset(res, ID2SYM(rb_intern("comparisons")), SIZET2NUM(stats->comparisons));
+  rb_hash_aset(res, ID2SYM(rb_intern("points")), SIZET2NUM(stats->points));
+  rb_hash_aset(res, ID2SYM(rb_intern("ruby_objects")), SIZET2NUM(stats->ruby_objects));
+  rb_hash_aset(res, ID2SYM(rb_intern("lexing_time")), last_stats_time(lexing_ns));
+  rb_hash_aset(res, ID2SYM(rb_intern("matching_time")), last_stats_time(matching_ns));
+  rb_hash_aset(res, ID2SYM(rb_intern("results_time")), last_stats_time(stats->results_ns));
+  return res;
+}
+
+// def aggregate_paths(json_str, path_arr, aggregates, opts)
+// Backs JsonScanner.aggregate: aggregates is an array of :count, :sum, :min, :max and :key_histogram,
+// returns a Hash of them by path, the opts of scan except with_path, with_roots_info, format, values and threads
+static VALUE aggregate_paths(VALUE self, VALUE json_str, VALUE path_ary, VALUE aggregates, VALUE rb_options)
+{
+  scan_options options;
+  VALUE result;
+  int aggregate = 0;
+  rb_check_type(json_str, T_STRING);
+  rb_check_type(aggregates, T_ARRAY);
+  for (long i = 0; i < RARRAY_LEN(aggregates); i++)
+  {
+    VALUE name = rb_ary_entry(aggregates, i);
+    if (name == count_sym)
+      aggregate |= AGGREGATE_COUNT;
+    else if (name == sum_sym)
+      aggregate |= AGGREGATE_SUM;
+    else if (name == min_sym)
+      aggregate |= AGGREGATE_MIN;
+    else if (name == max_sym)
+      aggregate |= AGGREGATE_MAX;
+    else if (name == key_histogram_sym)
+      aggregate |= AGGREGATE_KEY_HISTOGRAM;
+    else
+      rb_raise(rb_eArgError, "unknown aggregate: %" PRIsVALUE, rb_inspect(name));
+  }
+  if (!aggregate)
+    rb_raise(rb_eArgError, "no aggregates");
+  scan_options_get(&options, rb_options);
+  // keys outlive the callbacks only with with_path
+  SCAN_OPTION_SET(&options, with_path, (aggregate & AGGREGATE_KEY_HISTOGRAM) != 0);
+  SCAN_OPTION_SET(&options, with_roots_info, false);
+  SCAN_OPTION_SET(&options, values, false);
+  SCAN_OPTION_SET(&options, format, false);
+  options.aggregate = aggregate;
+  result = scan_string(json_str, path_ary, &options);
+  return SCAN_OPTION(&options, stop_early) ? rb_ary_entry(result, 0) : result;
+}
+
+// scan_many keeps the matches of every document natively until all the workers are done
+typedef struct
+{
+  saved_point_t *points;
+  size_t points_len;
+  saved_path_elem_t *path;
+  size_t path_len;
+  char *keys;
+  size_t keys_len;
+  saved_root_t *roots;
+  size_t roots_len;
+  yajl_status stat;
+  size_t bytes_consumed;
+  // malloc'ed copy of the yajl error message
+  char *error;
+  int done;
+} scan_many_result;
+
+typedef struct
+{
+  scan_options *options;
+  const char **texts;
+  size_t *text_lens;
+  scan_many_result *results;
+  long len;
+  // the next document to scan
+  long next;
+  scan_ctx *selector;
+  // every worker has its own copy of the selector, ctxs[0] converts the results
+  scan_ctx **ctxs;
+  int ctxs_len;
+  int workers;
+  volatile int interrupted;
+  int nomem;
+#ifdef HAVE_PTHREAD_CREATE
+  pthread_mutex_t lock;
+  int lock_initialized;
+#endif
+} scan_many_pool;
+
+typedef struct
+{
+  scan_many_pool *pool;
+  int worker;
+} scan_many_worker_args;
+
+static long scan_many_next(scan_many_pool *pool)
+{
+  long i;
+#ifdef HAVE_PTHREAD_CREATE
+  if (pool->workers > 1)
+    pthread_mutex_lock(&pool->lock);
+#endif
+  i = pool->next < pool->len ? pool->next++ : -1;
+#ifdef HAVE_PTHREAD_CREATE
+  if (pool->workers > 1)
+    pthread_mutex_unlock(&pool->lock);
+#endif
+  return i;
+}
+
+static void *scan_many_copy(const void *src, size_t len, size_t size, int *nomem)
+{
+  void *res;
+  if (len == 0)
+    return NULL;
+  res = malloc(len * size);
+  if (res == NULL)
+  {
+    *nomem = true;
+    return NULL;
+  }
+  memcpy(res, src, len * size);
+  return res;
+}
+
+// Doesn't need the GVL, moves the matches of the scanned document out of the worker's ctx
+static int scan_many_save(scan_many_pool *pool, scan_ctx *ctx, scan_text_args *args, scan_many_result *result)
+{
+  int nomem = false;
+  if (args->stat != yajl_status_ok && args->stat != yajl_status_client_canceled)
+  {
+    const char *msg = (const char *)yajl_get_error(ctx->handle, SCAN_OPTION(pool->options, verbose_error),
+                                                   args->error_text, args->error_text_len);
+    result->bytes_consumed = scan_ctx_get_bytes_consumed(ctx);
+    result->error = scan_many_copy(msg, strlen(msg) + 1, sizeof(char), &nomem);
+    yajl_free_error(ctx->handle, (unsigned char *)msg);
+  }
+  else
+  {
+    result->bytes_consumed = args->bytes_consumed;
+    result->points = scan_many_copy(ctx->saved_points, ctx->saved_points_len, sizeof(saved_point_t), &nomem);
+    result->points_len = ctx->saved_points_len;
+    result->path = scan_many_copy(ctx->saved_path, ctx->saved_path_len, sizeof(saved_path_elem_t), &nomem);
+    result->path_len = ctx->saved_path_len;
+    result->keys = scan_many_copy(ctx->saved_keys, ctx->saved_keys_len, sizeof(char), &nomem);
+    result->keys_len = ctx->saved_keys_len;
+    result->roots = scan_many_copy(ctx->saved_roots, ctx->saved_roots_len, sizeof(saved_root_t), &nomem);
+    result->roots_len = ctx->saved_roots_len;
+  }
+  result->stat = args->stat;
+  result->done = !nomem;
+  return !nomem;
+}
+
+// Doesn't need the GVL, scans documents until there are none left
+static void *scan_many_work(void *data)
+{
+  scan_many_worker_args *worker_args = (scan_many_worker_args *)data;
+  scan_many_pool *pool = worker_args->pool;
+  scan_ctx *ctx = pool->ctxs[worker_args->worker];
+  scan_text_args args;
+  long i;
+  args.options = pool->options;
+  args.ctx = ctx;
+  args.index = NULL;
+  while (!pool->interrupted && !pool->nomem && (i = scan_many_next(pool)) >= 0)
+  {
+    if (pool->results[i].done)
+      continue;
+    // Qnil stands for the lists, the matches are converted by scan_many_results
+    scan_ctx_reset_with_options(ctx, Qnil, SCAN_OPTION(pool->options, with_roots_info) ? Qnil : Qundef, pool->options);
+    args.json_text = pool->texts[i];
+    args.json_text_len = pool->text_lens[i];
+    scan_text_parse(&args);
+    if (scan_ctx_aborted(ctx) || !scan_many_save(pool, ctx, &args, &pool->results[i]))
+      pool->nomem = pool->nomem || !ctx->interrupted;
+    if (ctx->handle)
+      scan_ctx_free_handle(ctx);
+    ctx->saved_points_len = 0;
+    ctx->saved_path_len = 0;
+    ctx->saved_keys_len = 0;
+    ctx->saved_roots_len = 0;
+  }
+  return NULL;
+}
+
+// Doesn't need the GVL, the calling thread is the first worker
+static void *scan_many_parse(void *data)
+{
+  scan_many_pool *pool = (scan_many_pool *)data;
+  scan_many_worker_args worker_args = {pool, 0};
+#ifdef HAVE_PTHREAD_CREATE
+  scan_many_worker_args *args = malloc(sizeof(scan_many_worker_args) * pool->workers);
+  pthread_t *threads = malloc(sizeof(pthread_t) * pool->workers);
+  int started = 0;
+  if (pool->workers > 1 && args && threads)
+  {
+    sigset_t mask, old_mask;
+    // Signals are for Ruby threads
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    for (int w = 1; w < pool->workers; w++)
+    {
+      args[w].pool = pool;
+      args[w].worker = w;
+      // the rest of the workers pick up the documents if a thread can't be started
+      if (pthread_create(&threads[started], NULL, scan_many_work, &args[w]) != 0)
+        break;
+      started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  }
+  scan_many_work(&worker_args);
+  for (int t = 0; t < started; t++)
+    pthread_join(threads[t], NULL);
+  free(args);
+  free(threads);
+#else
+  scan_many_work(&worker_args);
+#endif
+  return NULL;
+}
+
+static void scan_many_unblock(void *data)
+{
+  scan_many_pool *pool = (scan_many_pool *)data;
+  pool->interrupted = true;
+  for (int w = 0; w < pool->ctxs_len; w++)
+    pool->ctxs[w]->interrupted = true;
+}
+
+static VALUE scan_many_save_results(VALUE data)
+{
+  scan_ctx_save_results((scan_ctx *)data);
+  return Qnil;
+}
+
+// Converts the matches of a document and appends them to the lists, needs the GVL
+static void scan_many_result_save(scan_many_pool *pool, scan_many_result *result, VALUE points_list,
+                                  VALUE roots_info_list)
+{
+  scan_ctx *ctx = pool->ctxs[0];
+  saved_point_t *points = ctx->saved_points;
+  saved_path_elem_t *path = ctx->saved_path;
+  char *keys = ctx->saved_keys;
+  saved_root_t *roots = ctx->saved_roots;
+  int state;
+  scan_ctx_reset_with_options(ctx, points_list, roots_info_list, pool->options);
+  // scan_ctx_save_results reads the buffers of the ctx, JSON.parse can raise for JsonScanner.parse
+  ctx->saved_points = result->points;
+  ctx->saved_points_len = result->points_len;
+  ctx->saved_path = result->path;
+  ctx->saved_path_len = result->path_len;
+  ctx->saved_keys = result->keys;
+  ctx->saved_keys_len = result->keys_len;
+  ctx->saved_roots = result->roots;
+  ctx->saved_roots_len = result->roots_len;
+  rb_protect(scan_many_save_results, (VALUE)ctx, &state);
+  ctx->saved_points = points;
+  ctx->saved_path = path;
+  ctx->saved_keys = keys;
+  ctx->saved_roots = roots;
+  if (state)
+    rb_jump_tag(state);
+}
+
+static VALUE scan_many_result_new(scan_many_pool *pool, scan_many_result *result)
+{
+  VALUE points_list, roots_info_list = Qundef;
+  if (result->error)
+    return scan_parse_error_new(result->error, result->bytes_consumed);
+  points_list = scan_points_list_new(pool->ctxs[0]->paths_len, pool->options);
+  if (SCAN_OPTION(pool->options, with_roots_info))
+    roots_info_list = rb_ary_new();
+  scan_many_result_save(pool, result, points_list, roots_info_list);
+  return scan_result_new(points_list, roots_info_list, pool->options, result->bytes_consumed);
+}
+
+static VALUE scan_many_release(VALUE data)
+{
+  scan_many_pool *pool = (scan_many_pool *)data;
+  for (long i = 0; pool->results && i < pool->len; i++)
+  {
+    free(pool->results[i].points);
+    free(pool->results[i].path);
+    free(pool->results[i].keys);
+    free(pool->results[i].roots);
+    free(pool->results[i].error);
+  }
+  for (int w = 0; w < pool->ctxs_len; w++)
+  {
+    scan_ctx_return_scratch(pool->ctxs[w]);
+    scan_ctx_free(pool->ctxs[w]);
+    ruby_xfree(pool->ctxs[w]);
+  }
+#ifdef HAVE_PTHREAD_CREATE
+  if (pool->lock_initialized)
+    pthread_mutex_destroy(&pool->lock);
+#endif
+  ruby_xfree(pool->ctxs);
+  ruby_xfree(pool->results);
+  ruby_xfree(pool->texts);
+  ruby_xfree(pool->text_lens);
+  return Qnil;
+}
+
+static int scan_many_default_threads(void)
+{
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > 0)
+    return cpus > INT_MAX ? INT_MAX : (int)cpus;
+#endif
+  return 1;
+}
+
+// Scans all the documents, results are kept natively
+static void scan_many_scan(scan_many_pool *pool)
+{
+  size_t total_len = 0;
+  pool->ctxs = ruby_xcalloc(pool->workers, sizeof(scan_ctx *));
+  for (int w = 0; w < pool->workers; w++)
+  {
+    pool->ctxs[w] = ruby_xmalloc(sizeof(scan_ctx));
+    scan_ctx_init_shared(pool->ctxs[w], pool->selector);
+    pool->ctxs_len++;
+    scan_ctx_take_scratch(pool->ctxs[w]);
+  }
+  pool->results = ruby_xcalloc(pool->len, sizeof(scan_many_result));
+#ifdef HAVE_PTHREAD_CREATE
+  if (pool->workers > 1)
+  {
+    if (pthread_mutex_init(&pool->lock, NULL) != 0)
+      rb_sys_fail("pthread_mutex_init");
+    pool->lock_initialized = true;
+  }
+#endif
+  for (long i = 0; i < pool->len; i++)
+    total_len += pool->text_lens[i];
+  if (pool->workers > 1 || total_len >= SCAN_NOGVL_MIN_LEN)
+    rb_thread_call_without_gvl(scan_many_parse, pool, scan_many_unblock, pool);
+  else
+    scan_many_parse(pool);
+  if (pool->nomem)
+    rb_memerror();
+  if (pool->interrupted)
+  {
+    // Interrupted and handled without an exception, the rest is scanned holding the GVL
+    pool->interrupted = false;
+    for (int w = 0; w < pool->ctxs_len; w++)
+      pool->ctxs[w]->interrupted = false;
+    pool->workers = 1;
+    pool->next = 0;
+    scan_many_parse(pool);
+    if (pool->nomem)
+      rb_memerror();
+  }
+}
+
+static VALUE scan_many_run(VALUE data)
+{
+  scan_many_pool *pool = (scan_many_pool *)data;
+  VALUE result;
+  scan_many_scan(pool);
+  result = rb_ary_new_capa(pool->len);
+  for (long i = 0; i < pool->len; i++)
+    rb_ary_push(result, scan_many_result_new(pool, &pool->results[i]));
+  return result;
+}
+
+// Values separated by newlines can be scanned in parallel: a raw newline can't be inside a string, and a shard
+// which ends inside of a value fails with a premature EOF, so the text is scanned as usual then
+static int scan_ndjson_supported(scan_options *options, size_t json_text_len)
+{
+  return options->threads > 1 && !options->aggregate && !SCAN_OPTION(options, stats) &&
+         NIL_P(options->resume_from) && SCAN_OPTION(options, allow_multiple_values) &&
+         !SCAN_OPTION(options, allow_comments) && !SCAN_OPTION(options, allow_partial_values) &&
+         !SCAN_OPTION(options, allow_trailing_garbage) && json_text_len >= 2 * SCAN_NOGVL_MIN_LEN;
+}
+
+static VALUE scan_ndjson_run(VALUE data)
+{
+  scan_many_pool *pool = (scan_many_pool *)data;
+  size_t offset = 0;
+  VALUE points_list, roots_info_list = Qundef;
+  scan_many_scan(pool);
+  for (long i = 0; i < pool->len; i++)
+  {
+    if (pool->results[i].stat != yajl_status_ok)
+      return Qundef;
+  }
+  points_list = scan_points_list_new(pool->ctxs[0]->paths_len, pool->options);
+  if (SCAN_OPTION(pool->options, with_roots_info))
+    roots_info_list = rb_ary_new();
+  for (long i = 0; i < pool->len; i++)
+  {
+    scan_many_result *result = &pool->results[i];
+    for (size_t j = 0; j < result->points_len; j++)
+    {
+      result->points[j].begin += offset;
+      result->points[j].end += offset;
+    }
+    for (size_t j = 0; j < result->roots_len; j++)
+      result->roots[j].begin += offset;
+    scan_many_result_save(pool, result, points_list, roots_info_list);
+    offset += pool->text_lens[i];
+  }
+  return scan_result_new(points_list, roots_info_list, pool->options, offset);
+}
+
+// Splits the text at newlines into opts[:threads] shards of about the same size and scans them with scan_many workers,
+// returns Qundef if a shard fails to parse
+static VALUE scan_ndjson(scan_ctx *ctx, scan_text_args *args)
+{
+  scan_many_pool pool;
+  size_t pos = 0, shard_len;
+  int shards = args->options->threads;
+  if ((size_t)shards > args->json_text_len / SCAN_NOGVL_MIN_LEN)
+    shards = (int)(args->json_text_len / SCAN_NOGVL_MIN_LEN);
+  shard_len = args->json_text_len / shards;
+  memset(&pool, 0, sizeof(pool));
+  pool.options = args->options;
+  pool.selector = ctx;
+  pool.texts = ruby_xmalloc2(shards, sizeof(const char *));
+  pool.text_lens = ruby_xmalloc2(shards, sizeof(size_t));
+  while (pos < args->json_text_len)
+  {
+    size_t end = args->json_text_len;
+    if (pool.len < shards - 1 && pos + shard_len < args->json_text_len)
+    {
+      const char *newline = memchr(args->json_text + pos + shard_len, '\n', args->json_text_len - pos - shard_len);
+      if (newline)
+      {
+        size_t next = end = newline - args->json_text + 1;
+        // yajl doesn't accept a text with no values
+        while (next < args->json_text_len && isspace((unsigned char)args->json_text[next]))
+          next++;
+        if (next == args->json_text_len)
+          end = next;
+      }
+    }
+    pool.texts[pool.len] = args->json_text + pos;
+    pool.text_lens[pool.len] = end - pos;
+    pool.len++;
+    pos = end;
+  }
+  pool.workers = (int)pool.len;
+  return rb_ensure(scan_ndjson_run, (VALUE)&pool, scan_many_release, (VALUE)&pool);
+}
+
+// def scan_many(json_strs, path_arr, opts)
+// scans each string like scan does using up to opts[:threads] native threads (the number of CPUs by default),
+// returns the results in the same order, a JsonScanner::ParseError in place of the result of an invalid document
+static VALUE scan_many(int argc, VALUE *argv, VALUE self)
+{
+  VALUE json_strs, path_ary, rb_options, strs, result;
+  scan_options options;
+  scan_many_pool pool;
+  rb_scan_args(argc, argv, "21", &json_strs, &path_ary, &rb_options);
+  rb_check_type(json_strs, T_ARRAY);
+  scan_options_get(&options, rb_options);
+  if (options.resume_from != Qnil)
+    rb_raise(rb_eArgError, "resume_from can't be used with scan_many");
+  if (!rb_obj_is_kind_of(path_ary, rb_cJsonScannerSelector))
+    path_ary = rb_class_new_instance(1, &path_ary, rb_cJsonScannerSelector);
+  memset(&pool, 0, sizeof(pool));
+  TypedData_Get_Struct(path_ary, scan_ctx, &selector_type, pool.selector);
+  // The documents are scanned without the GVL, frozen strings can't be changed by other threads meanwhile
+  strs = rb_ary_new_capa(RARRAY_LEN(json_strs));
+  for (long i = 0; i < RARRAY_LEN(json_strs); i++)
+  {
+    VALUE json_str = rb_ary_entry(json_strs, i);
+    rb_check_type(json_str, T_STRING);
+    rb_ary_push(strs, rb_str_new_frozen(json_str));
+  }
+  pool.options = &options;
+  pool.len = RARRAY_LEN(strs);
+  pool.texts = ruby_xmalloc2(pool.len ? pool.len : 1, sizeof(const char *));
+  pool.text_lens = ruby_xmalloc2(pool.len ? pool.len : 1, sizeof(size_t));
+  for (long i = 0; i < pool.len; i++)
+  {
+    pool.texts[i] = RSTRING_PTR(RARRAY_AREF(strs, i));
+    pool.text_lens[i] = (size_t)RSTRING_LEN(RARRAY_AREF(strs, i));
+  }
+  pool.workers = options.threads ? options.threads : scan_many_default_threads();
+  if (pool.workers > pool.len)
+    pool.workers = pool.len > 0 ? (int)pool.len : 1;
+  result = rb_ensure(scan_many_run, (VALUE)&pool, scan_many_release, (VALUE)&pool);
+  RB_GC_GUARD(strs);
+  RB_GC_GUARD(path_ary);
+  return result;
 }
 
-static VALUE selector_m_length(VALUE self)
+typedef struct
 {
-  scan_ctx *ctx;
-  TypedData_Get_Struct(self, scan_ctx, &selector_type, ctx);
-  return INT2FIX(ctx->paths_len);
+  scan_text_args args;
+  char *buf;
+  size_t buf_len;
+} scan_file_args;
+
+static VALUE scan_file_release(VALUE data)
+{
+  scan_file_args *file_args = (scan_file_args *)data;
+  scan_text_release((VALUE)&file_args->args);
+#ifdef HAVE_MMAP
+  munmap(file_args->buf, file_args->buf_len);
+#endif
+  return Qnil;
 }
 
-static size_t options_size(const void *data)
+// def scan_file(file_path, path_arr, opts)
+// the same as scan, but reads the file itself; regular files are mapped into memory if possible,
+// so they don't have to fit into a Ruby string
+static VALUE scan_file(int argc, VALUE *argv, VALUE self)
 {
-  return sizeof(scan_options);
+  VALUE file_path, path_ary, rb_options;
+  scan_options options;
+  rb_scan_args(argc, argv, "21", &file_path, &path_ary, &rb_options);
+  FilePathValue(file_path);
+  scan_options_get(&options, rb_options);
+#ifdef HAVE_MMAP
+  {
+    scan_file_args file_args;
+    struct stat st;
+    void *addr;
+    int fd, err;
+    // Opening a FIFO blocks until there is a writer, which may be a thread waiting for the GVL
+    fd = rb_cloexec_open(StringValueCStr(file_path), O_RDONLY | O_NONBLOCK, 0);
+    if (fd < 0)
+      rb_sys_fail_str(file_path);
+    if (fstat(fd, &st) < 0)
+      goto fail;
+    if (!S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+      close(fd);
+      goto read_io;
+    }
+    if ((unsigned long long)st.st_size > SIZE_MAX)
+    {
+      errno = EFBIG;
+      goto fail;
+    }
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+      goto fail;
+    close(fd);
+#ifdef HAVE_MADVISE
+    // Each page is read once, let the kernel read ahead and drop pages behind
+    madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    file_args.buf = addr;
+    file_args.buf_len = (size_t)st.st_size;
+    file_args.args.path_ary = path_ary;
+    file_args.args.options = &options;
+    file_args.args.json_text = file_args.buf;
+    file_args.args.json_text_len = file_args.buf_len;
+    file_args.args.ctx = NULL;
+    file_args.args.index = NULL;
+    return rb_ensure(scan_text, (VALUE)&file_args.args, scan_file_release, (VALUE)&file_args);
+
+  fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    rb_sys_fail_str(file_path);
+  }
+read_io:
+#endif
+  // Pipes, devices and systems without mmap: Ruby IO waits for the data without the GVL and handles interrupts
+  return scan_string(rb_funcall(rb_cFile, rb_intern("binread"), 1, file_path), path_ary, &options);
 }
 
-static const rb_data_type_t options_type = {
-    .wrap_struct_name = "json_scanner_options",
-    .function = {
-        .dfree = RUBY_DEFAULT_FREE,
-        .dsize = options_size,
-    },
-    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
-};
+typedef struct
+{
+  scan_ctx ctx;
+  scan_options options;
+  // Selector or an array of the key strings
+  VALUE paths_owner;
+  int stopped;
+  int finished;
+} stream_ctx;
 
-static VALUE options_alloc(VALUE self)
+static void stream_mark(void *data)
 {
-  // NOT INITIALIZED
-  scan_options *options;
-  return TypedData_Make_Struct(self, scan_options, &options_type, options);
+  stream_ctx *stream = (stream_ctx *)data;
+  // C struct holds these, so they must not move
+  rb_gc_mark(stream->paths_owner);
+  rb_gc_mark(stream->ctx.points_list);
+  rb_gc_mark(stream->ctx.roots_info_list);
 }
 
-static VALUE options_m_initialize(int argc, VALUE *argv, VALUE self)
+static void stream_free(void *data)
 {
-  VALUE kwargs;
-  scan_options *options;
-  TypedData_Get_Struct(self, scan_options, &options_type, options);
-#if RUBY_API_VERSION_MAJOR > 2 || (RUBY_API_VERSION_MAJOR == 2 && RUBY_API_VERSION_MINOR >= 7)
-  rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "0:", &kwargs);
-#else
-  rb_scan_args(argc, argv, "0:", &kwargs);
-#endif
-  scan_options_init(options, kwargs);
-  return self;
+  stream_ctx *stream = (stream_ctx *)data;
+  if (stream->ctx.handle)
+    yajl_free(stream->ctx.handle);
+  scan_ctx_free(&stream->ctx);
+  ruby_xfree(stream);
 }
 
-static VALUE options_m_inspect(VALUE self)
+static size_t stream_size(const void *data)
 {
-  VALUE res;
-  scan_options *options;
-  TypedData_Get_Struct(self, scan_options, &options_type, options);
-  res = rb_sprintf("#<%" PRIsVALUE " {", rb_class_name(CLASS_OF(self)));
-  if (SCAN_OPTION_IS_SET(options, with_path))
-    rb_str_catf(res, "with_path: %s, ", SCAN_OPTION(options, with_path) ? "true" : "false");
-  if (SCAN_OPTION_IS_SET(options, verbose_error))
-    rb_str_catf(res, "verbose_error: %s, ", SCAN_OPTION(options, verbose_error) ? "true" : "false");
-  if (SCAN_OPTION_IS_SET(options, allow_comments))
-    rb_str_catf(res, "allow_comments: %s, ", SCAN_OPTION(options, allow_comments) ? "true" : "false");
-  if (SCAN_OPTION_IS_SET(options, dont_validate_strings))
-    rb_str_catf(res, "dont_validate_strings: %s, ", SCAN_OPTION(options, dont_validate_strings) ? "true" : "false");
-  if (SCAN_OPTION_IS_SET(options, allow_trailing_garbage))
-    rb_str_catf(res, "allow_trailing_garbage: %s, ", SCAN_OPTION(options, allow_trailing_garbage) ? "true" : "false");
-  if (SCAN_OPTION_IS_SET(options, allow_multiple_values))
-    rb_str_catf(res, "allow_multiple_values: %s, ", SCAN_OPTION(options, allow_multiple_values) ? "true" : "false");
-  if (SCAN_OPTION_IS_SET(options, allow_partial_values))
-    rb_str_catf(res, "allow_partial_values: %s, ", SCAN_OPTION(options, allow_partial_values) ? "true" : "false");
-  if (SCAN_OPTION_IS_SET(options, symbolize_path_keys))
-    rb_str_catf(res, "symbolize_path_keys: %s, ", SCAN_OPTION(options, symbolize_path_keys) ? "true" : "false");
-  if (SCAN_OPTION_IS_SET(options, with_roots_info))
-    rb_str_catf(res, "with_roots_info: %s, ", SCAN_OPTION(options, with_roots_info) ? "true" : "false");
-  if (RSTRING_END(res)[-1] == ' ')
-    rb_str_resize(res, RSTRING_LEN(res) - 2);
-  rb_str_buf_cat_ascii(res, "}>");
-  return res;
+  stream_ctx *stream = (stream_ctx *)data;
+  // yajl buffers are not counted
+  return sizeof(stream_ctx) - sizeof(scan_ctx) + selector_size(&stream->ctx);
 }
 
-static yajl_callbacks scan_callbacks = {
-    scan_on_null,
-    scan_on_boolean,
-    NULL,
-    NULL,
-    scan_on_number,
-    scan_on_string,
-    scan_on_start_object,
-    scan_on_key,
-    scan_on_end_object,
-    scan_on_start_array,
-    scan_on_end_array};
+static const rb_data_type_t stream_type = {
+    .wrap_struct_name = "json_scanner_stream_scanner",
+    .function = {
+        .dmark = stream_mark,
+        .dfree = stream_free,
+        .dsize = stream_size,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
 
-// def scan(json_str, path_arr, opts)
-// opts
-// with_path: false, verbose_error: false, symbolize_path_keys: false, with_roots_info: false
-// the following opts converted to bool and passed to yajl_config if provided, ignored if not provided
-// allow_comments, dont_validate_strings, allow_trailing_garbage, allow_multiple_values, allow_partial_values
-static VALUE scan(int argc, VALUE *argv, VALUE self)
+static VALUE stream_alloc(VALUE self)
 {
-  VALUE json_str, path_ary, rb_options;
-  scan_options options;
+  stream_ctx *stream = ruby_xmalloc(sizeof(stream_ctx));
+  stream->ctx.paths = NULL;
+  stream->ctx.paths_len = 0;
+  stream->ctx.max_path_len = 0;
+  stream->ctx.nodes = NULL;
+  stream->ctx.nodes_len = 0;
+  stream->ctx.shared = false;
+  scan_ctx_init_state(&stream->ctx);
+  scan_ctx_init_saved(&stream->ctx);
+  stream->ctx.interrupted = false;
+  scan_ctx_reset(&stream->ctx, Qundef, Qundef, false, false, false);
+  stream->paths_owner = Qnil;
+  stream->stopped = false;
+  stream->finished = false;
+  return TypedData_Wrap_Struct(self, &stream_type, stream);
+}
 
-  char *json_text;
-  size_t json_text_len;
-  yajl_handle handle;
-  yajl_status stat;
-  scan_ctx *ctx;
-  int free_ctx = true;
-  VALUE err_msg = Qnil, bytes_consumed = Qnil, result, roots_info_result = Qundef;
-  // Turned out callbacks can't raise exceptions
-  // VALUE callback_err;
-  rb_scan_args(argc, argv, "21", &json_str, &path_ary, &rb_options);
-  rb_check_type(json_str, T_STRING);
-  // rb_io_write(rb_stderr, rb_sprintf("with_path_flag: %" PRIsVALUE " \n", with_path_flag));
-  switch (TYPE(rb_options))
-  {
-  case T_HASH:
-  case T_NIL:
-    scan_options_init(&options, rb_options);
-    break;
-  case T_DATA:
-    if (rb_obj_is_kind_of(rb_options, rb_cJsonScannerOptions))
-    {
-      scan_options *ptr;
-      TypedData_Get_Struct(rb_options, scan_options, &options_type, ptr);
-      options = *ptr;
-    }
-    else
-    {
-      rb_raise(rb_eTypeError, "Expected a Hash or %" PRIsVALUE ", got %" PRIsVALUE, rb_cJsonScannerOptions, rb_obj_class(rb_options));
-    }
-    break;
-  default:
-    rb_raise(rb_eTypeError, "Expected a Hash or %" PRIsVALUE ", got %" PRIsVALUE, rb_cJsonScannerOptions, rb_obj_class(rb_options));
-    break;
-  }
-  if (SCAN_OPTION(&options, with_roots_info))
-    roots_info_result = rb_ary_new();
-  json_text = RSTRING_PTR(json_str);
-#if LONG_MAX > SIZE_MAX
-  json_text_len = RSTRING_LENINT(json_str);
-#else
-  json_text_len = RSTRING_LEN(json_str);
-#endif
+// def initialize(path_ary_or_selector, opts = nil)
+// the same opts as for scan
+static VALUE stream_m_initialize(int argc, VALUE *argv, VALUE self)
+{
+  VALUE path_ary, rb_options;
+  stream_ctx *stream;
+  TypedData_Get_Struct(self, stream_ctx, &stream_type, stream);
+  rb_scan_args(argc, argv, "11", &path_ary, &rb_options);
+  if (stream->ctx.handle)
+    rb_raise(rb_eRuntimeError, "already initialized");
+  scan_options_get(&stream->options, rb_options);
   if (rb_obj_is_kind_of(path_ary, rb_cJsonScannerSelector))
   {
-    free_ctx = false;
-    TypedData_Get_Struct(path_ary, scan_ctx, &selector_type, ctx);
+    scan_ctx *src;
+    TypedData_Get_Struct(path_ary, scan_ctx, &selector_type, src);
+    stream->paths_owner = path_ary;
+    scan_ctx_init_shared(&stream->ctx, src);
   }
   else
   {
     VALUE scan_ctx_init_err;
-    ctx = ruby_xmalloc(sizeof(scan_ctx));
-    scan_ctx_init_err = scan_ctx_init(ctx, path_ary, Qundef);
+    stream->paths_owner = rb_ary_new();
+    scan_ctx_init_err = scan_ctx_init(&stream->ctx, path_ary, stream->paths_owner, Qundef);
     if (scan_ctx_init_err != Qundef)
-    {
-      ruby_xfree(ctx);
       rb_exc_raise(scan_ctx_init_err);
-    }
   }
-  // Need to keep a ref to result array on the stack to prevent it from being GC-ed
-  result = rb_ary_new_capa(ctx->paths_len);
-  for (int i = 0; i < ctx->paths_len; i++)
+  if (!scan_ctx_alloc_state(&stream->ctx))
+    rb_memerror();
+  scan_ctx_reset_with_options(&stream->ctx, scan_points_list_new(stream->ctx.paths_len, &stream->options),
+                              SCAN_OPTION(&stream->options, with_roots_info) ? rb_ary_new() : Qundef, &stream->options);
+  stream->ctx.streaming = true;
+  // containers can span chunks, so they can't be skipped
+  stream->ctx.skip_fast = false;
+  stream->ctx.checkpoints = true;
+  if ((stream->ctx.done_log = malloc(sizeof(int) * (stream->ctx.nodes_len ? stream->ctx.nodes_len : 1))) == NULL)
+    rb_memerror();
+  if (stream->options.resume_from != Qnil)
   {
-    rb_ary_push(result, rb_ary_new());
-  }
-  scan_ctx_reset(ctx, result, roots_info_result, SCAN_OPTION(&options, with_path), SCAN_OPTION(&options, symbolize_path_keys));
-  // scan_ctx_debug(ctx);
-
-  handle = yajl_alloc(&scan_callbacks, NULL, (void *)ctx);
-  if (SCAN_OPTION_IS_SET(&options, allow_comments))
-    yajl_config(handle, yajl_allow_comments, SCAN_OPTION(&options, allow_comments));
-  if (SCAN_OPTION_IS_SET(&options, dont_validate_strings))
-    yajl_config(handle, yajl_dont_validate_strings, SCAN_OPTION(&options, dont_validate_strings));
-  if (SCAN_OPTION_IS_SET(&options, allow_trailing_garbage))
-    yajl_config(handle, yajl_allow_trailing_garbage, SCAN_OPTION(&options, allow_trailing_garbage));
-  if (SCAN_OPTION_IS_SET(&options, allow_multiple_values))
-    yajl_config(handle, yajl_allow_multiple_values, SCAN_OPTION(&options, allow_multiple_values));
-  if (SCAN_OPTION_IS_SET(&options, allow_partial_values))
-    yajl_config(handle, yajl_allow_partial_values, SCAN_OPTION(&options, allow_partial_values));
-  ctx->handle = handle;
-  stat = yajl_parse(handle, (unsigned char *)json_text, json_text_len);
-  if (stat == yajl_status_ok)
+    scan_checkpoint_t cp;
+    VALUE done = scan_checkpoint_get(stream->options.resume_from, &cp);
+    scan_ctx_restore(&stream->ctx, &cp, done);
+  }
+  scan_ctx_alloc_handle(&stream->ctx, &stream->options);
+  if (scan_ctx_resumed_done(&stream->ctx))
+    stream->stopped = true;
+  else if (stream->ctx.resumed)
+    scan_ctx_replay(&stream->ctx, stream->ctx.current_path_len, "null");
+  return self;
+}
+
+static stream_ctx *stream_get(VALUE self)
+{
+  stream_ctx *stream;
+  TypedData_Get_Struct(self, stream_ctx, &stream_type, stream);
+  if (!stream->ctx.handle)
+    rb_raise(rb_eRuntimeError, "not initialized");
+  return stream;
+}
+
+// Returns matches found since the previous call, in the same format as scan does
+static VALUE stream_take_results(stream_ctx *stream)
+{
+  VALUE result = stream->ctx.points_list;
+  stream->ctx.points_list = scan_points_list_new(stream->ctx.paths_len, &stream->options);
+  if (stream->ctx.roots_info_list != Qundef)
   {
-    scan_ctx_save_bytes_consumed(ctx);
-    stat = yajl_complete_parse(handle);
+    result = rb_ary_new_from_args(2, result, stream->ctx.roots_info_list);
+    stream->ctx.roots_info_list = rb_ary_new();
   }
+  return result;
+}
 
-  if (stat != yajl_status_ok)
+static void stream_parse(stream_ctx *stream, VALUE chunk)
+{
+  scan_ctx *ctx = &stream->ctx;
+  yajl_status stat;
+  VALUE err;
+  size_t chunk_len;
+  rb_check_type(chunk, T_STRING);
+  if (stream->finished)
+    rb_raise(rb_eRuntimeError, "stream scanner is already finished");
+  // Nothing else can match, the rest of the input is ignored
+  if (stream->stopped)
+    return;
+  chunk_len = (size_t)RSTRING_LEN(chunk);
+  ctx->chunk = (unsigned char *)RSTRING_PTR(chunk);
+  ctx->chunk_len = chunk_len;
+  stat = yajl_parse(ctx->handle, ctx->chunk, chunk_len);
+  if (ctx->nomem)
+    rb_memerror();
+  scan_ctx_save_results(ctx);
+  switch (stat)
   {
-    char *str = (char *)yajl_get_error(handle, SCAN_OPTION(&options, verbose_error), (unsigned char *)json_text, json_text_len);
-    err_msg = rb_utf8_str_new_cstr(str);
-    bytes_consumed = ULL2NUM(scan_ctx_get_bytes_consumed(ctx));
-    yajl_free_error(handle, (unsigned char *)str);
+  case yajl_status_ok:
+    scan_ctx_save_chunk_quotes(ctx);
+    scan_ctx_save_bytes_consumed(ctx);
+    break;
+  case yajl_status_client_canceled:
+    stream->stopped = true;
+    scan_ctx_save_bytes_consumed(ctx);
+    break;
+  default:
+    err = scan_ctx_parse_error(ctx, SCAN_OPTION(&stream->options, verbose_error), ctx->chunk, chunk_len);
+    ctx->chunk = NULL;
+    RB_GC_GUARD(chunk);
+    rb_exc_raise(err);
   }
-  // // Needed when yajl_allow_partial_values is set
-  // if (ctx->current_path_len > 0)
-  // {
-  //   if (ctx->current_path_len > ctx->max_path_len)
-  //     ctx->current_path_len = ctx->max_path_len;
-  //   for (int i = ctx->current_path_len - 1; i > 0; i--)
-  //   {
-  //     switch (ctx->current_path[i].type)
-  //     {
-  //     case PATH_KEY:
-  //       scan_on_end_object(ctx);
-  //       break;
-  //     case PATH_INDEX:
-  //       scan_on_end_array(ctx);
-  //       break;
-  //     }
-  //   }
-  // }
-  // callback_err = ctx->rb_err;
-  if (free_ctx)
+  ctx->chunk = NULL;
+  RB_GC_GUARD(chunk);
+}
+
+// def feed(chunk)
+static VALUE stream_m_feed(VALUE self, VALUE chunk)
+{
+  stream_ctx *stream = stream_get(self);
+  stream_parse(stream, chunk);
+  return stream_take_results(stream);
+}
+
+// def <<(chunk)
+static VALUE stream_m_push(VALUE self, VALUE chunk)
+{
+  stream_parse(stream_get(self), chunk);
+  return self;
+}
+
+// def finish
+static VALUE stream_m_finish(VALUE self)
+{
+  stream_ctx *stream = stream_get(self);
+  if (!stream->finished && !stream->stopped)
   {
-    // fprintf(stderr, "free_ctx\n");
-    scan_ctx_free(ctx);
-    ruby_xfree(ctx);
+    yajl_status stat = yajl_complete_parse(stream->ctx.handle);
+    if (stream->ctx.nomem)
+      rb_memerror();
+    scan_ctx_save_results(&stream->ctx);
+    if (stat == yajl_status_client_canceled)
+      stream->stopped = true;
+    else if (stat != yajl_status_ok)
+      rb_exc_raise(scan_ctx_parse_error(&stream->ctx, SCAN_OPTION(&stream->options, verbose_error), (unsigned char *)" ", 1));
   }
-  yajl_free(handle);
-  if (err_msg != Qnil)
+  stream->finished = true;
+  return stream_take_results(stream);
+}
+
+static VALUE stream_m_bytes_consumed(VALUE self)
+{
+  return SIZET2NUM(stream_get(self)->ctx.yajl_bytes_consumed);
+}
+
+// def checkpoint
+// The state at the end of the last top-level value or element of a top-level array fed, for resume_from
+static VALUE stream_m_checkpoint(VALUE self)
+{
+  scan_ctx *ctx = &stream_get(self)->ctx;
+  scan_checkpoint_t *cp = &ctx->checkpoint;
+  VALUE res = rb_hash_new(), done = rb_ary_new_capa(cp->done_len);
+  for (int i = 0; i < cp->done_len; i++)
+    rb_ary_push(done, INT2NUM(ctx->done_log[i]));
+  rb_hash_aset(res, ID2SYM(rb_intern("offset")), SIZET2NUM(cp->offset));
+  rb_hash_aset(res, ID2SYM(rb_intern("path")), cp->depth == 1 ? rb_ary_new_from_args(1, LONG2NUM(cp->index)) : rb_ary_new());
+  rb_hash_aset(res, ID2SYM(rb_intern("starts")), cp->depth == 1 ? rb_ary_new_from_args(1, SIZET2NUM(cp->start)) : rb_ary_new());
+  rb_hash_aset(res, ID2SYM(rb_intern("roots")), SIZET2NUM(cp->roots));
+  rb_hash_aset(res, ID2SYM(rb_intern("done_nodes")), done);
+  return res;
+}
+
+static VALUE stream_m_finished_p(VALUE self)
+{
+  stream_ctx *stream = stream_get(self);
+  return stream->finished || stream->stopped ? Qtrue : Qfalse;
+}
+
+static void index_mark(void *data)
+{
+  json_index_t *index = (json_index_t *)data;
+  // C struct holds it, so it must not move
+  rb_gc_mark(index->json_str);
+}
+
+static void index_free(void *data)
+{
+  json_index_t *index = (json_index_t *)data;
+  free(index->nodes);
+  ruby_xfree(index);
+}
+
+static size_t index_size(const void *data)
+{
+  // the text is counted by its string
+  const json_index_t *index = (const json_index_t *)data;
+  return sizeof(json_index_t) + index->nodes_cap * sizeof(index_node_t);
+}
+
+static const rb_data_type_t index_type = {
+    .wrap_struct_name = "json_scanner_index",
+    .function = {
+        .dmark = index_mark,
+        .dfree = index_free,
+        .dsize = index_size,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | JSON_SCANNER_TYPED_FROZEN_SHAREABLE,
+};
+
+static VALUE index_alloc(VALUE self)
+{
+  json_index_t *index;
+  VALUE obj = TypedData_Make_Struct(self, json_index_t, &index_type, index);
+  index->json_str = Qnil;
+  index->nodes = NULL;
+  index->nodes_len = 0;
+  index->nodes_cap = 0;
+  index->max_depth = INT_MAX;
+  return obj;
+}
+
+typedef struct
+{
+  // only the interrupted and nomem flags are used
+  scan_ctx ctx;
+  json_index_t *index;
+  simd_index_t si;
+  const unsigned char *text;
+  size_t len;
+  int built;
+} index_build_args;
+
+// Doesn't need the GVL
+static void *index_build_nogvl(void *data)
+{
+  index_build_args *args = (index_build_args *)data;
+  args->built = simd_index_build(&args->ctx, &args->si, args->text, args->len) &&
+                index_build_nodes(&args->ctx, args->index, &args->si, args->text, args->len);
+  return NULL;
+}
+
+static void index_build_unblock(void *data)
+{
+  ((index_build_args *)data)->ctx.interrupted = true;
+}
+
+static VALUE index_build_run(VALUE data)
+{
+  index_build_args *args = (index_build_args *)data;
+  for (int restarted = false;; restarted = true)
   {
-    VALUE err = rb_exc_new_str(rb_eJsonScannerParseError, err_msg);
-    rb_ivar_set(err, rb_iv_bytes_consumed, bytes_consumed);
-    rb_exc_raise(err);
+    args->ctx.interrupted = false;
+    // A restarted build keeps the GVL, the same as a restarted scan
+    if (args->len >= SCAN_NOGVL_MIN_LEN && !restarted)
+      rb_thread_call_without_gvl(index_build_nogvl, args, index_build_unblock, args);
+    else
+      index_build_nogvl(args);
+    if (args->built || !args->ctx.interrupted)
+      break;
   }
-  // if (callback_err != Qnil)
-  //   rb_exc_raise(callback_err);
-  if (roots_info_result != Qundef)
+  if (!args->built)
+    rb_memerror();
+  return Qnil;
+}
+
+static VALUE index_build_release(VALUE data)
+{
+  index_build_args *args = (index_build_args *)data;
+  free(args->si.pos);
+  free(args->si.stack);
+  free(args->si.key_buf);
+  return Qnil;
+}
+
+// def build_index(json_str, max_depth, opts)
+// Backs JsonScanner::Index.build, the text is validated by a scan without paths, which raises the same errors
+// JsonScanner.scan does, then the structural index of the simd engine is turned into nodes up to max_depth
+static VALUE index_s_build(VALUE self, VALUE json_str, VALUE max_depth, VALUE rb_options)
+{
+  VALUE obj, no_paths = rb_ary_new();
+  json_index_t *index;
+  scan_options options;
+  index_build_args args;
+  rb_check_type(json_str, T_STRING);
+  if ((size_t)RSTRING_LEN(json_str) > UINT32_MAX)
+    rb_raise(rb_eArgError, "JSON text is too long to be indexed");
+  if (!NIL_P(max_depth) && NUM2INT(max_depth) < 0)
+    rb_raise(rb_eArgError, "max_depth must not be negative");
+  scan_options_get(&options, rb_options);
+  if (SCAN_OPTION(&options, allow_trailing_garbage) && SCAN_OPTION(&options, allow_multiple_values))
+    rb_raise(rb_eArgError, "allow_trailing_garbage can't be used with allow_multiple_values");
+  json_str = rb_str_new_frozen(json_str);
+  scan_string(json_str, no_paths, &options);
+  obj = index_alloc(self);
+  TypedData_Get_Struct(obj, json_index_t, &index_type, index);
+  index->json_str = json_str;
+  if (!NIL_P(max_depth))
+    index->max_depth = NUM2INT(max_depth);
+  index->allow_multiple_values = SCAN_OPTION(&options, allow_multiple_values);
+  index->dont_validate_strings = SCAN_OPTION(&options, dont_validate_strings);
+  memset(&args, 0, sizeof(args));
+  args.index = index;
+  args.text = (const unsigned char *)RSTRING_PTR(json_str);
+  args.len = (size_t)RSTRING_LEN(json_str);
+  rb_ensure(index_build_run, (VALUE)&args, index_build_release, (VALUE)&args);
+  if (index->nodes_len < index->nodes_cap)
   {
-    result = rb_ary_new_from_args(2, result, roots_info_result);
+    void *shrunk = realloc(index->nodes, sizeof(index_node_t) * (index->nodes_len ? index->nodes_len : 1));
+    if (shrunk != NULL)
+    {
+      index->nodes = shrunk;
+      index->nodes_cap = index->nodes_len ? index->nodes_len : 1;
+    }
   }
+  // Scans never change the index, it's shareable between Ractors
+  rb_obj_freeze(obj);
+  RB_GC_GUARD(no_paths);
+  return obj;
+}
+
+// def scan(path_ary, opts = nil)
+// The opts of JsonScanner.scan, the text is neither parsed nor validated again, so the options of yajl are
+// the ones the index was built with; engine, skip_unmatched and threads have no effect
+static VALUE index_m_scan(int argc, VALUE *argv, VALUE self)
+{
+  VALUE path_ary, rb_options, result;
+  json_index_t *index;
+  scan_options options;
+  scan_text_args args;
+  TypedData_Get_Struct(self, json_index_t, &index_type, index);
+  rb_scan_args(argc, argv, "11", &path_ary, &rb_options);
+  if (NIL_P(index->json_str))
+    rb_raise(rb_eRuntimeError, "not initialized");
+  scan_options_get(&options, rb_options);
+  SCAN_OPTION_SET(&options, allow_multiple_values, index->allow_multiple_values);
+  SCAN_OPTION_SET(&options, dont_validate_strings, index->dont_validate_strings);
+  options.threads = 0;
+  if (SCAN_OPTION(&options, stats))
+    rb_raise(rb_eArgError, "stats can't be used with Index#scan");
+  if (options.resume_from != Qnil)
+    rb_raise(rb_eArgError, "resume_from can't be used with Index#scan");
+  args.path_ary = path_ary;
+  args.options = &options;
+  args.json_text = RSTRING_PTR(index->json_str);
+  args.json_text_len = (size_t)RSTRING_LEN(index->json_str);
+  args.ctx = NULL;
+  args.index = index;
+  result = rb_ensure(scan_text, (VALUE)&args, scan_text_release, (VALUE)&args);
+  RB_GC_GUARD(self);
   return result;
 }
 
+static VALUE index_m_inspect(VALUE self)
+{
+  json_index_t *index;
+  VALUE res = rb_str_new_cstr("#<JsonScanner::Index nodes: ");
+  TypedData_Get_Struct(self, json_index_t, &index_type, index);
+  rb_str_catf(res, "%" PRIuSIZE, index->nodes_len);
+  if (index->max_depth != INT_MAX)
+    rb_str_catf(res, ", max_depth: %d", index->max_depth);
+  rb_str_cat_cstr(res, ">");
+  return res;
+}
+
 RUBY_FUNC_EXPORTED void
 Init_json_scanner(void)
 {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  // Selector and Options are frozen, the scratch memory is per thread, Selector.compile caches per Ractor
+  rb_ext_ractor_safe(true);
+#endif
   rb_mJsonScanner = rb_define_module("JsonScanner");
   rb_cJsonScannerSelector = rb_define_class_under(rb_mJsonScanner, "Selector", rb_cObject);
   rb_define_alloc_func(rb_cJsonScannerSelector, selector_alloc);
@@ -1019,17 +6627,89 @@ Init_json_scanner(void)
   rb_define_method(rb_cJsonScannerSelector, "inspect", selector_m_inspect, 0);
   rb_define_method(rb_cJsonScannerSelector, "length", selector_m_length, 0);
   rb_define_alias(rb_cJsonScannerSelector, "size", "length");
+  rb_define_singleton_method(rb_cJsonScannerSelector, "compile", selector_s_compile, 1);
+  rb_define_const(rb_cJsonScannerSelector, "CACHE_SIZE", INT2FIX(SELECTOR_CACHE_SIZE));
+#ifdef HAVE_RUBY_RACTOR_H
+  selector_cache_key = rb_ractor_local_storage_value_newkey();
+#else
+  selector_cache = rb_hash_new();
+  rb_global_variable(&selector_cache);
+#endif
+  rb_cJsonScannerStreamScanner = rb_define_class_under(rb_mJsonScanner, "StreamScanner", rb_cObject);
+  rb_define_alloc_func(rb_cJsonScannerStreamScanner, stream_alloc);
+  rb_define_method(rb_cJsonScannerStreamScanner, "initialize", stream_m_initialize, -1);
+  rb_define_method(rb_cJsonScannerStreamScanner, "feed", stream_m_feed, 1);
+  rb_define_method(rb_cJsonScannerStreamScanner, "<<", stream_m_push, 1);
+  rb_define_method(rb_cJsonScannerStreamScanner, "finish", stream_m_finish, 0);
+  rb_define_method(rb_cJsonScannerStreamScanner, "bytes_consumed", stream_m_bytes_consumed, 0);
+  rb_define_method(rb_cJsonScannerStreamScanner, "finished?", stream_m_finished_p, 0);
+  rb_define_method(rb_cJsonScannerStreamScanner, "checkpoint", stream_m_checkpoint, 0);
+  rb_cJsonScannerIndex = rb_define_class_under(rb_mJsonScanner, "Index", rb_cObject);
+  rb_define_alloc_func(rb_cJsonScannerIndex, index_alloc);
+  rb_define_singleton_method(rb_cJsonScannerIndex, "build_index", index_s_build, 3);
+  rb_define_method(rb_cJsonScannerIndex, "scan", index_m_scan, -1);
+  rb_define_method(rb_cJsonScannerIndex, "inspect", index_m_inspect, 0);
   rb_cJsonScannerOptions = rb_define_class_under(rb_mJsonScanner, "Options", rb_cObject);
   rb_define_alloc_func(rb_cJsonScannerOptions, options_alloc);
   rb_define_method(rb_cJsonScannerOptions, "initialize", options_m_initialize, -1);
   rb_define_method(rb_cJsonScannerOptions, "inspect", options_m_inspect, 0);
-  rb_define_const(rb_mJsonScanner, "ANY_INDEX", rb_range_new(INT2FIX(0), INT2FIX(-1), false));
+  rb_cJsonScannerPackedResult = rb_define_class_under(rb_mJsonScanner, "PackedResult", rb_cObject);
+  rb_include_module(rb_cJsonScannerPackedResult, rb_mEnumerable);
+  rb_define_alloc_func(rb_cJsonScannerPackedResult, packed_result_alloc);
+  rb_define_method(rb_cJsonScannerPackedResult, "initialize", packed_result_m_initialize, 1);
+  rb_define_method(rb_cJsonScannerPackedResult, "data", packed_result_m_data, 0);
+  rb_define_method(rb_cJsonScannerPackedResult, "size", packed_result_m_size, 0);
+  rb_define_alias(rb_cJsonScannerPackedResult, "length", "size");
+  rb_define_method(rb_cJsonScannerPackedResult, "[]", packed_result_m_aref, 1);
+  rb_define_method(rb_cJsonScannerPackedResult, "each", packed_result_m_each, 0);
+  rb_define_method(rb_cJsonScannerPackedResult, "byteslice_for", packed_result_m_byteslice_for, 2);
+  rb_define_method(rb_cJsonScannerPackedResult, "inspect", packed_result_m_inspect, 0);
+  rb_define_const(rb_cJsonScannerPackedResult, "RECORD_SIZE", INT2FIX(PACKED_RECORD_SIZE));
+  any_index_range = rb_range_new(INT2FIX(0), INT2FIX(-1), false);
+  rb_define_const(rb_mJsonScanner, "ANY_INDEX", any_index_range);
   any_key_sym = rb_id2sym(rb_intern("*"));
-  rb_define_const(rb_mJsonScanner, "ANY_KEY", rb_range_new(any_key_sym, any_key_sym, false));
+  fast_sym = rb_id2sym(rb_intern("fast"));
+  yajl_sym = rb_id2sym(rb_intern("yajl"));
+  simd_sym = rb_id2sym(rb_intern("simd"));
+  arrays_sym = rb_id2sym(rb_intern("arrays"));
+  packed_sym = rb_id2sym(rb_intern("packed"));
+  stub_sym = rb_id2sym(rb_intern("stub"));
+  total_allocated_objects_sym = rb_id2sym(rb_intern("total_allocated_objects"));
+  scan_stats_calibrate();
+  quirks_mode_sym = rb_id2sym(rb_intern("quirks_mode"));
+  symbolize_names_sym = rb_id2sym(rb_intern("symbolize_names"));
+  rb_json_parse = rb_intern("parse");
+  any_key_range = rb_range_new(any_key_sym, any_key_sym, false);
+  rb_define_const(rb_mJsonScanner, "ANY_KEY", any_key_range);
+  any_depth_sym = rb_id2sym(rb_intern("**"));
+  any_depth_range = rb_range_new(any_depth_sym, any_depth_sym, false);
+  type_sym = rb_id2sym(rb_intern("type"));
+  eq_sym = rb_id2sym(rb_intern("eq"));
+  in_sym = rb_id2sym(rb_intern("in"));
+  count_sym = rb_id2sym(rb_intern("count"));
+  sum_sym = rb_id2sym(rb_intern("sum"));
+  min_sym = rb_id2sym(rb_intern("min"));
+  max_sym = rb_id2sym(rb_intern("max"));
+  key_histogram_sym = rb_id2sym(rb_intern("key_histogram"));
+  rb_define_const(rb_mJsonScanner, "ANY_DEPTH", any_depth_range);
   rb_eJsonScannerParseError = rb_define_class_under(rb_mJsonScanner, "ParseError", rb_eRuntimeError);
   rb_define_attr(rb_eJsonScannerParseError, BYTES_CONSUMED, true, false);
   rb_iv_bytes_consumed = rb_intern("@" BYTES_CONSUMED);
   rb_define_module_function(rb_mJsonScanner, "scan", scan, -1);
+  rb_define_module_function(rb_mJsonScanner, "scan_file", scan_file, -1);
+  rb_define_module_function(rb_mJsonScanner, "scan_many", scan_many, -1);
+  rb_define_module_function(rb_mJsonScanner, "parse_tree", parse_tree, 3);
+  rb_define_module_function(rb_mJsonScanner, "aggregate_paths", aggregate_paths, 4);
+  rb_define_module_function(rb_mJsonScanner, "allocation_counts", allocation_counts, 0);
+  rb_define_module_function(rb_mJsonScanner, "last_stats", last_stats, 0);
+#ifdef SIMD_AVX2_DISPATCH
+  __builtin_cpu_init();
+  simd_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("pclmul");
+#endif
+#ifdef HAVE_PTHREAD_CREATE
+  if (pthread_key_create(&thread_scratch_key, scan_scratch_free) != 0)
+    rb_sys_fail("pthread_key_create");
+#endif
   null_sym = rb_id2sym(rb_intern("null"));
   boolean_sym = rb_id2sym(rb_intern("boolean"));
   number_sym = rb_id2sym(rb_intern("number"));
@@ -1045,4 +6725,12 @@ Init_json_scanner(void)
   scan_kwargs_table[6] = rb_intern("allow_partial_values");
   scan_kwargs_table[7] = rb_intern("symbolize_path_keys");
   scan_kwargs_table[8] = rb_intern("with_roots_info");
+  scan_kwargs_table[9] = rb_intern("stop_early");
+  scan_kwargs_table[10] = rb_intern("skip_unmatched");
+  scan_kwargs_table[11] = rb_intern("engine");
+  scan_kwargs_table[12] = rb_intern("format");
+  scan_kwargs_table[13] = rb_intern("threads");
+  scan_kwargs_table[14] = rb_intern("values");
+  scan_kwargs_table[15] = rb_intern("stats");
+  scan_kwargs_table[16] = rb_intern("resume_from");
 }
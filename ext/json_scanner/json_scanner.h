@@ -4,10 +4,47 @@
 #include "ruby.h"
 #include "ruby/intern.h"
 #include "ruby/version.h"
+#include "ruby/thread.h"
+#ifdef HAVE_RUBY_RACTOR_H
+#include "ruby/ractor.h"
+#endif
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/stat.h>
+#ifdef HAVE_CLOCK_GETTIME
+#include <time.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD_CREATE
+#include <pthread.h>
+#endif
 #include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
 
+#if defined(__GNUC__) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #define true 1
 #define false 0
 
+// Frozen typed data can be shared between Ractors since Ruby 3.0
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+#define JSON_SCANNER_TYPED_FROZEN_SHAREABLE RUBY_TYPED_FROZEN_SHAREABLE
+#else
+#define JSON_SCANNER_TYPED_FROZEN_SHAREABLE 0
+#endif
+
 #endif /* JSON_SCANNER_H */
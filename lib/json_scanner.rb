@@ -4,6 +4,7 @@ require_relative "json_scanner/version"
 require_relative "json_scanner/json_scanner"
 
 require "json"
+require "set"
 
 # Extract values from JSON without full parsing. This gem uses the +yajl+ library
 #   to scan a JSON string and allows you to parse pieces of it.
@@ -11,84 +12,57 @@ module JsonScanner
   class Error < StandardError; end
 
   ALLOWED_OPTS = %i[verbose_error allow_comments dont_validate_strings allow_multiple_values
-                    allow_trailing_garbage allow_partial_values symbolize_path_keys symbolize_names].freeze
+                    allow_trailing_garbage allow_partial_values symbolize_path_keys symbolize_names
+                    stop_early skip_unmatched engine threads].freeze
   private_constant :ALLOWED_OPTS
-  STUB = :stub
-  private_constant :STUB
-  SCAN_OPTS = { with_path: true, with_roots_info: true }.freeze
-  private_constant :SCAN_OPTS
-  SCAN_OPTIONS = Options.new(SCAN_OPTS)
-  private_constant :SCAN_OPTIONS
+  AGGREGATES = %i[count sum min max key_histogram].freeze
+  DEFAULT_AGGREGATES = %i[count sum min max].freeze
+  private_constant :DEFAULT_AGGREGATES
 
   def self.parse(json_str, config_or_path_ary, **opts)
-    # with_path and with_roots_info is set here
+    # with_path, with_roots_info and values are set by parse_tree
     unless (extra_opts = opts.keys - ALLOWED_OPTS).empty?
       raise ArgumentError, "unknown keyword#{"s" if extra_opts.size > 1}: #{extra_opts.map(&:inspect).join(", ")}"
     end
 
     opts[:symbolize_path_keys] = opts.delete(:symbolize_names) if opts.key?(:symbolize_names)
-    results, roots = if opts.empty?
-                       scan(json_str, config_or_path_ary, SCAN_OPTIONS)
-                     else
-                       scan(json_str, config_or_path_ary, **opts, **SCAN_OPTS)
-                     end
-
-    res = process_results(json_str, results, roots, opts[:symbolize_path_keys])
+    # the tree is assembled natively, unmatched values are stubs: the symbols of their types or :stub for
+    # array elements, containers are parsed with JSON.parse
+    res = parse_tree(json_str, config_or_path_ary, opts.empty? ? nil : opts)
 
     opts[:allow_multiple_values] ? res : res.first
   end
 
-  def self.process_results(json_str, results, roots, symbolize_names)
-    # stubs are symbols, so they can be distinguished from real values
-    res = roots.map(&:first)
-    # results for different path matchers can overlap, in that case we will simply parse more than one time,
-    # but there shouln't be any surprises in the behavior
-    results.each do |result|
-      process_result(res, result, roots, json_str, symbolize_names)
+  def self.aggregate(json_str, config_or_path_ary, **opts)
+    aggregates = AGGREGATES.select { |name| opts.delete(name) }
+    aggregates = DEFAULT_AGGREGATES if aggregates.empty?
+    unless (extra_opts = opts.keys - ALLOWED_OPTS | opts.keys & [:symbolize_names]).empty?
+      raise ArgumentError, "unknown keyword#{"s" if extra_opts.size > 1}: #{extra_opts.map(&:inspect).join(", ")}"
     end
-    res
-  end
-
-  private_class_method :process_results
-
-  def self.process_result(res, result, roots, json_str, symbolize_names)
-    current_root_index = 0
-    next_root = roots[1]
-    result.each do |path, (begin_pos, end_pos, _type)|
-      while next_root && begin_pos >= next_root[1]
-        current_root_index += 1
-        next_root = roots[current_root_index + 1]
-      end
 
-      # for 'res[index]' check inside insert_value
-      res[current_root_index] = nil if res[current_root_index].is_a?(Symbol)
-      insert_value(res, parse_value(json_str, begin_pos, end_pos, symbolize_names), current_root_index, path)
-    end
+    # matches are reduced natively into a Hash per path, with_path, with_roots_info and values are set by
+    # aggregate_paths, threads are ignored
+    aggregate_paths(json_str, config_or_path_ary, aggregates, opts.empty? ? nil : opts)
   end
 
-  private_class_method :process_result
+  private_class_method :parse_tree, :aggregate_paths
 
-  def self.parse_value(json_str, begin_pos, end_pos, symbolize_names)
-    # TODO: opts for JSON.parse
-    JSON.parse(
-      json_str.byteslice(begin_pos...end_pos),
-      quirks_mode: true, symbolize_names: symbolize_names,
-    )
-  end
+  # A document indexed once to be scanned with many selectors, see Index.build
+  class Index
+    BUILD_OPTS = %i[verbose_error dont_validate_strings allow_multiple_values allow_trailing_garbage].freeze
+    private_constant :BUILD_OPTS
 
-  private_class_method :parse_value
+    def self.build(json_str, max_depth: nil, **opts)
+      unless (extra_opts = opts.keys - BUILD_OPTS).empty?
+        raise ArgumentError, "unknown keyword#{"s" if extra_opts.size > 1}: #{extra_opts.map(&:inspect).join(", ")}"
+      end
 
-  def self.insert_value(res, parsed_value, index, path)
-    until path.empty?
-      new_index = path.shift
-      res[index] ||= new_index.is_a?(Integer) ? [] : {}
-      res = res[index]
-      index = new_index
+      # the text is validated with opts first, values up to max_depth are recorded, nil for any depth
+      build_index(json_str, max_depth, opts.empty? ? nil : opts)
     end
 
-    (index - res.size).times { res.push(STUB) } if res.is_a?(Array) && res.size < index
-    res[index] = parsed_value
+    private_class_method :new, :build_index
   end
-
-  private_class_method :insert_value
 end
+
+require_relative "json_scanner/lazy_document"
@@ -0,0 +1,167 @@
+# frozen_string_literal: true
+
+module JsonScanner
+  # A JSON object or array read on demand. Children of a container are scanned the first time it's accessed,
+  #   nested containers are skipped by bracket matching and become documents of their own, so every byte is
+  #   scanned at most once however many lookups are made
+  class LazyDocument
+    ALLOWED_OPTS = %i[verbose_error dont_validate_strings].freeze
+    private_constant :ALLOWED_OPTS
+    CHILD_PATHS = Selector.new([[ANY_KEY], [ANY_INDEX]])
+    private_constant :CHILD_PATHS
+    CONTAINERS = %i[object array].freeze
+    private_constant :CONTAINERS
+    # indexes of the paths of a scan are C longs, dig doesn't look ahead past larger ones
+    MAX_INDEX = 2**31 - 1
+    private_constant :MAX_INDEX
+
+    def initialize(json_str, **opts)
+      unless (extra_opts = opts.keys - ALLOWED_OPTS).empty?
+        raise ArgumentError, "unknown keyword#{"s" if extra_opts.size > 1}: #{extra_opts.map(&:inspect).join(", ")}"
+      end
+
+      # byteslices of a frozen string share its buffer
+      @json_str = json_str.frozen? ? json_str : json_str.dup.freeze
+      @begin = 0
+      @end = @json_str.bytesize
+      # siblings of the requested value are skipped walking the structural index of the SIMD engine
+      @opts = Options.new(
+        with_path: true, with_roots_info: true, values: true, skip_unmatched: :fast, engine: :simd, **opts,
+      )
+    end
+
+    # :object or :array
+    def type
+      load_children
+      @type
+    end
+
+    def [](key)
+      children = load_children
+      if @type == :array
+        raise TypeError, "no implicit conversion of #{key.class} into Integer" unless key.is_a?(Integer)
+
+        key += children.size if key.negative?
+        return if key.negative?
+      end
+      (point = children[key]) && child(point)
+    end
+
+    def dig(key, *rest)
+      load_children(rest.empty? ? nil : [key, *rest[0...-1]])
+      value = self[key]
+      return value if rest.empty? || value.nil?
+      raise TypeError, "#{value.class} does not have #dig method" unless value.is_a?(LazyDocument)
+
+      value.dig(*rest)
+    end
+
+    def keys
+      children = load_children
+      raise TypeError, "keys of an array" unless @type == :object
+
+      children.keys
+    end
+
+    def size
+      load_children.size
+    end
+
+    # The container parsed with JSON.parse
+    def value
+      JSON.parse(@json_str.byteslice(@begin, @end - @begin))
+    end
+
+    def inspect
+      "#<#{self.class} #{@type || "unscanned"} #{@begin}...#{@end}>"
+    end
+
+    protected
+
+    def init_child(parent, begin_pos, end_pos)
+      @json_str = parent.json_str
+      @begin = begin_pos
+      @end = end_pos
+      @opts = parent.opts
+      self
+    end
+
+    attr_reader :json_str, :opts
+
+    # The children found by a scan of an ancestor, base - the offset of this container in the scanned text
+    def assign_children(type, keys_points, indexes_points, base)
+      @type = type
+      @views = {}
+      inside = base...(base + @end - @begin)
+      @children = if type == :object
+                    # keys of paths are binary strings, the ones JsonScanner.parse returns are UTF-8
+                    keys_points.each_with_object({}) do |(path, point), res|
+                      next unless inside.cover?(point[0])
+
+                      res[String.new(path.last, encoding: Encoding::UTF_8)] = rebase(point, base)
+                    end
+                  else
+                    indexes_points.map(&:last).select { |point| inside.cover?(point[0]) }.map! do |point|
+                      rebase(point, base)
+                    end
+                  end
+    end
+
+    # The point of a child dig follows, nil if there is none
+    def child_point(key)
+      @type == :object || key.is_a?(Integer) ? @children[key] : nil
+    end
+
+    def child(point)
+      begin_pos, end_pos, type, value = point
+      return value unless CONTAINERS.include?(type)
+
+      @views[begin_pos] ||= LazyDocument.allocate.init_child(self, @begin + begin_pos, @begin + end_pos)
+    end
+
+    private
+
+    # keys - the keys dig follows from this container, the children of the containers on the way are found by
+    #   the same scan, so none of them is scanned again. The keys are followed up to a negative index, the container
+    #   there is scanned when it's accessed
+    def load_children(keys = nil)
+      return @children if @children
+
+      prefix = (keys || []).take_while { |key| key.is_a?(String) || (key.is_a?(Integer) && key.between?(0, MAX_INDEX)) }
+      results, roots = JsonScanner.scan(text, prefix.empty? ? CHILD_PATHS : children_paths(prefix), @opts)
+      type = roots.first && roots.first.first
+      raise TypeError, "#{type.inspect} is not a container" unless CONTAINERS.include?(type)
+
+      assign_children(type, results[0], results[1], 0)
+      assign_descendants(prefix, results)
+      @children
+    end
+
+    def rebase(point, base)
+      base.zero? ? point : [point[0] - base, point[1] - base, *point.drop(2)]
+    end
+
+    # the root is scanned in place, points of nested containers are relative to their slices
+    def text
+      @begin.zero? && @end == @json_str.bytesize ? @json_str : @json_str.byteslice(@begin, @end - @begin)
+    end
+
+    # the children of this container and of the containers at every prefix of keys
+    def children_paths(keys)
+      (0..keys.size).flat_map { |i| [keys.first(i) + [ANY_KEY], keys.first(i) + [ANY_INDEX]] }
+    end
+
+    def assign_descendants(keys, results)
+      node = self
+      base = 0
+      keys.each_with_index do |key, i|
+        point = node.child_point(key)
+        break unless point && CONTAINERS.include?(point[2])
+
+        base += point[0]
+        node = node.child(point)
+        node.assign_children(point[2], results[2 * i + 2], results[2 * i + 3], base)
+      end
+    end
+  end
+end
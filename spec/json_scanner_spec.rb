@@ -2,6 +2,9 @@
 
 require_relative "spec_helper"
 require "json"
+require "objspace"
+require "tempfile"
+require "tmpdir"
 
 RSpec.describe JsonScanner do
   it "has a version number" do
@@ -61,6 +64,108 @@ RSpec.describe JsonScanner do
       ).to eq([[values], roots])
     end
 
+    it "supports 'stop_early'" do
+      json = '{"a": 1, "b": [1, 2, 3], "c": {"d": 4}} garbage'
+      expect(described_class.scan(json, [["a"], ["b", 1]], stop_early: true)).to eq(
+        [[[[6, 7, :number]], [[18, 19, :number]]], 19],
+      )
+      expect(described_class.scan(json, [["b", (0..1)]], stop_early: true, with_roots_info: true)).to eq(
+        [[[[15, 16, :number], [18, 19, :number]]], [[:object, 0]], 19],
+      )
+      expect(described_class.scan(json, [["b", described_class::ANY_INDEX]], stop_early: true)).to eq(
+        [[[[15, 16, :number], [18, 19, :number], [21, 22, :number]]], 23],
+      )
+      expect(described_class.scan(json, [["c", "e"]], stop_early: true)).to eq([[[]], 38])
+      expect(described_class.scan("[1, 2]", [[5]], stop_early: true)).to eq([[[]], 6])
+      expect do
+        described_class.scan(json, [["a"], ["b", 1]])
+      end.to raise_error described_class::ParseError
+      expect(
+        described_class.scan('{"a": 1} {"a": 2}', [["a"]], stop_early: true, allow_multiple_values: true),
+      ).to eq([[[[6, 7, :number], [15, 16, :number]]], 17])
+    end
+
+    it "supports 'skip_unmatched'" do
+      json = '{"a": {"x": [1, "]", "\\"["], "y": {}}, "b": [[2], 3], "c": [1, 2 3]}'
+      expect(described_class.scan(json, [["b", 1], ["a"]], skip_unmatched: :fast, with_path: true)).to eq(
+        [[[["b", 1], [50, 51, :number]]], [[["a"], [6, 37, :object]]]],
+      )
+      expect(described_class.scan(json, [["b", 0, 0]], skip_unmatched: :fast, stop_early: true)).to eq(
+        [[[[46, 47, :number]]], 47],
+      )
+      expect { described_class.scan(json, [["b", 1]]) }.to raise_error(described_class::ParseError)
+      expect { described_class.scan(json, [], skip_unmatched: :slow) }.to raise_error(ArgumentError)
+    end
+
+    it "supports 'engine'" do
+      json = "[1, {\"k\\\"\\u00e9\": [\"#{"x\\\"" * 40}\", -0.5e3, true]}, null]  "
+      [
+        [[[1, "k\"é", 0], [1, "k\"é", 1]], { with_path: true, with_roots_info: true }],
+        [[[1, described_class::ANY_KEY, (1..-1)], [2]], { stop_early: true }],
+        [[[1]], { skip_unmatched: :fast, with_path: true }],
+      ].each do |paths, opts|
+        expect(described_class.scan(json, paths, engine: :simd, **opts)).to eq(
+          described_class.scan(json, paths, **opts),
+        )
+      end
+      expect { described_class.scan("[1, 2} ", [], engine: :simd) }.to raise_error(described_class::ParseError)
+      expect { described_class.scan(json, [], engine: :fast) }.to raise_error(ArgumentError)
+    end
+
+    it "supports 'values'" do
+      json = '[1, -2.5e1, 123456789012345678901, "a\\"\\u00e9", true, null, {"k": [false]}]'
+      expected = [
+        [1, 2, :number, 1], [4, 10, :number, -25.0], [12, 33, :number, 123_456_789_012_345_678_901],
+        [35, 46, :string, "a\"\u00e9"], [48, 52, :boolean, true], [54, 58, :null, nil], [60, 74, :object, nil],
+      ]
+      [{}, { engine: :simd }].each do |opts|
+        expect(described_class.scan(json, [[described_class::ANY_INDEX]], values: true, **opts)).to eq([expected])
+      end
+      expect(described_class.scan(json, [[6, "k", 0]], values: true, with_path: true)).to eq(
+        [[[[6, "k", 0], [67, 72, :boolean, false]]]],
+      )
+      expect { described_class.scan(json, [[0]], values: true, format: :packed) }.to raise_error(ArgumentError)
+    end
+
+    it "supports 'format'" do
+      json = '[1, "ab", {"k": null}, [true]]'
+      packed = described_class.scan(json, [[described_class::ANY_INDEX], [2, "k"]], format: :packed)
+      expect(packed.map(&:to_a)).to eq(described_class.scan(json, [[described_class::ANY_INDEX], [2, "k"]]))
+      expect([packed[0].size, packed[0][-1], packed[0][4], packed[0].byteslice_for(json, 2)]).to eq(
+        [4, [23, 29, :array], nil, '{"k": null}'],
+      )
+      expect(described_class::PackedResult.new(packed[1].data).to_a).to eq([[16, 20, :null]])
+      expect { described_class.scan(json, [[0]], format: :packed, with_path: true) }.to raise_error(ArgumentError)
+      expect { described_class.scan(json, [[0]], format: :columns) }.to raise_error(ArgumentError)
+    end
+
+    it "scans newline delimited values in parallel" do
+      json_str = "#{Array.new(20_000) { |i| JSON.generate({ "id" => i, "v" => [i.to_s] }) }.join("\n")}\n"
+      selector = [["id"], ["v", described_class::ANY_INDEX]]
+      opts = { allow_multiple_values: true, with_roots_info: true }
+      expect(described_class.scan(json_str, selector, **opts, threads: 3)).to eq(
+        described_class.scan(json_str, selector, **opts),
+      )
+      expect(described_class.parse(json_str, [["id"]], allow_multiple_values: true, threads: 3).last).to eq(
+        { "id" => 19_999 },
+      )
+      pretty_str = Array.new(5_000) { |i| JSON.pretty_generate({ "id" => i, "v" => [i.to_s] }) }.join("\n")
+      expect(described_class.scan(pretty_str, selector, **opts, threads: 3)).to eq(
+        described_class.scan(pretty_str, selector, **opts),
+      )
+    end
+
+    it "can be interrupted" do
+      json = "[#{Array.new(200_000) { '{"a": [1, "x"]}' }.join(", ")}]"
+      selector = described_class::Selector.new([[described_class::ANY_INDEX, "a", 1]])
+      thread = Thread.new { loop { described_class.scan(json, selector, engine: :simd) } }
+      thread.report_on_exception = false
+      sleep 0.05
+      thread.raise(Interrupt)
+      expect { thread.join }.to raise_error(Interrupt)
+      expect(described_class.scan(json, selector).first.size).to eq(200_000)
+    end
+
     it "supports any key selector" do
       expect(
         described_class.scan(
@@ -80,6 +185,54 @@ RSpec.describe JsonScanner do
       )
     end
 
+    it "supports any depth selector" do
+      json = '{"id":1,"a":{"id":2,"b":[{"id":3}]}}'
+      ids = [[["id"], [6, 7, :number]], [["a", "id"], [18, 19, :number]], [["a", "b", 0, "id"], [31, 32, :number]]]
+      expect(
+        described_class.scan(
+          json, [[described_class::ANY_DEPTH, "id"], ["a", described_class::ANY_DEPTH, described_class::ANY_INDEX]],
+          with_path: true,
+        ),
+      ).to eq([ids, [[["a", "b", 0], [25, 33, :object]]]])
+      expect(
+        described_class.scan(json, [[described_class::ANY_DEPTH, "id"]], skip_unmatched: :fast, engine: :simd),
+      ).to eq([ids.map(&:last)])
+      expect(described_class.scan("[[1]]", [[described_class::ANY_DEPTH]])).to eq(
+        [[[2, 3, :number], [1, 4, :array], [0, 5, :array]]],
+      )
+      deep = ("[" * 5000) + ("]" * 5000)
+      expect(described_class.scan(deep, [[described_class::ANY_DEPTH, 0]]).first.size).to eq(4999)
+    end
+
+    it "supports predicates" do
+      json = '{"items": [{"price": 10}, {"price": "n/a"}, {"price": 2.5e1}], ' \
+             '"types": ["purchase", "pur\\u0063hase", "view"]}'
+      price = ["items", described_class::ANY_INDEX, "price"]
+      paths = [price + [{ type: :number }], price + [{ in: (0...20) }], price + [{ eq: 25 }]]
+      expect(described_class.scan(json, paths)).to eq(
+        [[[21, 23, :number], [54, 59, :number]], [[21, 23, :number]], [[54, 59, :number]]],
+      )
+      [{}, { engine: :simd }].each do |opts|
+        expect(described_class.scan(json, [["types", described_class::ANY_INDEX, { eq: "purchase" }]], **opts)).to eq(
+          [[[73, 83, :string], [85, 100, :string]]],
+        )
+      end
+      expect(described_class.parse(json, [price + [{ type: :number, in: (20..Float::INFINITY) }]])).to eq(
+        { "items" => [:stub, :stub, { "price" => 25.0 }] },
+      )
+      expect { described_class.scan(json, [[{ eq: [] }]]) }.to raise_error(ArgumentError)
+    end
+
+    it "compares large integers in predicates exactly" do
+      json = "[9223372036854775806, 9223372036854775807, 18446744073709551617, 1e2, -0]"
+      paths = [2**63 - 1, 18_446_744_073_709_551_616, 100, 0].map { |eq| [described_class::ANY_INDEX, { eq: eq }] }
+      [{}, { engine: :simd }].each do |opts|
+        expect(described_class.scan(json, paths, **opts)).to eq(
+          [[[22, 41, :number]], [], [[65, 68, :number]], [[70, 72, :number]]],
+        )
+      end
+    end
+
     it "works with max path len correctly" do
       expect(
         described_class.scan('{"a": [1]}', [[], ["a"]]),
@@ -193,13 +346,34 @@ RSpec.describe JsonScanner do
     end
 
     it "allows to pass options as a hash" do
+      options = { with_path: true }
       expect(
-        described_class.scan("[1]", [[0]], { with_path: true }),
+        described_class.scan("[1]", [[0]], options),
       ).to eq(
         [
           [[[0], [1, 2, :number]]],
         ],
       )
+      expect(options).to eq({ with_path: true })
+    end
+
+    it "handles escape sequences" do
+      json = '{"a\\n": {"b\\"": "x\\ry"}, "c\\u0041": ["\\\\", "\\\\\\""]}'
+      expect(described_class.scan(json, [[described_class::ANY_KEY, described_class::ANY_KEY]], with_path: true)).to eq(
+        [[[["a\n", "b\""], [16, 22, :string]]]],
+      )
+      expect(
+        described_class.scan(json, [[described_class::ANY_KEY, described_class::ANY_INDEX]], with_path: true),
+      ).to eq([[[["cA", 0], [37, 41, :string]], [["cA", 1], [43, 49, :string]]]])
+    end
+
+    it "supports sets of keys" do
+      json = '{"a": {"x": 1}, "b": {"x": 2}, "c": {"x": 3}, "d": 4}'
+      expect(described_class.scan(json, [[Set["a", :c, "a"], "x"]], with_path: true)).to eq(
+        [[[["a", "x"], [12, 13, :number]], [["c", "x"], [42, 43, :number]]]],
+      )
+      expect(described_class.scan(json, [[Set[], "x"], [Set["d", "e"]]])).to eq([[], [[51, 52, :number]]])
+      expect { described_class.scan(json, [[Set["a", 1]]]) }.to raise_error ArgumentError
     end
 
     it "allows to configure yajl" do
@@ -326,6 +500,60 @@ RSpec.describe JsonScanner do
     end
   end
 
+  describe ".scan_file" do
+    it "scans files" do
+      json = '{"a": [1, "x\\ny", {"b": null}]}'
+      Tempfile.create("json_scanner") do |file|
+        file.write(json)
+        file.flush
+        selector = [["a", described_class::ANY_INDEX], ["a", 2, "b"]]
+        expect(described_class.scan_file(file.path, selector, with_path: true)).to eq(
+          described_class.scan(json, selector, with_path: true),
+        )
+        expect(described_class.scan_file(file.path, [["a", 0]], stop_early: true)).to eq([[[[7, 8, :number]]], 8])
+      end
+    end
+
+    it "raises system errors" do
+      expect { described_class.scan_file("/nonexistent/file.json", [[]]) }.to raise_error(Errno::ENOENT)
+    end
+
+    it "scans pipes written by another thread" do
+      skip "no mkfifo" unless File.respond_to?(:mkfifo)
+
+      Dir.mktmpdir("json_scanner") do |dir|
+        path = File.join(dir, "fifo")
+        File.mkfifo(path)
+        writer = Thread.new { File.open(path, "w") { |io| io.write('{"a": [1, 2]}') } }
+        expect(described_class.scan_file(path, [["a", 1]])).to eq([[[10, 11, :number]]])
+        writer.join
+      end
+    end
+  end
+
+  describe ".scan_many" do
+    it "scans documents in order" do
+      json_strs = Array.new(50) { |i| JSON.generate({ "a" => Array.new(i % 5) { |j| j }, "b" => i }) }
+      json_strs[7] = '{"a": [1'
+      selector = JsonScanner::Selector.new([["a", described_class::ANY_INDEX], ["b"]])
+      [{}, { with_path: true, with_roots_info: true }, { engine: :simd, stop_early: true }].each do |opts|
+        expected = json_strs.map do |json_str|
+          begin
+            described_class.scan(json_str, selector, **opts)
+          rescue described_class::ParseError => e
+            [e.class, e.bytes_consumed]
+          end
+        end
+        result = described_class.scan_many(json_strs, selector, **opts, threads: 3).map do |res|
+          res.is_a?(described_class::ParseError) ? [res.class, res.bytes_consumed] : res
+        end
+        expect(result).to eq(expected)
+      end
+      expect(described_class.scan_many([], [[]])).to eq([])
+      expect { described_class.scan_many(["[]"], [[]], threads: 0) }.to raise_error(ArgumentError)
+    end
+  end
+
   describe ".parse" do
     it "extracts values" do
       expect(
@@ -344,6 +572,12 @@ RSpec.describe JsonScanner do
       )
     end
 
+    it "supports 'stop_early'" do
+      expect(
+        described_class.parse('{"a": 1, "b": [1, 2, 3]} garbage', [["b", 1]], stop_early: true),
+      ).to eq({ "b" => [:stub, 2] })
+    end
+
     it "handles borders correctly" do
       expect(
         described_class.parse("[]{}42", [[]], allow_multiple_values: true),
@@ -366,6 +600,73 @@ RSpec.describe JsonScanner do
         [{}, 2, []],
       )
     end
+
+    it "fills skipped elements of nested arrays and shared paths" do
+      expect(
+        described_class.parse("[[0, 1], [2, [3, 4]], 5]", [[2], [1, 1, 1], [1, 1, 1]]),
+      ).to eq(
+        [:stub, [:stub, [:stub, 4]], 5],
+      )
+      expect(
+        described_class.parse('{"é": [{"ключ": 1}]}', [["é", 0, "ключ"]], symbolize_names: true),
+      ).to eq({ "é": [{ "ключ": 1 }] })
+      expect(described_class.parse('{"é": {"a": 1}}', [["é"], ["é", "a"]])).to eq({ "é" => { "a" => 1 } })
+    end
+  end
+
+  describe ".aggregate" do
+    it "accumulates matches" do
+      json = '{"items": [{"price": 10, "sku": "a"}, {"price": 2.5, "qty": 3}, {"price": "n/a"}]}'
+      item = ["items", described_class::ANY_INDEX]
+      expect(described_class.aggregate(json, [item + ["price"], ["total"]])).to eq(
+        [{ count: 3, sum: 12.5, min: 2.5, max: 10 }, { count: 0, sum: 0, min: nil, max: nil }],
+      )
+      keys = [item + [described_class::ANY_KEY]]
+      expect(described_class.aggregate(json, keys, key_histogram: true, symbolize_path_keys: true)).to eq(
+        [{ key_histogram: { price: 3, sku: 1, qty: 1 } }],
+      )
+      expect(
+        described_class.aggregate("[9223372036854775807, 9223372036854775807, 1.5]", [[0..1]], sum: true, max: true),
+      ).to eq([{ sum: 18_446_744_073_709_551_614, max: 9_223_372_036_854_775_807 }])
+      expect(
+        described_class.aggregate(json, [item + ["price", { type: :number }]], count: true, stop_early: true),
+      ).to eq([{ count: 2 }])
+      expect { described_class.aggregate(json, [[]], with_path: true) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe ".allocation_counts" do
+    it "counts the memory allocated by the scans of the thread" do
+      json = '{"a": [1, "x", {"b": 2}], "c": "a string"}'
+      selector = described_class::Selector.new([["a", (0..-1)], ["c"]])
+      3.times { described_class.scan(json, selector, with_path: true) }
+      before = described_class.allocation_counts
+      10.times { described_class.scan(json, selector, with_path: true) }
+      after = described_class.allocation_counts
+      expect(after[:scans] - before[:scans]).to eq(10)
+      expect(after[:yajl_allocs] > before[:yajl_allocs]).to be(true)
+      expect(after[:mallocs]).to eq(before[:mallocs])
+      expect(Thread.new { described_class.allocation_counts }.value).to eq({ scans: 0, yajl_allocs: 0, mallocs: 0 })
+    end
+  end
+
+  describe ".last_stats" do
+    it "reports the last scan of the thread made with stats" do
+      json = '{"a": [1, 2, {"b": "x"}], "c": {"d": [[1]]}, "e": null}'
+      described_class.scan(json, [["a", described_class::ANY_INDEX], %w[c d]], stats: true)
+      stats = described_class.last_stats
+      expect(stats[:tokens]).to eq({ null: 1, boolean: 0, number: 3, string: 1, key: 5, object: 3, array: 3 })
+      expect(stats.values_at(:bytes, :max_depth, :deep_containers, :points)).to eq([json.bytesize, 4, 1, 4])
+      expect(stats.values_at(:comparisons, :ruby_objects, :lexing_time, :matching_time).none?(&:nil?)).to be(true)
+      described_class.scan(json, [["e"]], stats: true, skip_unmatched: :fast)
+      expect(described_class.last_stats.values_at(:skipped_containers, :points)).to eq([2, 1])
+    end
+
+    it "is nil without scans with stats" do
+      expect(Thread.new { described_class.scan("[1]", [[0]]) && described_class.last_stats }.value).to be_nil
+      index = described_class::Index.build("[1]")
+      expect { index.scan([[0]], stats: true) }.to raise_error(ArgumentError)
+    end
   end
 
   describe described_class::Selector do
@@ -387,6 +688,33 @@ RSpec.describe JsonScanner do
       ).to eq([[[[0, 19, :object]], [[16, 18, :number]]]])
     end
 
+    it "matches paths with common prefixes" do
+      conf = described_class.new(
+        [
+          ["a", "b"], ["a", JsonScanner::ANY_KEY], [JsonScanner::ANY_KEY, "b"], ["a", "b"],
+          ["c", 1], ["c", (0..1)], ["c", JsonScanner::ANY_INDEX], ["c", 1, "d"],
+        ],
+      )
+      expect(JsonScanner.scan('{"a": {"b": 1, "x": 2}, "c": [0, {"d": 3}, 4]}', conf)).to eq(
+        [
+          [[12, 13, :number]], [[12, 13, :number], [20, 21, :number]], [[12, 13, :number]], [[12, 13, :number]],
+          [[33, 41, :object]], [[30, 31, :number], [33, 41, :object]],
+          [[30, 31, :number], [33, 41, :object], [43, 44, :number]], [[39, 40, :number]],
+        ],
+      )
+    end
+
+    it "can be shared between threads" do
+      json_str = JSON.generate(Array.new(10_000) { |i| { "a" => i, "b" => [i, "x" * 5] } })
+      conf = described_class.new [[JsonScanner::ANY_INDEX, "a"], [JsonScanner::ANY_INDEX, "b", 1]]
+      expected = JsonScanner.scan(json_str, conf, with_path: true)
+      results = Array.new(4) do
+        Thread.new { Array.new(5) { JsonScanner.scan(json_str, conf, with_path: true) } }
+      end.flat_map(&:value)
+      expect(results.uniq).to eq([expected])
+      expect(JsonScanner.scan(json_str, conf, engine: :simd, with_path: true)).to eq(expected)
+    end
+
     it "re-raises exceptions" do
       expect do
         described_class.new [[(0...-1)]]
@@ -399,10 +727,79 @@ RSpec.describe JsonScanner do
       end.to raise_error ArgumentError
     end
 
+    it "compiles JSONPath and JSON Pointer expressions" do
+      expect(described_class.compile(["$.data.items[*].price", "$.meta['a', \"b\"]", "$..id"]).inspect).to eq(
+        "#<JsonScanner::Selector [['data', 'items', (0..-1), 'price'], ['meta', {'a', 'b'}], [('**'..'**'), 'id']]>",
+      )
+      expect(described_class.compile(["$", "$.a.*[1][2:][:2]", "/a~1b/0/~0/01", "", "/"]).inspect).to eq(
+        "#<JsonScanner::Selector [[], ['a', ('*'..'*'), 1, (2..-1), (0..1)], ['a/b', ('0'|0), '~', '01'], [], ['']]>",
+      )
+      expect(described_class.compile("$.a")).to be(described_class.compile(+"$.a"))
+      expect(JsonScanner.scan('{"a": [1, 2]}', described_class.compile("/a/1"))).to eq([[[10, 11, :number]]])
+      ["$a", "$[-1]", "$[0,1]", "$[::2]", "$['a", "/~2", "a", "$.a b", "$.1a", "$.a-b"].each do |expr|
+        expect { described_class.compile(expr) }.to raise_error(ArgumentError)
+      end
+    end
+
+    it "matches JSON Pointer tokens of digits as keys and indexes" do
+      json = '{"responses": {"200": [1, 2], "01": 3}, "list": [{"0": 4}]}'
+      selector = described_class.compile(["/responses/200/1", "/responses/01", "/list/0/0", "/list/00"])
+      expect(JsonScanner.scan(json, selector)).to eq(
+        [[[26, 27, :number]], [[36, 37, :number]], [[55, 56, :number]], []],
+      )
+    end
+
+    it "doesn't allocate compiling a cached expression" do
+      exprs = ["$.cached", +"/cached/0", ["$.a", "$.b"]]
+      compiler = described_class
+      # the first round compiles them
+      allocations = Array.new(2) do
+        allocated = GC.stat(:total_allocated_objects)
+        exprs.each { |expr| compiler.compile(expr) }
+        GC.stat(:total_allocated_objects) - allocated
+      end
+      expect(allocations.last).to eq(0)
+    end
+
+    it "evicts least recently used compiled selectors" do
+      first = described_class.compile("$.first")
+      second = described_class.compile("$.second")
+      (described_class::CACHE_SIZE - 2).times { |i| described_class.compile("$.other#{i}") }
+      expect(described_class.compile("$.first")).to be(first)
+      described_class.compile("$.last")
+      expect(described_class.compile("$.first")).to be(first)
+      expect(described_class.compile("$.second")).not_to be(second)
+    end
+
+    it "is frozen and shared by concurrent scans" do
+      selector = described_class.new([["a", JsonScanner::ANY_INDEX], [JsonScanner::ANY_DEPTH, "id"]])
+      json = "{\"a\": [#{Array.new(30_000) { |i| "{\"id\": #{i}}" }.join(", ")}]}"
+      expected = JsonScanner.scan(json, selector, with_path: true)
+      results = Array.new(4) { Thread.new { JsonScanner.scan(json, selector, with_path: true) } }.map(&:value)
+      expect([selector.frozen?, JsonScanner::Options.new(with_path: true).frozen?]).to eq([true, true])
+      expect(results.uniq).to eq([expected])
+      next unless defined?(Ractor)
+
+      experimental = Warning[:experimental]
+      Warning[:experimental] = false
+      ractor = Ractor.new(selector) { |sel| JsonScanner.scan('{"a": [{"id": 1}]}', sel) }
+      Warning[:experimental] = experimental
+      expect(Ractor.shareable?(selector)).to be(true)
+      expect(ractor.respond_to?(:value) ? ractor.value : ractor.take).to eq([[[7, 16, :object]], [[14, 15, :number]]])
+    end
+
     it "supports inspect" do
       expect(
         described_class.new([[], ["abracadabra", JsonScanner::ANY_INDEX], [42, JsonScanner::ANY_KEY]]).inspect,
       ).to eq("#<JsonScanner::Selector [[], ['abracadabra', (0..-1)], [42, ('*'..'*')]]>")
+      expect(described_class.new([["a", Set["b", :c]]]).inspect).to eq("#<JsonScanner::Selector [['a', {'b', 'c'}]]>")
+      expect(described_class.new([[JsonScanner::ANY_DEPTH, "id"]]).inspect).to eq(
+        "#<JsonScanner::Selector [[('**'..'**'), 'id']]>",
+      )
+      predicates = [["a", { type: %i[number string], eq: 2.5, in: (1...3) }], [{ eq: "x" }]]
+      expect(described_class.new(predicates).inspect).to eq(
+        "#<JsonScanner::Selector [['a', {type: [:number, :string], eq: 2.5, in: (1...3)}], [{eq: 'x'}]]>",
+      )
     end
   end
 
@@ -421,4 +818,178 @@ RSpec.describe JsonScanner do
       ).to eq("#<JsonScanner::Options {allow_trailing_garbage: true, allow_partial_values: true}>")
     end
   end
+
+  describe described_class::StreamScanner do
+    it "scans chunks" do
+      scanner = described_class.new([["data", JsonScanner::ANY_INDEX, "id"]], with_path: true)
+      expect(scanner.feed('{"data": [{"id": 1}, {"i')).to eq([[[["data", 0, "id"], [17, 18, :number]]]])
+      expect(scanner << 'd": 22}, ').to be(scanner)
+      expect(scanner.feed('{"id": "3"}]}')).to eq(
+        [[[["data", 1, "id"], [28, 30, :number]], [["data", 2, "id"], [40, 43, :string]]]],
+      )
+      expect(scanner.finish).to eq([[]])
+      expect(scanner.bytes_consumed).to eq(46)
+    end
+
+    it "can't be fed after finish" do
+      scanner = described_class.new([[0]])
+      scanner << "[1]"
+      expect(scanner.finished?).to be(false)
+      expect(scanner.finish).to eq([[[1, 2, :number]]])
+      expect(scanner.finished?).to be(true)
+      expect { scanner.feed("1") }.to raise_error(RuntimeError)
+    end
+
+    it "returns the same results as scan for any chunks" do
+      json = '[{"a\\n": "x\\"y", "b": [1, 22, "\\\\"]}, {"a\\n": null, "b": {"c": -1.5e3}}]'
+      selector = JsonScanner::Selector.new([[JsonScanner::ANY_INDEX, JsonScanner::ANY_KEY], [0, "b", 2], []])
+      expected = JsonScanner.scan(json, selector, with_path: true, with_roots_info: true)
+      [1, 2, 3, 7].each do |chunk_size|
+        scanner = described_class.new(selector, with_path: true, with_roots_info: true)
+        json.bytes.each_slice(chunk_size) { |chunk| scanner << chunk.pack("C*") }
+        expect(scanner.finish).to eq(expected)
+      end
+    end
+
+    it "supports 'stop_early'" do
+      scanner = described_class.new([["meta"]], stop_early: true)
+      expect(scanner.feed('{"meta": {"v": 1}, "data": [')).to eq([[[9, 17, :object]]])
+      expect(scanner.finished?).to be(true)
+      expect(scanner.feed("garbage")).to eq([[]])
+      expect(scanner.finish).to eq([[]])
+      expect(scanner.bytes_consumed).to eq(17)
+    end
+
+    it "includes bytes consumed in the exception" do
+      scanner = described_class.new([[0]])
+      scanner << "[[1,2],"
+      expect do
+        scanner.feed(",[3,4]]")
+      end.to(
+        raise_error(JsonScanner::ParseError) do |exc|
+          expect(exc.bytes_consumed).to eq(8)
+        end,
+      )
+    end
+
+    it "resumes from a checkpoint" do
+      json = '[{"id": 1}, {"id": 2}, {"id": 3}]'
+      scanner = described_class.new([[JsonScanner::ANY_INDEX, "id"]], with_path: true)
+      scanner << json.byteslice(0, 25)
+      checkpoint = scanner.checkpoint
+      expect(checkpoint).to eq({ offset: 21, path: [1], starts: [0], roots: 0, done_nodes: [] })
+      resumed = described_class.new([[JsonScanner::ANY_INDEX, "id"]], with_path: true, resume_from: checkpoint)
+      expect(resumed.feed(json.byteslice(21, json.bytesize))).to eq([[[[2, "id"], [30, 31, :number]]]])
+      expect(resumed.finish).to eq([[]])
+      # stored as JSON
+      checkpoint = JSON.parse(JSON.generate(checkpoint))
+      expect(JsonScanner.scan(json, [[JsonScanner::ANY_INDEX]], resume_from: checkpoint)).to eq([[[23, 32, :object]]])
+    end
+
+    it "stops where the uninterrupted scan stops when resumed with stop_early" do
+      json = '[true, {}, true, "\u00e9", [1]]'
+      full = JsonScanner.scan(json, [[1]], stop_early: true)
+      expect(full).to eq([[[[7, 9, :object]]], 9])
+      checkpoints = [6, json.bytesize].map do |len|
+        scanner = described_class.new([[1]], stop_early: true)
+        scanner << json.byteslice(0, len)
+        scanner.checkpoint
+      end
+      resumed = checkpoints.map { |checkpoint| JsonScanner.scan(json, [[1]], stop_early: true, resume_from: checkpoint) }
+      expect([checkpoints.map { |checkpoint| checkpoint[:offset] }, resumed]).to eq([[5, 9], [full, [[[]], 9]]])
+      resumed = described_class.new([[1]], stop_early: true, resume_from: checkpoints.last)
+      expect([resumed.feed(json.byteslice(9, json.bytesize)), resumed.bytes_consumed, resumed.finished?]).to eq(
+        [[[]], 9, true],
+      )
+    end
+
+    it "checkpoints between newline delimited values" do
+      scanner = described_class.new([["id"]], allow_multiple_values: true)
+      scanner << %({"id": 1}\n{"id": 2}\n{"i)
+      checkpoint = scanner.checkpoint
+      expect(checkpoint).to eq({ offset: 19, path: [], starts: [], roots: 2, done_nodes: [] })
+      resumed = described_class.new([["id"]], allow_multiple_values: true, resume_from: checkpoint)
+      expect(resumed.feed(%(\n{"id": 3}\n))).to eq([[[27, 28, :number]]])
+      expect(resumed.checkpoint).to eq({ offset: 29, path: [], starts: [], roots: 3, done_nodes: [] })
+      expect { JsonScanner.scan("[]", [["id"]], resume_from: checkpoint) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe described_class::Index do
+    it "answers selectors with the results of scan" do
+      json = JSON.generate({ "data" => { "items" => Array.new(20) { |i| { "id" => i, "tags" => ["a\nb", i] } } },
+                             "meta" => { "total" => 20 } })
+      selectors = ["$.meta.total", "$.data.items[2:4].id", "$..tags[0]", "$.data.*"].map do |expr|
+        JsonScanner::Selector.compile(expr)
+      end
+      opts = { with_path: true, values: true }
+      results = [nil, 0, 2].map do |max_depth|
+        index = described_class.build(json, max_depth: max_depth)
+        selectors.map { |sel| index.scan(sel, opts) == JsonScanner.scan(json, sel, **opts) }
+      end
+      expect(results.flatten.uniq).to eq([true])
+      index = described_class.build(json, max_depth: 2)
+      expect(index.scan([%w[meta total]], stop_early: true)).to eq(
+        JsonScanner.scan(json, [%w[meta total]], stop_early: true),
+      )
+      expect(index.inspect).to eq("#<JsonScanner::Index nodes: 5, max_depth: 2>")
+      expect(index.frozen?).to be(true)
+      expect(ObjectSpace.memsize_of(index) > ObjectSpace.memsize_of(described_class.build("[]"))).to be(true)
+    end
+
+    it "validates the text when it's built" do
+      expect { described_class.build("[1, 2") }.to raise_error(JsonScanner::ParseError)
+      expect { described_class.build("[1, 2] 3") }.to raise_error(JsonScanner::ParseError)
+      index = described_class.build("[1, 2] [3]", allow_multiple_values: true)
+      expect(index.scan([[0]], with_roots_info: true)).to eq(
+        JsonScanner.scan("[1, 2] [3]", [[0]], allow_multiple_values: true, with_roots_info: true),
+      )
+      expect { described_class.build("[]", with_path: true) }.to raise_error(ArgumentError)
+    end
+
+    it "splits adjacent top-level scalars the way scan does" do
+      %w[1false truefalse null1 1.5true -1null 0e5null].each do |json|
+        index = described_class.build(json, allow_multiple_values: true)
+        expect(index.scan([[]])).to eq(JsonScanner.scan(json, [[]], allow_multiple_values: true))
+      end
+    end
+  end
+
+  describe described_class::LazyDocument do
+    it "digs values scanning every container once" do
+      json = JSON.generate({ "data" => [{ "id" => 1, "tags" => ["a\nb"] }, { "id" => 2.5, "x" => nil }], "ok" => true })
+      doc = described_class.new(json)
+      expect([doc.type, doc.keys, doc.size, doc["ok"], doc["missing"]]).to eq([:object, %w[data ok], 2, true, nil])
+      expect([doc.dig("data", 0, "tags", 0), doc.dig("data", -1, "id"), doc.dig("data", 1, "x", "y")]).to eq(
+        ["a\nb", 2.5, nil],
+      )
+      expect(doc["data"]).to be(doc["data"])
+      expect(doc.dig("data", 1).value).to eq({ "id" => 2.5, "x" => nil })
+      expect { doc.dig("data", "id") }.to raise_error(TypeError)
+    end
+
+    it "finds the containers dig goes through with one scan" do
+      json = JSON.generate({ "a" => { "b" => [[1, { "c" => [true, "x"] }]], "b2" => {} }, "d" => [[2]] })
+      doc = described_class.new(json)
+      scans = -> { JsonScanner.allocation_counts[:scans] }
+      before = scans.call
+      expect([doc.dig("a", "b", 0, 1, "c", 1), doc.dig("a", "b", 0, 0), doc["a"].keys]).to eq(["x", 1, %w[b b2]])
+      expect([doc.dig("a", "b", 0, 1, "c").size, scans.call - before]).to eq([2, 1])
+      expect([doc.dig("d", -1, 0), doc.dig("a", "b", 0, 1, "c").value, scans.call - before]).to eq([2, [true, "x"], 3])
+    end
+
+    it "reads non-ASCII keys as UTF-8" do
+      doc = described_class.new(%({"\u00e9": 1, "a": {"\\u00e9": [2]}}))
+      expect([doc["\u00e9"], doc.dig("a", "\u00e9", 0), doc.keys]).to eq([1, 2, ["\u00e9", "a"]])
+      expect(doc.keys.map(&:encoding)).to eq([Encoding::UTF_8, Encoding::UTF_8])
+    end
+
+    it "checks containers when they're accessed" do
+      doc = described_class.new('{"a": [1, 2 3], "b": {}}')
+      expect([doc["b"].size, doc["b"].keys]).to eq([0, []])
+      expect { doc["a"].size }.to raise_error(JsonScanner::ParseError)
+      expect { described_class.new("42").size }.to raise_error(TypeError)
+      expect { described_class.new("[]", with_path: true) }.to raise_error(ArgumentError)
+    end
+  end
 end